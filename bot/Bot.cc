@@ -0,0 +1,474 @@
+#include "game/Client.hh"
+#include "game/Sim.hh"
+#include "game/SimComponents.hh"
+#include "common/ENetPool.hh"
+#include "server/Worker.hh"
+
+#include <enet/enet.h>
+#include <entityx/entityx.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <cassert>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <deque>
+#include <vector>
+#include <string>
+
+// Headless load generator: a number of bots connect to the server, each
+// running its own simulation and issuing random orders, and statistics
+// about tick pacing, order latency and traffic are printed periodically.
+//
+// With "loopback" as the host, the bots play one match on a server in
+// this process instead, without going through the network.
+
+typedef std::chrono::steady_clock Clock;
+
+struct BotConfig {
+    // Host name, or LOOPBACK_HOST
+    std::string host;
+    int port;
+
+    size_t numBots;
+
+    // Orders tried per second by each bot
+    double ordersPerSecond;
+
+    // Stop after this many seconds, or never if zero
+    double durationS;
+
+    double reportIntervalS;
+    double frameRate;
+};
+
+static const char *LOOPBACK_HOST = "loopback";
+
+// Orders that have not been run after this long are counted as lost
+static const double ORDER_TIMEOUT_S = 10.0;
+
+static double toMs(Clock::duration duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// Samples of a latency in milliseconds
+struct Samples {
+    std::vector<double> values;
+
+    void add(double value) {
+        values.push_back(value);
+    }
+
+    void print(std::ostream &out, const char *name) {
+        out << name << ":";
+
+        if (values.empty()) {
+            out << " -" << std::endl;
+            return;
+        }
+
+        std::sort(values.begin(), values.end());
+
+        const double percentiles[] = { 50, 90, 99 };
+        for (double p : percentiles) {
+            size_t i = static_cast<size_t>(p / 100.0 * (values.size() - 1));
+            out << " p" << p << "=" << values[i] << "ms";
+        }
+
+        out << " max=" << values.back() << "ms"
+            << " (" << values.size() << " samples)" << std::endl;
+    }
+};
+
+// Statistics of all bots since the last report
+struct BotStats {
+    Samples roundTrip;
+    Samples tickInterval;
+    Samples orderLatency;
+
+    size_t ordersTried;
+    size_t ordersSent;
+    size_t ordersRun;
+    size_t ordersInvalid;
+    size_t ordersLost;
+
+    size_t bytesSent, bytesReceived;
+    size_t packetsSent, packetsReceived;
+
+    // By message and order type, without ENet's overhead
+    MessageTraffic sent, received;
+
+    BotStats() {
+        reset();
+    }
+
+    void reset() {
+        roundTrip.values.clear();
+        tickInterval.values.clear();
+        orderLatency.values.clear();
+
+        ordersTried = ordersSent = ordersRun = 0;
+        ordersInvalid = ordersLost = 0;
+
+        bytesSent = bytesReceived = 0;
+        packetsSent = packetsReceived = 0;
+
+        sent.reset();
+        received.reset();
+    }
+
+    void print(std::ostream &out, double intervalS, size_t numBots) {
+        out << "--- " << numBots << " bots, last " << intervalS << "s"
+            << std::endl;
+
+        roundTrip.print(out, "round trip");
+        tickInterval.print(out, "tick interval");
+        orderLatency.print(out, "order to execution");
+
+        out << "orders: " << ordersTried << " tried, "
+            << ordersSent << " sent, "
+            << ordersRun << " run (" << ordersInvalid << " invalid), "
+            << ordersLost << " lost" << std::endl;
+
+        double perBot = intervalS * std::max<size_t>(numBots, 1);
+        out << "per bot: up " << bytesSent / perBot << " B/s, "
+            << packetsSent / perBot << " packets/s; down "
+            << bytesReceived / perBot << " B/s, "
+            << packetsReceived / perBot << " packets/s" << std::endl;
+
+        out << "sent:" << std::endl;
+        sent.print(out);
+        out << "received:" << std::endl;
+        received.print(out);
+    }
+};
+
+static bool sameOrder(const Order &a, const Order &b) {
+    if (a.type != b.type || a.player != b.player)
+        return false;
+
+    switch (a.type) {
+    case Order::BUILD:
+        return a.build.objectId == b.build.objectId
+               && a.build.type == b.build.type
+               && a.build.x == b.build.x
+               && a.build.y == b.build.y;
+    case Order::CONSTRUCT:
+        return a.construct.queue == b.construct.queue
+               && a.construct.from == b.construct.from
+               && a.construct.to == b.construct.to;
+    case Order::ATTACK:
+        return a.attack.objectId == b.attack.objectId
+               && a.attack.x == b.attack.x
+               && a.attack.y == b.attack.y;
+    case Order::RAISE_MAP:
+        return a.raiseMap.x == b.raiseMap.x
+               && a.raiseMap.y == b.raiseMap.y
+               && a.raiseMap.w == b.raiseMap.w
+               && a.raiseMap.h == b.raiseMap.h;
+    default:
+        return false;
+    }
+}
+
+// One connection to the server, driven by the same Client as the game
+struct Bot : entityx::Receiver<Bot> {
+    Bot(const std::string &name, BotStats &stats, uint32_t seed)
+        : client(name), stats(stats), random(seed), subscribed(false),
+          ordersDue(0), ticksRun(0), lastBytesSent(0), lastBytesReceived(0),
+          lastPacketsSent(0), lastPacketsReceived(0) {
+    }
+
+    void connect(const std::string &host, int port) {
+        client.connect(host, port);
+    }
+
+    void connect(LoopbackHost &host) {
+        client.connect(host);
+    }
+
+    void update(double dt, double ordersPerSecond, Clock::time_point now) {
+        client.update(dt);
+
+        if (!client.isStarted())
+            return;
+
+        if (!subscribed) {
+            client.getSim().getEvents().subscribe<OrderRun>(*this);
+            lastTickTime = now;
+            subscribed = true;
+        }
+
+        size_t ticks = client.getTicksReceived() - client.getNumQueuedTicks();
+        for (; ticksRun < ticks; ticksRun++) {
+            stats.tickInterval.add(toMs(now - lastTickTime));
+            stats.roundTrip.add(client.getConnection()->getRoundTripTime());
+            lastTickTime = now;
+        }
+
+        ordersDue += ordersPerSecond * dt;
+        for (; ordersDue >= 1.0; ordersDue -= 1.0) {
+            Order order;
+            randomOrder(order);
+            stats.ordersTried++;
+
+            if (client.order(order)) {
+                order.player = client.getPlayerId();
+                pendingOrders.push_back(std::make_pair(order, now));
+                stats.ordersSent++;
+            }
+        }
+
+        while (!pendingOrders.empty()
+               && toMs(now - pendingOrders.front().second)
+                  > ORDER_TIMEOUT_S * 1000.0) {
+            pendingOrders.pop_front();
+            stats.ordersLost++;
+        }
+    }
+
+    // Adds the traffic since the last call to the statistics
+    void sampleTraffic() {
+        stats.sent.add(client.getSentTraffic());
+        stats.received.add(client.getReceivedTraffic());
+        client.resetTraffic();
+
+        const ENetHost *host = client.getHost();
+        if (!host)
+            return;
+
+        stats.bytesSent += host->totalSentData - lastBytesSent;
+        stats.bytesReceived += host->totalReceivedData - lastBytesReceived;
+        stats.packetsSent += host->totalSentPackets - lastPacketsSent;
+        stats.packetsReceived += host->totalReceivedPackets
+                                 - lastPacketsReceived;
+
+        lastBytesSent = host->totalSentData;
+        lastBytesReceived = host->totalReceivedData;
+        lastPacketsSent = host->totalSentPackets;
+        lastPacketsReceived = host->totalReceivedPackets;
+    }
+
+    void receive(const OrderRun &event) {
+        if (event.order.player != client.getPlayerId())
+            return;
+
+        for (auto it = pendingOrders.begin(); it != pendingOrders.end(); ++it) {
+            if (sameOrder(it->first, event.order)) {
+                stats.orderLatency.add(toMs(Clock::now() - it->second));
+                stats.ordersRun++;
+                if (!event.valid)
+                    stats.ordersInvalid++;
+
+                pendingOrders.erase(it);
+                return;
+            }
+        }
+    }
+
+private:
+    Client client;
+    BotStats &stats;
+
+    std::mt19937 random;
+
+    bool subscribed;
+    double ordersDue;
+
+    size_t ticksRun;
+    Clock::time_point lastTickTime;
+
+    // Orders sent but not run yet, oldest first
+    std::deque<std::pair<Order, Clock::time_point>> pendingOrders;
+
+    enet_uint32 lastBytesSent, lastBytesReceived;
+    enet_uint32 lastPacketsSent, lastPacketsReceived;
+
+    uint16_t randomCoord(size_t size) {
+        return static_cast<uint16_t>(random() % size);
+    }
+
+    // Picks one of BUILD, CONSTRUCT, ATTACK and RAISE_MAP, with targets
+    // taken from our own buildings where needed
+    void randomOrder(Order &order) {
+        Sim &sim(client.getSim());
+        const Map &map(sim.getState().getMap());
+
+        entityx::Entity mainBuilding;
+        std::vector<ObjectId> towers, unfinished;
+
+        GameObject::Handle gameObject;
+        Building::Handle building;
+        for (auto entity : sim.getEntities().entities_with_components(
+                 gameObject, building)) {
+            if (gameObject->getOwner() != client.getPlayerId())
+                continue;
+
+            if (building->getType() == BUILDING_MAIN && building->isUsable())
+                mainBuilding = entity;
+            if (building->getType() == BUILDING_TOWER && building->isUsable())
+                towers.push_back(gameObject->getId());
+            if (!building->isFinished())
+                unfinished.push_back(gameObject->getId());
+        }
+
+        switch (random() % 4) {
+        case 0:
+            if (mainBuilding) {
+                const glm::uvec3 &p(
+                    mainBuilding.component<Building>()->getPosition());
+                int dx = static_cast<int>(random() % 33) - 16,
+                    dy = static_cast<int>(random() % 33) - 16;
+
+                order = Order(Order::BUILD);
+                order.build.objectId =
+                    mainBuilding.component<GameObject>()->getId();
+                order.build.type = static_cast<BuildingType>(
+                    1 + random() % (BUILDING_MAX - 1));
+                order.build.x = static_cast<uint16_t>(
+                    std::min<int>(std::max<int>(p.x + dx, 0),
+                                  map.getSizeX() - 1));
+                order.build.y = static_cast<uint16_t>(
+                    std::min<int>(std::max<int>(p.y + dy, 0),
+                                  map.getSizeY() - 1));
+                return;
+            }
+            break;
+
+        case 1:
+            if (mainBuilding && !unfinished.empty()) {
+                order = Order(Order::CONSTRUCT);
+                order.construct.queue = random() % 2;
+                order.construct.from =
+                    mainBuilding.component<GameObject>()->getId();
+                order.construct.to = unfinished[random() % unfinished.size()];
+                return;
+            }
+            break;
+
+        case 2:
+            if (!towers.empty()) {
+                order = Order(Order::ATTACK);
+                order.attack.objectId = towers[random() % towers.size()];
+                order.attack.x = randomCoord(map.getSizeX());
+                order.attack.y = randomCoord(map.getSizeY());
+                return;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        order = Order(Order::RAISE_MAP);
+        order.raiseMap.w = static_cast<uint16_t>(1 + random() % 4);
+        order.raiseMap.h = static_cast<uint16_t>(1 + random() % 4);
+        order.raiseMap.x = randomCoord(map.getSizeX() - order.raiseMap.w);
+        order.raiseMap.y = randomCoord(map.getSizeY() - order.raiseMap.h);
+    }
+};
+
+int main(int argc, char *argv[]) {
+    BotConfig config;
+    config.host = "localhost";
+    config.port = 1234;
+    config.numBots = 1;
+    config.ordersPerSecond = 1.0;
+    config.durationS = 0;
+    config.reportIntervalS = 5.0;
+    config.frameRate = 60.0;
+
+    // Usage: bot [host] [port] [bots] [orders per second] [seconds]
+    // With "loopback" as the host, the bots play on a server in this
+    // process.
+    if (argc > 1) config.host = argv[1];
+    if (argc > 2) config.port = atoi(argv[2]);
+    if (argc > 3) config.numBots = std::max(atoi(argv[3]), 1);
+    if (argc > 4) config.ordersPerSecond = atof(argv[4]);
+    if (argc > 5) config.durationS = atof(argv[5]);
+
+    if (initializeENetWithPool() != 0) {
+        std::cerr << "Failed to initialize ENet" << std::endl;
+        return 1;
+    }
+
+    ServerConfig serverConfig;
+    serverConfig.port = 0;
+    serverConfig.playersPerMatch = config.numBots;
+
+    Worker *server = NULL;
+    std::thread serverThread;
+
+    if (config.host == LOOPBACK_HOST) {
+        server = new Worker(serverConfig, 0, NULL);
+        server->init();
+        serverThread = std::thread(&Worker::run, server);
+    }
+
+    BotStats stats;
+
+    std::vector<Bot *> bots;
+    for (size_t i = 0; i < config.numBots; i++) {
+        std::stringstream name;
+        name << "bot" << i;
+
+        bots.push_back(new Bot(name.str(), stats, static_cast<uint32_t>(i)));
+
+        if (server)
+            bots.back()->connect(server->getLoopbackHost());
+        else
+            bots.back()->connect(config.host, config.port);
+    }
+
+    Clock::duration frameLength = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(1.0 / config.frameRate));
+
+    Clock::time_point startTime = Clock::now(),
+                      lastFrameTime = startTime,
+                      lastReportTime = startTime;
+
+    for (;;) {
+        Clock::time_point now = Clock::now();
+        double dt = std::chrono::duration<double>(now - lastFrameTime).count();
+        lastFrameTime = now;
+
+        for (auto bot : bots)
+            bot->update(dt, config.ordersPerSecond, now);
+
+        double reportS =
+            std::chrono::duration<double>(now - lastReportTime).count();
+        double elapsedS =
+            std::chrono::duration<double>(now - startTime).count();
+        bool done = config.durationS > 0 && elapsedS >= config.durationS;
+
+        if (reportS >= config.reportIntervalS || done) {
+            for (auto bot : bots)
+                bot->sampleTraffic();
+
+            stats.print(std::cout, reportS, bots.size());
+            stats.reset();
+            lastReportTime = now;
+        }
+
+        if (done)
+            break;
+
+        std::this_thread::sleep_until(now + frameLength);
+    }
+
+    for (auto bot : bots)
+        delete bot;
+
+    if (server) {
+        server->stop();
+        serverThread.join();
+        delete server;
+    }
+
+    enet_deinitialize();
+
+    return 0;
+}
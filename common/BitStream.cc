@@ -4,78 +4,252 @@
 #include <iostream>
 #include <cassert>
 
-BitStreamWriter::BitStreamWriter() {
+BitStreamWriter::BitStreamWriter(Mode mode)
+    : mode(mode), fixedBuffer(nullptr), fixedCapacity(0), numBits(0),
+      orderCodec(nullptr), orderTraffic(nullptr) {
+    assert(mode != FIXED);
+}
+
+BitStreamWriter::BitStreamWriter(uint8_t* buffer, size_t capacity)
+    : mode(FIXED), fixedBuffer(buffer), fixedCapacity(capacity), numBits(0),
+      orderCodec(nullptr), orderTraffic(nullptr) {
+    assert(buffer != nullptr);
+}
+
+uint8_t* BitStreamWriter::grow(size_t numBytes) {
+    size_t oldSize = size();
+
+    switch (mode) {
+    case GROWING:
+        buffer.resize(oldSize + numBytes, 0);
+        return &buffer[oldSize];
+    case FIXED:
+        assert(oldSize + numBytes <= fixedCapacity);
+        std::fill(fixedBuffer + oldSize, fixedBuffer + oldSize + numBytes, 0);
+        return fixedBuffer + oldSize;
+    case COUNTING:
+    default:
+        return nullptr;
+    }
+}
+
+void BitStreamWriter::writeBits(uint32_t value, size_t n) {
+    assert(n <= 32);
+    assert(n == 32 || value < (static_cast<uint64_t>(1) << n));
+
+    if (mode == COUNTING) {
+        numBits += n;
+        return;
+    }
+
+    while (n > 0) {
+        size_t bitOffset = numBits % 8;
+        if (bitOffset == 0)
+            grow(1);
+
+        size_t count = std::min(8 - bitOffset, n);
+        uint32_t mask = (1u << count) - 1;
+
+        uint8_t* last = (mode == FIXED ? fixedBuffer : &buffer[0]) + numBits / 8;
+        *last |= static_cast<uint8_t>((value & mask) << bitOffset);
+
+        value >>= count;
+        n -= count;
+        numBits += count;
+    }
+}
+
+void BitStreamWriter::writeVarUint(uint64_t value) {
+    while (value >= 0x80) {
+        writeBits(static_cast<uint32_t>(value & 0x7f) | 0x80, 8);
+        value >>= 7;
+    }
+    writeBits(static_cast<uint32_t>(value), 8);
+}
+
+void BitStreamWriter::writeVarInt(int64_t value) {
+    writeVarUint(zigZagEncode(value));
 }
 
 void BitStreamWriter::writeBytes(uint8_t const* data, size_t size) {
     assert(data != nullptr);
     assert(size > 0);
 
-    auto oldSize = buffer.size();
-    buffer.resize(oldSize + size);
-    std::copy(data, data + size, &buffer[oldSize]);
+    if (mode == COUNTING) {
+        numBits += size * 8;
+    } else if (numBits % 8 == 0) {
+        uint8_t* out = grow(size);
+        std::copy(data, data + size, out);
+        numBits += size * 8;
+    } else {
+        for (size_t i = 0; i < size; i++)
+            writeBits(data[i], 8);
+    }
 }
 
 uint8_t const* BitStreamWriter::ptr() const {
-    assert(buffer.size() > 0);
+    assert(mode != COUNTING);
+    assert(size() > 0);
 
-    return &buffer[0];
-}
-
-size_t BitStreamWriter::size() const {
-    return buffer.size();
+    return mode == FIXED ? fixedBuffer : &buffer[0];
 }
 
 void BitStreamWriter::reset() {
     buffer.resize(0);
+    numBits = 0;
 }
 
 BitStreamReader::BitStreamReader(std::vector<uint8_t> const& v)
-    : BitStreamReader(&v[0], v.size()) {
+    : BitStreamReader(v.data(), v.size()) {
 }
 
 BitStreamReader::BitStreamReader(uint8_t const* buffer, size_t bufferLength)
-    : buffer(buffer), bufferLength(bufferLength), index(0) {
-    assert(buffer != nullptr);
-    assert(bufferLength > 0);
+    : buffer(buffer), bufferLength(bufferLength), bitIndex(0),
+      checked(true), failed(false), orderCodec(nullptr),
+      orderTraffic(nullptr) {
+    assert(buffer != nullptr || bufferLength == 0);
+}
+
+bool BitStreamReader::canRead(size_t numBits) {
+    if (!checked) {
+        assert(numBits <= remainingBits());
+        return true;
+    }
+
+    if (numBits > remainingBits()) {
+        failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t BitStreamReader::readBits(size_t n) {
+    assert(n <= 32);
+
+    if (!canRead(n))
+        return 0;
+
+    uint32_t value = 0;
+    size_t shift = 0;
+
+    while (n > 0) {
+        size_t bitOffset = bitIndex % 8;
+        size_t count = std::min(8 - bitOffset, n);
+        uint32_t mask = (1u << count) - 1;
+
+        uint32_t bits = (buffer[bitIndex / 8] >> bitOffset) & mask;
+        value |= bits << shift;
+
+        shift += count;
+        n -= count;
+        bitIndex += count;
+    }
+
+    return value;
+}
+
+uint64_t BitStreamReader::readVarUint(size_t valueBits) {
+    assert(valueBits > 0 && valueBits <= 64);
+
+    uint64_t value = 0;
+
+    for (size_t shift = 0; shift < valueBits; shift += 7) {
+        uint32_t byte = readBits(8);
+        uint64_t bits = byte & 0x7f;
+
+        // Bits that don't fit into valueBits
+        if (valueBits - shift < 7 && bits >> (valueBits - shift)) {
+            fail();
+            return 0;
+        }
+
+        value |= bits << shift;
+
+        if (!(byte & 0x80)) {
+            // Writers never end with a zero byte
+            if (byte == 0 && shift > 0) {
+                fail();
+                return 0;
+            }
+
+            return value;
+        }
+    }
+
+    // Continued past the last byte that valueBits allow
+    fail();
+    return 0;
+}
+
+int64_t BitStreamReader::readVarInt(size_t valueBits) {
+    return zigZagDecode(readVarUint(valueBits));
 }
 
 void BitStreamReader::readBytes(uint8_t* out, size_t size) {
     assert(out != nullptr);
     assert(size > 0);
-    assert(index + size <= bufferLength);
 
-    std::copy(buffer + index, buffer + index + size, out);
-    index += size;
+    if (!canRead(size * 8)) {
+        std::fill(out, out + size, 0);
+        return;
+    }
+
+    if (bitIndex % 8 == 0) {
+        size_t index = bitIndex / 8;
+        std::copy(buffer + index, buffer + index + size, out);
+        bitIndex += size * 8;
+    } else {
+        for (size_t i = 0; i < size; i++)
+            out[i] = static_cast<uint8_t>(readBits(8));
+    }
+}
+
+ByteView BitStreamReader::readView(size_t size) {
+    size_t index = position();
+
+    if (!canRead((index + size) * 8 - bitIndex))
+        return ByteView();
+
+    bitIndex = (index + size) * 8;
+    return ByteView(buffer + index, size);
 }
 
 bool BitStreamReader::eof() {
-    return index == bufferLength;
+    return position() == bufferLength;
 }
 
 std::vector<uint8_t> BitStreamReader::restVector() const {
-    return std::vector<uint8_t>(buffer + index, buffer + bufferLength);
+    return std::vector<uint8_t>(buffer + position(), buffer + bufferLength);
 }
 
 void BitStreamReader::skip(size_t offset) {
-    assert(index + offset <= bufferLength);
-    index += offset;
+    if (!canRead((position() + offset) * 8 - bitIndex))
+        return;
+
+    bitIndex = (position() + offset) * 8;
 }
 
 void write(BitStreamWriter& stream, std::string const& str) {
-    write(stream, str.size());
-    stream.writeBytes(
-            reinterpret_cast<const uint8_t*>(str.c_str()),
-            str.size());
+    stream.writeVarUint(str.size());
+
+    if (!str.empty()) {
+        stream.writeBytes(
+                reinterpret_cast<const uint8_t*>(str.c_str()),
+                str.size());
+    }
 }
 
 void read(BitStreamReader& stream, std::string& str) {
-    size_t size;
-    read(stream, size);
-    str = std::string(size, ' ');
-    
-    // This might just explode on you.
-    stream.readBytes(
-            reinterpret_cast<uint8_t*>(const_cast<char*>(str.c_str())),
-            size);
+    size_t size = stream.readVarUint();
+
+    if (size > stream.remainingBits() / 8) {
+        stream.fail();
+        return;
+    }
+
+    str.resize(size);
+
+    if (size > 0)
+        stream.readBytes(reinterpret_cast<uint8_t*>(&str[0]), size);
 }
@@ -8,72 +8,273 @@
 #include <iostream>
 #include <typeinfo>
 
-// These bit streams operate on a byte level... for now. :P
-// Doesn't take care of endianness issues.
+struct OrderCodec;
+struct OrderTraffic;
 
+// Bits are packed starting at the least significant bit of each byte.
+// Integers are written as varints (7 bits per byte plus a continuation bit),
+// signed integers are zig-zag encoded first so that small negative
+// values stay small. Fields with a known range can be written with
+// a fixed number of bits using writeBits.
+//
+// Doesn't take care of endianness issues for raw writeBytes data.
+
+// Number of bits needed to store values in [0, maxValue]
+constexpr size_t bitsRequired(uint32_t maxValue) {
+    return maxValue == 0 ? 0 : 1 + bitsRequired(maxValue >> 1);
+}
+
+inline uint64_t zigZagEncode(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigZagDecode(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Bounded view into the buffer of a BitStreamReader. Only valid as long
+// as the underlying buffer (e.g. the ENetPacket) is alive.
+struct ByteView {
+    uint8_t const* data;
+    size_t size;
+
+    ByteView()
+        : data(nullptr), size(0) {
+    }
+
+    ByteView(uint8_t const* data, size_t size)
+        : data(data), size(size) {
+    }
+};
+
+// Bounds for the encoded size of a type in bits. If isFixed is false,
+// the type has parts of variable length that are not covered by maxBits.
+struct WireSize {
+    size_t minBits;
+    size_t maxBits;
+    bool isFixed;
+};
+
+// A writer either grows its own buffer, writes into a fixed buffer
+// given by the caller (e.g. the data of a pre-sized ENetPacket), or
+// only counts the bits that would be written, so that the size of
+// the buffer can be determined beforehand.
 struct BitStreamWriter {
-    BitStreamWriter();
+    enum Mode {
+        GROWING,
+        FIXED,
+        COUNTING
+    };
+
+    explicit BitStreamWriter(Mode mode = GROWING);
+    BitStreamWriter(uint8_t* buffer, size_t capacity);
+
+    // Writes the lowest numBits bits of value, numBits <= 32
+    void writeBits(uint32_t value, size_t numBits);
+
+    void writeVarUint(uint64_t value);
+    void writeVarInt(int64_t value);
 
     void writeBytes(uint8_t const* data, size_t size);
 
+    // Not available in COUNTING mode
     uint8_t const* ptr() const;
-    size_t size() const;
+
+    // Size in bytes, including the partially filled last byte
+    size_t size() const { return (numBits + 7) / 8; }
+    size_t bitSize() const { return numBits; }
 
     void reset();
 
+    // If set, orders written to this stream are encoded by the codec
+    void setOrderCodec(OrderCodec* codec) { orderCodec = codec; }
+    OrderCodec* getOrderCodec() const { return orderCodec; }
+
+    // If set, orders written to this stream are counted
+    void setOrderTraffic(OrderTraffic* traffic) { orderTraffic = traffic; }
+    OrderTraffic* getOrderTraffic() const { return orderTraffic; }
+
 private:
+    Mode mode;
+
     std::vector<uint8_t> buffer;
+
+    uint8_t* fixedBuffer;
+    size_t fixedCapacity;
+
+    size_t numBits;
+
+    OrderCodec* orderCodec;
+    OrderTraffic* orderTraffic;
+
+    // Appends zeroed bytes, returns nullptr in COUNTING mode
+    uint8_t* grow(size_t numBytes);
 };
 
+// Number of bytes needed to write the given value
+template<typename T>
+size_t measure(const T& value) {
+    BitStreamWriter counter(BitStreamWriter::COUNTING);
+    write(counter, value);
+    return counter.size();
+}
+
+// Readers check every read against the end of the buffer. Reading past
+// the end does not touch memory outside of the buffer, but marks the
+// reader as failed and yields zeros. Once the size of some data has been
+// validated as a whole, checking can be turned off for reading it.
 struct BitStreamReader {
     BitStreamReader(std::vector<uint8_t> const&);
     BitStreamReader(uint8_t const* buffer, size_t bufferLength);
 
+    uint32_t readBits(size_t numBits);
+
+    // Reads a varint of at most valueBits bits. Encodings that are longer
+    // than needed or hold a larger value mark the reader as failed, so
+    // that no more than (valueBits + 6) / 7 bytes are ever read.
+    uint64_t readVarUint(size_t valueBits = 64);
+    int64_t readVarInt(size_t valueBits = 64);
+
     void readBytes(uint8_t* out, size_t size);
 
+    // Skips to the next byte boundary, then returns a view of the next
+    // `size' bytes without copying them
+    ByteView readView(size_t size);
+
+    // True if no full byte is left to read
     bool eof();
 
-    size_t position() const { return index; }
+    size_t remainingBits() const { return bufferLength * 8 - bitIndex; }
+
+    // Turning checking off is only allowed if it has been made sure that
+    // the following reads stay within the buffer
+    void setChecked(bool checked) { this->checked = checked; }
+    bool isChecked() const { return checked; }
+
+    // Marks the data as malformed
+    void fail() { failed = true; }
+    bool hasFailed() const { return failed; }
+
+    // Position in bytes, rounded up
+    size_t position() const { return (bitIndex + 7) / 8; }
 
     std::vector<uint8_t> restVector() const;
 
     void skip(size_t offset);
 
+    // If set, orders read from this stream are decoded by the codec
+    void setOrderCodec(OrderCodec* codec) { orderCodec = codec; }
+    OrderCodec* getOrderCodec() const { return orderCodec; }
+
+    // If set, orders read from this stream are counted
+    void setOrderTraffic(OrderTraffic* traffic) { orderTraffic = traffic; }
+    OrderTraffic* getOrderTraffic() const { return orderTraffic; }
+
 private:
     uint8_t const* buffer;
     size_t const bufferLength;
 
-    size_t index;
+    size_t bitIndex;
+
+    bool checked;
+    bool failed;
+
+    OrderCodec* orderCodec;
+    OrderTraffic* orderTraffic;
+
+    // Returns false and marks the reader as failed if numBits can not be read
+    bool canRead(size_t numBits);
 };
 
-template<typename T/*,
-         typename = typename std::enable_if<std::is_pod<T>::value>::type*/>
-void write(BitStreamWriter& stream, const T& value) {
+// Integers and enums are written as varints, anything else is copied
+// bytewise. Types with a meaningful range should rather be written
+// explicitly with writeBits.
+
+template<typename T>
+void write(BitStreamWriter& stream, const T& value,
+           typename std::enable_if<std::is_integral<T>::value
+                                   && std::is_unsigned<T>::value>::type* = 0) {
+    stream.writeVarUint(value);
+}
+
+template<typename T>
+void write(BitStreamWriter& stream, const T& value,
+           typename std::enable_if<std::is_integral<T>::value
+                                   && std::is_signed<T>::value>::type* = 0) {
+    stream.writeVarInt(value);
+}
+
+template<typename T>
+void write(BitStreamWriter& stream, const T& value,
+           typename std::enable_if<std::is_enum<T>::value>::type* = 0) {
+    stream.writeVarUint(static_cast<uint64_t>(value));
+}
+
+template<typename T>
+void write(BitStreamWriter& stream, const T& value,
+           typename std::enable_if<std::is_pod<T>::value
+                                   && !std::is_integral<T>::value
+                                   && !std::is_enum<T>::value>::type* = 0) {
     stream.writeBytes(reinterpret_cast<uint8_t const*>(&value), sizeof(T));
 }
 
+inline void write(BitStreamWriter& stream, bool value) {
+    stream.writeBits(value ? 1 : 0, 1);
+}
+
 void write(BitStreamWriter&, std::string const&);
 
 template<typename T>
 void write(BitStreamWriter& stream, const std::vector<T>& v) {
-    write(stream, v.size());
+    stream.writeVarUint(v.size());
 
     for (auto& e : v)
         write(stream, e);
 }
 
-template<typename T/*,
-         typename = typename std::enable_if<std::is_pod<T>::value>::type*/>
-void read(BitStreamReader& stream, T& value) {
+template<typename T>
+void read(BitStreamReader& stream, T& value,
+          typename std::enable_if<std::is_integral<T>::value
+                                  && std::is_unsigned<T>::value>::type* = 0) {
+    value = static_cast<T>(stream.readVarUint(sizeof(T) * 8));
+}
+
+template<typename T>
+void read(BitStreamReader& stream, T& value,
+          typename std::enable_if<std::is_integral<T>::value
+                                  && std::is_signed<T>::value>::type* = 0) {
+    value = static_cast<T>(stream.readVarInt(sizeof(T) * 8));
+}
+
+template<typename T>
+void read(BitStreamReader& stream, T& value,
+          typename std::enable_if<std::is_enum<T>::value>::type* = 0) {
+    value = static_cast<T>(stream.readVarUint(sizeof(T) * 8));
+}
+
+template<typename T>
+void read(BitStreamReader& stream, T& value,
+          typename std::enable_if<std::is_pod<T>::value
+                                  && !std::is_integral<T>::value
+                                  && !std::is_enum<T>::value>::type* = 0) {
     stream.readBytes(reinterpret_cast<uint8_t*>(&value), sizeof(T));
 }
 
+inline void read(BitStreamReader& stream, bool& value) {
+    value = stream.readBits(1) != 0;
+}
+
 void read(BitStreamReader&, std::string&);
 
 template<typename T>
 void read(BitStreamReader& stream, std::vector<T>& v) {
-    size_t size;
-    read(stream, size);
+    size_t size = stream.readVarUint();
+
+    // Every element takes up at least one bit
+    if (size > stream.remainingBits()) {
+        stream.fail();
+        return;
+    }
 
     v.resize(size);
 
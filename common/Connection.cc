@@ -0,0 +1,91 @@
+#include "Connection.hh"
+
+#include <cassert>
+#include <chrono>
+
+OutgoingMessage::OutgoingMessage(const Message &message, int channel,
+                                 OrderCodec *codec)
+    : message(message), channel(channel), codec(codec), packet(NULL),
+      encodeTime(0) {
+    assert(channel >= 0 && channel < NUM_CHANNELS);
+}
+
+OutgoingMessage::~OutgoingMessage() {
+    // The packet is reference counted by ENet once it has been sent
+    if (packet && packet->referenceCount == 0)
+        enet_packet_destroy(packet);
+}
+
+ENetPacket *OutgoingMessage::getPacket() {
+    if (!packet) {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+
+        enet_uint32 flags = channel == CHANNEL_TICKS ?
+                            ENET_PACKET_FLAG_UNSEQUENCED :
+                            ENET_PACKET_FLAG_RELIABLE;
+        packet = message.toPacket(codec, flags, &orders);
+
+        encodeTime += std::chrono::duration<double>(
+            Clock::now() - start).count();
+    }
+
+    return packet;
+}
+
+double OutgoingMessage::takeEncodeTime() {
+    double time = encodeTime;
+    encodeTime = 0;
+    return time;
+}
+
+ENetConnection::ENetConnection(ENetPeer *peer)
+    : peer(peer) {
+    peer->data = this;
+}
+
+ENetConnection::~ENetConnection() {
+    peer->data = NULL;
+}
+
+size_t ENetConnection::send(OutgoingMessage &message) {
+    ENetPacket *packet = message.getPacket();
+    enet_peer_send(peer, static_cast<enet_uint8>(message.getChannel()),
+                   packet);
+    return packet->dataLength;
+}
+
+void ENetConnection::disconnect() {
+    enet_peer_disconnect(peer, 0);
+}
+
+void ENetConnection::setPingInterval(enet_uint32 ms) {
+    enet_peer_ping_interval(peer, ms);
+}
+
+enet_uint32 ENetConnection::getRoundTripTime() const {
+    return peer->roundTripTime;
+}
+
+enet_uint32 ENetConnection::getRoundTripTimeVariance() const {
+    return peer->roundTripTimeVariance;
+}
+
+double ENetConnection::getPacketLoss() const {
+    return static_cast<double>(peer->packetLoss)
+           / ENET_PEER_PACKET_LOSS_SCALE;
+}
+
+size_t ENetConnection::getReliableDataInTransit() const {
+    return peer->reliableDataInTransit;
+}
+
+enet_uint32 enetTimeoutMs(std::chrono::steady_clock::time_point deadline,
+                          std::chrono::steady_clock::time_point now) {
+    if (deadline <= now)
+        return 0;
+
+    return static_cast<enet_uint32>(
+        (std::chrono::duration_cast<std::chrono::nanoseconds>(
+            deadline - now).count() + 999999) / 1000000);
+}
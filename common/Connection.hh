@@ -0,0 +1,139 @@
+#ifndef STRAT_COMMON_CONNECTION_HH
+#define STRAT_COMMON_CONNECTION_HH
+
+#include "Message.hh"
+#include "Traffic.hh"
+
+#include <enet/enet.h>
+
+#include <algorithm>
+#include <chrono>
+
+struct OrderCodec;
+
+// A message on its way to one or more connections. Over ENet, it is
+// encoded into a packet on first use, which is then shared by all
+// connections. The message and codec must stay unchanged until then.
+//
+// Messages on CHANNEL_RELIABLE and CHANNEL_MAP are sent reliably and in
+// order within their channel, those on CHANNEL_TICKS unsequenced and
+// unreliably.
+struct OutgoingMessage {
+    OutgoingMessage(const Message &message, int channel,
+                    OrderCodec *codec = NULL);
+    ~OutgoingMessage();
+
+    OutgoingMessage(const OutgoingMessage &) = delete;
+    OutgoingMessage &operator=(const OutgoingMessage &) = delete;
+
+    const Message &getMessage() const { return message; }
+    int getChannel() const { return channel; }
+
+    ENetPacket *getPacket();
+
+    // Orders in the packet, if it has been encoded
+    const OrderTraffic &getOrderTraffic() const { return orders; }
+
+    // Returns the time spent encoding since the last call, in seconds
+    double takeEncodeTime();
+
+private:
+    const Message &message;
+    int channel;
+
+    // Orders are encoded with the codec, if any
+    OrderCodec *codec;
+
+    ENetPacket *packet;
+
+    OrderTraffic orders;
+    double encodeTime;
+};
+
+// One end of the connection between a client and the server, either
+// over ENet or within the process (see Loopback.hh).
+//
+// Receiving is up to the owner of the connection, since ENet delivers
+// the messages of all peers of a host together.
+struct Connection {
+    Connection()
+        : data(NULL) {
+    }
+
+    virtual ~Connection() {}
+
+    // Returns the number of bytes put on the wire, which is zero if the
+    // message is passed on as it is
+    virtual size_t send(OutgoingMessage &) = 0;
+
+    // The other end finds out once the messages sent so far have arrived
+    virtual void disconnect() = 0;
+
+    // How often to measure the round trip time, if it is measured at all
+    virtual void setPingInterval(enet_uint32 ms) = 0;
+
+    virtual enet_uint32 getRoundTripTime() const = 0;
+    virtual enet_uint32 getRoundTripTimeVariance() const = 0;
+
+    // Fraction of the packets that are lost
+    virtual double getPacketLoss() const = 0;
+
+    // Bytes of reliable messages that have not been acknowledged yet
+    virtual size_t getReliableDataInTransit() const = 0;
+
+    // For the owner of the connection, e.g. the server's ClientInfo
+    void *data;
+};
+
+// A connection over an ENet peer. It sets itself as the peer's data.
+struct ENetConnection : Connection {
+    ENetConnection(ENetPeer *peer);
+    ~ENetConnection();
+
+    ENetPeer *getPeer() const { return peer; }
+
+    virtual size_t send(OutgoingMessage &);
+    virtual void disconnect();
+    virtual void setPingInterval(enet_uint32 ms);
+
+    virtual enet_uint32 getRoundTripTime() const;
+    virtual enet_uint32 getRoundTripTimeVariance() const;
+    virtual double getPacketLoss() const;
+    virtual size_t getReliableDataInTransit() const;
+
+private:
+    ENetPeer *peer;
+};
+
+// Sends data reliably in parts, without queueing more than a window of it
+// at once. The parts from offset up to end are sent, at most chunkSize at
+// a time, until the bytes in transit on the connection, inTransit as
+// reported e.g. by Connection::getReliableDataInTransit, reach window.
+//
+// sendChunk(offset, size) sends one part and returns the number of bytes
+// it queued, after which offset is moved past the part. Returns false if
+// the window filled up before the end was sent.
+template <typename SendChunk>
+bool sendWindowed(size_t inTransit, size_t &offset, size_t end,
+                  size_t chunkSize, size_t window, SendChunk sendChunk) {
+    // Data queued here only counts as in transit once ENet sends it
+    size_t queued = 0;
+    while (offset < end) {
+        if (inTransit + queued >= window)
+            return false;
+
+        size_t size = std::min(chunkSize, end - offset);
+        queued += sendChunk(offset, size);
+        offset += size;
+    }
+
+    return true;
+}
+
+// Milliseconds to wait for ENet, e.g. in enet_host_service, until the
+// deadline. Rounded up, so that we don't spin with a zero timeout while
+// less than a millisecond is left.
+enet_uint32 enetTimeoutMs(std::chrono::steady_clock::time_point deadline,
+                          std::chrono::steady_clock::time_point now);
+
+#endif
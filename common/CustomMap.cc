@@ -0,0 +1,230 @@
+#include "CustomMap.hh"
+
+#include "BitStream.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+// Reads a token of the header of a PGM image, skipping comments
+static bool readPGMToken(std::istream &in, std::string &token) {
+    token.clear();
+
+    int c;
+    while ((c = in.get()) != EOF) {
+        if (c == '#') {
+            while ((c = in.get()) != EOF && c != '\n');
+        } else if (!isspace(c)) {
+            break;
+        }
+    }
+
+    for (; c != EOF && !isspace(c); c = in.get())
+        token += static_cast<char>(c);
+
+    // The single whitespace after the header has been consumed
+    return !token.empty();
+}
+
+// Binary 8-bit grayscale images only
+static bool loadPGM(const std::string &path, size_t &width, size_t &height,
+                    size_t &maxValue, std::vector<uint8_t> &values) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+
+    std::string magic, w, h, max;
+    if (!readPGMToken(file, magic) || magic != "P5"
+        || !readPGMToken(file, w) || !readPGMToken(file, h)
+        || !readPGMToken(file, max)) {
+        std::cerr << path << " is not a binary PGM image" << std::endl;
+        return false;
+    }
+
+    width = atoi(w.c_str());
+    height = atoi(h.c_str());
+    maxValue = atoi(max.c_str());
+
+    if (width == 0 || height == 0 || width * height > MAX_CUSTOM_MAP_POINTS
+        || maxValue == 0 || maxValue > 255) {
+        std::cerr << path << ": unsupported size or depth" << std::endl;
+        return false;
+    }
+
+    values.resize(width * height);
+    file.read(reinterpret_cast<char *>(&values[0]), values.size());
+
+    if (file.gcount() != static_cast<std::streamsize>(values.size())) {
+        std::cerr << path << " is truncated" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool CustomMap::load(const std::string &heightPath,
+                     const std::string &waterPath, size_t heightLimit) {
+    size_t width, height, maxValue;
+    std::vector<uint8_t> values;
+
+    if (!loadPGM(heightPath, width, height, maxValue, values))
+        return false;
+
+    sizeX = static_cast<uint32_t>(width);
+    sizeY = static_cast<uint32_t>(height);
+
+    // Heights are stored in a byte each
+    heightLimit = std::min<size_t>(heightLimit, 255);
+
+    heights.resize(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        heights[i] = static_cast<uint8_t>(
+            (values[i] * heightLimit + maxValue / 2) / maxValue);
+    }
+
+    waterSources.clear();
+    if (waterPath.empty())
+        return true;
+
+    if (!loadPGM(waterPath, width, height, maxValue, values))
+        return false;
+
+    if (width != sizeX || height != sizeY) {
+        std::cerr << waterPath << " differs in size from " << heightPath
+                  << std::endl;
+        return false;
+    }
+
+    waterSources.resize(values.size());
+    for (size_t i = 0; i < values.size(); i++)
+        waterSources[i] = values[i] != 0;
+
+    return true;
+}
+
+void read(BitStreamReader &reader, CustomMap &map) {
+    map.sizeX = static_cast<uint32_t>(reader.readVarUint());
+    map.sizeY = static_cast<uint32_t>(reader.readVarUint());
+
+    size_t numPoints = static_cast<size_t>(map.sizeX) * map.sizeY;
+    if (reader.hasFailed() || numPoints == 0
+        || numPoints > MAX_CUSTOM_MAP_POINTS) {
+        reader.fail();
+        return;
+    }
+
+    // Every point takes at least a bit
+    if (numPoints > reader.remainingBits()) {
+        reader.fail();
+        return;
+    }
+
+    map.heights.resize(numPoints);
+    for (size_t i = 0; i < numPoints && !reader.hasFailed(); i++) {
+        int predicted = 0;
+        if (i % map.sizeX > 0)
+            predicted = map.heights[i - 1];
+        else if (i > 0)
+            predicted = map.heights[i - map.sizeX];
+
+        int difference = 0;
+        if (reader.readBits(1)) {
+            bool negative = reader.readBits(1);
+            bool large = reader.readBits(1);
+
+            difference = 1;
+            if (large) {
+                uint64_t extra = reader.readVarUint();
+                if (extra > 253) {
+                    reader.fail();
+                    return;
+                }
+
+                difference = 2 + static_cast<int>(extra);
+            }
+            if (negative)
+                difference = -difference;
+        }
+
+        int height = predicted + difference;
+        if (height < 0 || height > 255) {
+            reader.fail();
+            return;
+        }
+
+        map.heights[i] = static_cast<uint8_t>(height);
+    }
+
+    bool haveSources;
+    read(reader, haveSources);
+
+    map.waterSources.clear();
+    if (!haveSources || reader.hasFailed())
+        return;
+
+    map.waterSources.resize(numPoints);
+
+    // Runs alternate between points that are not sources and those that
+    // are, starting with the former
+    bool source = false;
+    for (size_t i = 0; i < numPoints; source = !source) {
+        size_t run = reader.readVarUint();
+        if (reader.hasFailed() || run > numPoints - i || (run == 0 && i > 0)) {
+            reader.fail();
+            return;
+        }
+
+        for (size_t end = i + run; i < end; i++)
+            map.waterSources[i] = source;
+    }
+}
+
+void write(BitStreamWriter &writer, const CustomMap &map) {
+    size_t numPoints = static_cast<size_t>(map.sizeX) * map.sizeY;
+    assert(numPoints > 0 && numPoints <= MAX_CUSTOM_MAP_POINTS);
+    assert(map.heights.size() == numPoints);
+    assert(map.waterSources.empty() || map.waterSources.size() == numPoints);
+
+    writer.writeVarUint(map.sizeX);
+    writer.writeVarUint(map.sizeY);
+
+    for (size_t i = 0; i < numPoints; i++) {
+        int predicted = 0;
+        if (i % map.sizeX > 0)
+            predicted = map.heights[i - 1];
+        else if (i > 0)
+            predicted = map.heights[i - map.sizeX];
+
+        int difference = map.heights[i] - predicted;
+        if (difference == 0) {
+            writer.writeBits(0, 1);
+            continue;
+        }
+
+        size_t magnitude = static_cast<size_t>(std::abs(difference));
+        writer.writeBits(1, 1);
+        writer.writeBits(difference < 0, 1);
+        writer.writeBits(magnitude > 1, 1);
+        if (magnitude > 1)
+            writer.writeVarUint(magnitude - 2);
+    }
+
+    write(writer, !map.waterSources.empty());
+    if (map.waterSources.empty())
+        return;
+
+    bool source = false;
+    for (size_t i = 0; i < numPoints; source = !source) {
+        size_t run = 0;
+        while (i + run < numPoints && map.waterSources[i + run] == source)
+            run++;
+
+        writer.writeVarUint(run);
+        i += run;
+    }
+}
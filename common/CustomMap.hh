@@ -0,0 +1,44 @@
+#ifndef STRAT_COMMON_CUSTOM_MAP_HH
+#define STRAT_COMMON_CUSTOM_MAP_HH
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct BitStreamReader;
+struct BitStreamWriter;
+
+// Terrain made outside of the game, played on instead of a map generated
+// from the random seed. The server sends it to the clients compressed,
+// after SERVER_START (see Match).
+struct CustomMap {
+    uint32_t sizeX, sizeY;
+
+    // By point, row after row (see Map::point)
+    std::vector<uint8_t> heights;
+
+    // Points where water springs up. If empty, every point at height zero
+    // is a source, as on generated maps.
+    std::vector<bool> waterSources;
+
+    CustomMap()
+        : sizeX(0), sizeY(0) {
+    }
+
+    // Reads the heights from a binary PGM image, scaled to at most
+    // heightLimit, and the water sources from another image of the same
+    // size, if given, in which every point that is not black is a source
+    bool load(const std::string &heightPath, const std::string &waterPath,
+              size_t heightLimit);
+};
+
+// Larger maps are rejected when reading
+static const size_t MAX_CUSTOM_MAP_POINTS = 4096 * 4096;
+
+// Heights are coded as the difference to the point on their left, or
+// above at the start of a row, which is mostly zero or one. Water
+// sources are coded as runs of equal points.
+void read(BitStreamReader &, CustomMap &);
+void write(BitStreamWriter &, const CustomMap &);
+
+#endif
@@ -0,0 +1,312 @@
+#include "ENetPool.hh"
+
+#include <enet/enet.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+
+// Block sizes of the pools, including the header
+static const size_t NUM_CLASSES = 7;
+static const size_t CLASS_SIZES[NUM_CLASSES] = {
+    64, 128, 256, 512, 1024, 2048, 4096
+};
+
+// Size class of allocations that go to malloc
+static const size_t LARGE_CLASS = NUM_CLASSES;
+
+// Every allocation starts with its size class, padded so that the
+// memory handed out stays aligned
+static const size_t HEADER_SIZE = 16;
+
+static const size_t SLAB_SIZE = 64 * 1024;
+
+// Blocks are moved between the thread caches and the shared free lists
+// in batches of this size. A thread keeps at most twice as many free
+// blocks of each class.
+static const size_t BATCH_SIZE = 32;
+
+struct FreeBlock {
+    FreeBlock *next;
+};
+
+struct SharedList {
+    std::mutex mutex;
+    FreeBlock *head;
+};
+
+static SharedList sharedLists[NUM_CLASSES];
+
+struct ThreadCache {
+    FreeBlock *heads[NUM_CLASSES];
+    size_t counts[NUM_CLASSES];
+
+    // Only written by the owning thread, but read by getENetPoolStats
+    std::atomic<size_t> pooled, large, frees;
+    std::atomic<size_t> slabs, bytesReserved;
+    std::atomic<size_t> refills, flushes;
+
+    ThreadCache();
+    ~ThreadCache();
+};
+
+static std::mutex registryMutex;
+
+// Statistics of the threads that have exited
+static ENetPoolStats retiredStats;
+
+// Never destroyed, since threads might exit during static destruction
+static std::vector<ThreadCache *> &registry() {
+    static std::vector<ThreadCache *> *caches = new std::vector<ThreadCache *>;
+    return *caches;
+}
+
+static thread_local ThreadCache cache;
+
+// Set once the cache of this thread has been destroyed, after which the
+// shared free lists are used directly
+static thread_local bool cacheDestroyed = false;
+
+static void count(std::atomic<size_t> &counter, size_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+// Once its cache has been destroyed, a thread counts its allocations and
+// frees in the statistics of the exited threads
+static void countRetiredAllocation(bool isLarge) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    if (isLarge)
+        retiredStats.large++;
+    else
+        retiredStats.pooled++;
+    retiredStats.inUse++;
+}
+
+static void countRetiredFree() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    retiredStats.inUse--;
+}
+
+// Moves up to n blocks from the front of the list to the shared list
+static void pushShared(size_t sizeClass, FreeBlock *&head, size_t n) {
+    if (!head || n == 0)
+        return;
+
+    FreeBlock *first = head, *last = head;
+    for (size_t i = 1; i < n && last->next; i++)
+        last = last->next;
+    head = last->next;
+
+    SharedList &shared(sharedLists[sizeClass]);
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    last->next = shared.head;
+    shared.head = first;
+}
+
+ThreadCache::ThreadCache()
+    : pooled(0), large(0), frees(0), slabs(0), bytesReserved(0),
+      refills(0), flushes(0) {
+    std::fill(heads, heads + NUM_CLASSES, static_cast<FreeBlock *>(NULL));
+    std::fill(counts, counts + NUM_CLASSES, 0);
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry().push_back(this);
+}
+
+ThreadCache::~ThreadCache() {
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        if (heads[i])
+            count(flushes);
+        pushShared(i, heads[i], counts[i]);
+    }
+
+    cacheDestroyed = true;
+
+    std::lock_guard<std::mutex> lock(registryMutex);
+    retiredStats.pooled += pooled;
+    retiredStats.large += large;
+    retiredStats.inUse += pooled + large - frees;
+    retiredStats.slabs += slabs;
+    retiredStats.bytesReserved += bytesReserved;
+    retiredStats.refills += refills;
+    retiredStats.flushes += flushes;
+
+    std::vector<ThreadCache *> &caches(registry());
+    caches.erase(std::find(caches.begin(), caches.end(), this));
+}
+
+// Fills the empty cache of the size class from the shared list, or from
+// a new slab if that is empty too
+static bool refill(ThreadCache &cache, size_t sizeClass) {
+    FreeBlock *&head(cache.heads[sizeClass]);
+    size_t &n(cache.counts[sizeClass]);
+
+    {
+        SharedList &shared(sharedLists[sizeClass]);
+        std::lock_guard<std::mutex> lock(shared.mutex);
+
+        while (shared.head && n < BATCH_SIZE) {
+            FreeBlock *block = shared.head;
+            shared.head = block->next;
+            block->next = head;
+            head = block;
+            n++;
+        }
+    }
+
+    if (n > 0) {
+        count(cache.refills);
+        return true;
+    }
+
+    uint8_t *slab = static_cast<uint8_t *>(malloc(SLAB_SIZE));
+    if (!slab)
+        return false;
+
+    size_t blockSize = CLASS_SIZES[sizeClass];
+    for (size_t offset = 0; offset + blockSize <= SLAB_SIZE;
+         offset += blockSize) {
+        FreeBlock *block = reinterpret_cast<FreeBlock *>(slab + offset);
+        block->next = head;
+        head = block;
+        n++;
+    }
+
+    count(cache.slabs);
+    count(cache.bytesReserved, SLAB_SIZE);
+    return true;
+}
+
+static void *popBlock(size_t sizeClass) {
+    if (cacheDestroyed) {
+        FreeBlock *block;
+        {
+            SharedList &shared(sharedLists[sizeClass]);
+            std::lock_guard<std::mutex> lock(shared.mutex);
+
+            block = shared.head;
+            if (block)
+                shared.head = block->next;
+        }
+
+        if (!block)
+            block = static_cast<FreeBlock *>(malloc(CLASS_SIZES[sizeClass]));
+        if (block)
+            countRetiredAllocation(false);
+        return block;
+    }
+
+    if (!cache.heads[sizeClass] && !refill(cache, sizeClass))
+        return NULL;
+
+    FreeBlock *block = cache.heads[sizeClass];
+    cache.heads[sizeClass] = block->next;
+    cache.counts[sizeClass]--;
+
+    count(cache.pooled);
+    return block;
+}
+
+static void pushBlock(size_t sizeClass, void *memory) {
+    FreeBlock *block = static_cast<FreeBlock *>(memory);
+
+    if (cacheDestroyed) {
+        block->next = NULL;
+        pushShared(sizeClass, block, 1);
+        countRetiredFree();
+        return;
+    }
+
+    block->next = cache.heads[sizeClass];
+    cache.heads[sizeClass] = block;
+    cache.counts[sizeClass]++;
+
+    count(cache.frees);
+
+    if (cache.counts[sizeClass] >= 2 * BATCH_SIZE) {
+        pushShared(sizeClass, cache.heads[sizeClass], BATCH_SIZE);
+        cache.counts[sizeClass] -= BATCH_SIZE;
+        count(cache.flushes);
+    }
+}
+
+static void *ENET_CALLBACK poolMalloc(size_t size) {
+    size_t sizeClass = 0;
+    while (sizeClass < NUM_CLASSES
+           && size + HEADER_SIZE > CLASS_SIZES[sizeClass]) {
+        sizeClass++;
+    }
+
+    uint8_t *block;
+    if (sizeClass == LARGE_CLASS) {
+        block = static_cast<uint8_t *>(malloc(size + HEADER_SIZE));
+
+        if (block && cacheDestroyed)
+            countRetiredAllocation(true);
+        else if (block)
+            count(cache.large);
+    } else {
+        block = static_cast<uint8_t *>(popBlock(sizeClass));
+    }
+
+    if (!block)
+        return NULL;
+
+    *reinterpret_cast<size_t *>(block) = sizeClass;
+    return block + HEADER_SIZE;
+}
+
+static void ENET_CALLBACK poolFree(void *memory) {
+    if (!memory)
+        return;
+
+    uint8_t *block = static_cast<uint8_t *>(memory) - HEADER_SIZE;
+    size_t sizeClass = *reinterpret_cast<size_t *>(block);
+
+    if (sizeClass == LARGE_CLASS) {
+        free(block);
+
+        if (cacheDestroyed)
+            countRetiredFree();
+        else
+            count(cache.frees);
+        return;
+    }
+
+    pushBlock(sizeClass, block);
+}
+
+int initializeENetWithPool() {
+    ENetCallbacks callbacks;
+    callbacks.malloc = poolMalloc;
+    callbacks.free = poolFree;
+    callbacks.no_memory = NULL;
+
+    return enet_initialize_with_callbacks(ENET_VERSION, &callbacks);
+}
+
+ENetPoolStats getENetPoolStats() {
+    std::lock_guard<std::mutex> lock(registryMutex);
+
+    ENetPoolStats stats(retiredStats);
+    for (auto cache : registry()) {
+        size_t pooled = cache->pooled.load(std::memory_order_relaxed);
+        size_t large = cache->large.load(std::memory_order_relaxed);
+        size_t frees = cache->frees.load(std::memory_order_relaxed);
+
+        stats.pooled += pooled;
+        stats.large += large;
+        stats.inUse += pooled + large - frees;
+        stats.slabs += cache->slabs.load(std::memory_order_relaxed);
+        stats.bytesReserved +=
+            cache->bytesReserved.load(std::memory_order_relaxed);
+        stats.refills += cache->refills.load(std::memory_order_relaxed);
+        stats.flushes += cache->flushes.load(std::memory_order_relaxed);
+    }
+
+    return stats;
+}
@@ -0,0 +1,38 @@
+#ifndef STRAT_COMMON_ENET_POOL_HH
+#define STRAT_COMMON_ENET_POOL_HH
+
+#include <cstddef>
+
+// Memory pools for ENet's allocations, i.e. packets, their data and the
+// commands queued for peers. These are allocated and freed for every
+// message sent or received.
+//
+// Small allocations come from free lists of a few size classes, which
+// are cached per thread and refilled from slabs. Freed memory goes back
+// to the free list of the freeing thread; slabs are never returned.
+// Larger allocations, e.g. the peer arrays of hosts, go to malloc.
+
+struct ENetPoolStats {
+    // Allocations served by the pools and by malloc
+    size_t pooled;
+    size_t large;
+
+    // Allocations currently in use
+    size_t inUse;
+
+    // Slabs allocated and bytes reserved by them
+    size_t slabs;
+    size_t bytesReserved;
+
+    // Batches moved between the thread caches and the shared free lists
+    size_t refills;
+    size_t flushes;
+};
+
+// Initializes ENet with the pools. Returns what enet_initialize returns.
+int initializeENetWithPool();
+
+// Sums of the statistics of all threads
+ENetPoolStats getENetPoolStats();
+
+#endif
@@ -17,7 +17,7 @@ struct PlayerInfo {
 };
 
 void read(BitStreamReader &, PlayerInfo &);
-void write(BitStreamWriter &, PlayerInfo &);
+void write(BitStreamWriter &, const PlayerInfo &);
 
 struct GameSettings {
     std::vector<PlayerInfo> players;
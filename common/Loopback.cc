@@ -0,0 +1,173 @@
+#include "Loopback.hh"
+
+#include <cassert>
+
+// Unbounded queue of messages for one producer and one consumer. The
+// consumer owns the node at the head, whose successors are queued; the
+// producer only appends after the tail.
+struct MessageQueue {
+    MessageQueue()
+        : head(new Node), tail(head) {
+        head->message = NULL;
+        head->next.store(NULL, std::memory_order_relaxed);
+    }
+
+    ~MessageQueue() {
+        while (Message *message = pop())
+            delete message;
+        delete head;
+    }
+
+    void push(Message *message) {
+        Node *node = new Node;
+        node->message = message;
+        node->next.store(NULL, std::memory_order_relaxed);
+
+        tail->next.store(node, std::memory_order_release);
+        tail = node;
+    }
+
+    Message *pop() {
+        Node *next = head->next.load(std::memory_order_acquire);
+        if (!next)
+            return NULL;
+
+        Message *message = next->message;
+        delete head;
+        head = next;
+        return message;
+    }
+
+    bool isEmpty() const {
+        return head->next.load(std::memory_order_acquire) == NULL;
+    }
+
+private:
+    struct Node {
+        Message *message;
+        std::atomic<Node *> next;
+    };
+
+    Node *head;
+    Node *tail;
+};
+
+// Shared by the two ends of a connection, and deleted by the last one
+struct LoopbackPipe {
+    LoopbackHost *host;
+
+    MessageQueue toServer;
+    MessageQueue toClient;
+
+    std::atomic<bool> closed;
+    std::atomic<int> references;
+
+    LoopbackPipe(LoopbackHost *host)
+        : host(host), closed(false), references(2) {
+    }
+};
+
+LoopbackConnection::LoopbackConnection(LoopbackPipe *pipe, bool serverSide)
+    : pipe(pipe), serverSide(serverSide), received(NULL) {
+}
+
+LoopbackConnection::~LoopbackConnection() {
+    disconnect();
+
+    delete received;
+
+    if (pipe->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete pipe;
+}
+
+const Message *LoopbackConnection::receive() {
+    delete received;
+
+    received = serverSide ? pipe->toServer.pop() : pipe->toClient.pop();
+    return received;
+}
+
+bool LoopbackConnection::isDisconnected() const {
+    // Checked in this order, since the other end sends everything before
+    // closing
+    if (!pipe->closed.load(std::memory_order_acquire))
+        return false;
+
+    return serverSide ? pipe->toServer.isEmpty() : pipe->toClient.isEmpty();
+}
+
+size_t LoopbackConnection::send(OutgoingMessage &message) {
+    if (pipe->closed.load(std::memory_order_relaxed))
+        return 0;
+
+    if (serverSide) {
+        pipe->toClient.push(new Message(message.getMessage()));
+    } else {
+        pipe->toServer.push(new Message(message.getMessage()));
+        pipe->host->wake();
+    }
+
+    return 0;
+}
+
+void LoopbackConnection::disconnect() {
+    if (pipe->closed.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    if (!serverSide)
+        pipe->host->wake();
+}
+
+LoopbackHost::LoopbackHost()
+    : woken(false) {
+}
+
+LoopbackHost::~LoopbackHost() {
+    for (auto &entry : pending)
+        delete entry.first;
+}
+
+LoopbackConnection *LoopbackHost::connect(enet_uint32 data) {
+    LoopbackPipe *pipe = new LoopbackPipe(this);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::make_pair(new LoopbackConnection(pipe, true),
+                                         data));
+    }
+
+    wake();
+    return new LoopbackConnection(pipe, false);
+}
+
+LoopbackConnection *LoopbackHost::accept(enet_uint32 &data) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (pending.empty())
+        return NULL;
+
+    LoopbackConnection *connection = pending.front().first;
+    data = pending.front().second;
+    pending.erase(pending.begin());
+    return connection;
+}
+
+void LoopbackHost::wait(std::chrono::steady_clock::time_point deadline) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait_until(lock, deadline, [this] {
+            return woken.load(std::memory_order_acquire);
+        });
+    }
+
+    // Anything sent from now on wakes us up again
+    woken.store(false, std::memory_order_release);
+}
+
+void LoopbackHost::wake() {
+    if (woken.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    condition.notify_one();
+}
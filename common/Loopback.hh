@@ -0,0 +1,92 @@
+#ifndef STRAT_COMMON_LOOPBACK_HH
+#define STRAT_COMMON_LOOPBACK_HH
+
+#include "Connection.hh"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Connections between a client and a server in the same process. They
+// pass Message objects as they are, without encoding them or going
+// through a socket, and nothing is ever lost or reordered.
+//
+// Each direction is a lock-free queue with a single producer and a single
+// consumer, so the ends can be used from different threads: the server's
+// end by its worker and the client's end by the client.
+
+struct LoopbackPipe;
+struct LoopbackHost;
+
+struct LoopbackConnection : Connection {
+    // Disconnects, if that hasn't happened yet
+    ~LoopbackConnection();
+
+    // Returns the next message from the other end, or NULL if there is
+    // none. The message is valid until the next call.
+    const Message *receive();
+
+    // Whether either end has disconnected, and everything the other end
+    // sent before has been received
+    bool isDisconnected() const;
+
+    virtual size_t send(OutgoingMessage &);
+    virtual void disconnect();
+    virtual void setPingInterval(enet_uint32) {}
+
+    virtual enet_uint32 getRoundTripTime() const { return 0; }
+    virtual enet_uint32 getRoundTripTimeVariance() const { return 0; }
+    virtual double getPacketLoss() const { return 0; }
+    virtual size_t getReliableDataInTransit() const { return 0; }
+
+private:
+    friend struct LoopbackHost;
+
+    LoopbackConnection(LoopbackPipe *pipe, bool serverSide);
+
+    LoopbackPipe *pipe;
+    bool serverSide;
+
+    // Last result of receive
+    Message *received;
+};
+
+// The server's side of the loopback connections, owned by a worker.
+// Clients connect from their own threads, and the worker waits for them
+// to connect or send something. Clients can keep their ends of the
+// connections after the server's ends and the host are gone, but not
+// use them while that happens.
+struct LoopbackHost {
+    LoopbackHost();
+    ~LoopbackHost();
+
+    LoopbackHost(const LoopbackHost &) = delete;
+    LoopbackHost &operator=(const LoopbackHost &) = delete;
+
+    // Called by clients. The data is passed on like ENet's connect data.
+    LoopbackConnection *connect(enet_uint32 data);
+
+    // Returns the server's end of a connection made since the last call,
+    // or NULL
+    LoopbackConnection *accept(enet_uint32 &data);
+
+    // Returns at the deadline, or earlier if a client has connected or
+    // sent something, or wake has been called
+    void wait(std::chrono::steady_clock::time_point deadline);
+    void wake();
+
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    // Set when there is something for the worker. Only the first of a
+    // series of wake calls needs to take the mutex.
+    std::atomic<bool> woken;
+
+    std::vector<std::pair<LoopbackConnection *, enet_uint32>> pending;
+};
+
+#endif
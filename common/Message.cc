@@ -1,9 +1,14 @@
 #include "Message.hh"
 
 #include "BitStream.hh"
+#include "MessageSchema.hh"
+#include "OrderCodec.hh"
 
 #include <cassert>
 
+static_assert(MessageSchema<Message::CLIENT_ORDER>::isFixed,
+              "Orders sent by clients should have a bounded size");
+
 Message::Message(Message::Type type)
     : type(type) {
     switch (type) { // ugh...
@@ -16,6 +21,68 @@ Message::Message(Message::Type type)
     case Message::SERVER_START:
         new(&server_start.settings) GameSettings;
         return;
+    case Message::CLIENT_SNAPSHOT:
+        new(&client_snapshot) Message::SnapshotChunk;
+        return;
+    case Message::SERVER_SNAPSHOT:
+        new(&server_snapshot) Message::SnapshotChunk;
+        return;
+    case Message::SERVER_MAP:
+        new(&server_map) Message::MapChunk;
+        return;
+    default:
+        return;
+    }
+}
+
+Message::Message(const Message &other)
+    : Message(other.type) {
+    switch (type) {
+    case Message::CLIENT_CONNECT:
+        client_connect = other.client_connect;
+        return;
+    case Message::CLIENT_ORDER:
+        client_order = other.client_order;
+        return;
+    case Message::CLIENT_TICK_ACK:
+        client_tick_ack = other.client_tick_ack;
+        return;
+    case Message::CLIENT_SNAPSHOT:
+        client_snapshot = other.client_snapshot;
+        return;
+    case Message::CLIENT_TIME_REQUEST:
+        client_time_request = other.client_time_request;
+        return;
+    case Message::CLIENT_STATE_HASH:
+        client_state_hash = other.client_state_hash;
+        return;
+    case Message::CLIENT_MAP_ACK:
+        client_map_ack = other.client_map_ack;
+        return;
+    case Message::SERVER_CONNECT:
+        server_connect = other.server_connect;
+        return;
+    case Message::SERVER_TICK:
+        server_tick = other.server_tick;
+        return;
+    case Message::SERVER_START:
+        server_start.settings = other.server_start.settings;
+        server_start.lateJoin = other.server_start.lateJoin;
+        server_start.stateHashInterval = other.server_start.stateHashInterval;
+        server_start.mapSize = other.server_start.mapSize;
+        return;
+    case Message::SERVER_SNAPSHOT_REQUEST:
+        server_snapshot_request = other.server_snapshot_request;
+        return;
+    case Message::SERVER_SNAPSHOT:
+        server_snapshot = other.server_snapshot;
+        return;
+    case Message::SERVER_TIME:
+        server_time = other.server_time;
+        return;
+    case Message::SERVER_MAP:
+        server_map = other.server_map;
+        return;
     default:
         return;
     }
@@ -32,68 +99,194 @@ Message::~Message() {
     case Message::SERVER_START:
         server_start.~ServerStart();
         return;
+    case Message::CLIENT_SNAPSHOT:
+        client_snapshot.~SnapshotChunk();
+        return;
+    case Message::SERVER_SNAPSHOT:
+        server_snapshot.~SnapshotChunk();
+        return;
+    case Message::SERVER_MAP:
+        server_map.~MapChunk();
+        return;
     default:
         return;
     }
 }
 
-ENetPacket *Message::toPacket() const {
-    BitStreamWriter writer;    
+const char *Message::getTypeName(Message::Type type) {
+    switch (type) {
+    case Message::CLIENT_CONNECT: return "CLIENT_CONNECT";
+    case Message::CLIENT_ORDER: return "CLIENT_ORDER";
+    case Message::CLIENT_TICK_ACK: return "CLIENT_TICK_ACK";
+    case Message::CLIENT_SNAPSHOT: return "CLIENT_SNAPSHOT";
+    case Message::CLIENT_TIME_REQUEST: return "CLIENT_TIME_REQUEST";
+    case Message::CLIENT_STATE_HASH: return "CLIENT_STATE_HASH";
+    case Message::CLIENT_MAP_ACK: return "CLIENT_MAP_ACK";
+    case Message::SERVER_CONNECT: return "SERVER_CONNECT";
+    case Message::SERVER_TICK: return "SERVER_TICK";
+    case Message::SERVER_START: return "SERVER_START";
+    case Message::SERVER_SNAPSHOT_REQUEST: return "SERVER_SNAPSHOT_REQUEST";
+    case Message::SERVER_SNAPSHOT: return "SERVER_SNAPSHOT";
+    case Message::SERVER_TIME: return "SERVER_TIME";
+    case Message::SERVER_MAP: return "SERVER_MAP";
+    default: return "UNDEFINED";
+    }
+}
+
+ENetPacket *Message::toPacket(OrderCodec *codec, enet_uint32 flags,
+                             OrderTraffic *traffic) const {
+    // Serialize straight into the packet's memory, so that there is
+    // only one allocation and no copy
+    size_t size;
+    if (codec) {
+        // Measuring must not change the state of the real codec
+        OrderCodec scratch(*codec);
+        BitStreamWriter counter(BitStreamWriter::COUNTING);
+        counter.setOrderCodec(&scratch);
+        write(counter, *this);
+        size = counter.size();
+    } else {
+        size = measure(*this);
+    }
+
+    ENetPacket *packet = enet_packet_create(NULL, size, flags);
+    assert(packet);
+
+    BitStreamWriter writer(packet->data, packet->dataLength);
+    writer.setOrderCodec(codec);
+    writer.setOrderTraffic(traffic);
     write(writer, *this);
+    assert(writer.size() == size);
 
-    return enet_packet_create(writer.ptr(),
-                              writer.size(),
-                              ENET_PACKET_FLAG_RELIABLE);
+    return packet;
 }
 
-void read(BitStreamReader &reader, Message &message) {
-    switch (message.type) {
-    case Message::UNDEFINED:
-        assert(false);
-        return;
-    case Message::CLIENT_CONNECT:
-        read(reader, message.client_connect.name);
-        return;
-    case Message::CLIENT_ORDER:
-        read(reader, message.client_order.order);
-        return;
-    case Message::CLIENT_TICK_DONE:
-        return;
-    case Message::SERVER_CONNECT:
-        read(reader, message.server_connect.yourPlayerId);
-        return;
-    case Message::SERVER_TICK:
-        read(reader, message.server_tick.orders);
-        return;
-    case Message::SERVER_START:
-        read(reader, message.server_start.settings);
-        return;
+MessagePool::MessagePool() {
+    for (size_t i = 0; i < Message::TYPE_MAX; i++)
+        messages[i] = new Message(static_cast<Message::Type>(i));
+}
+
+MessagePool::~MessagePool() {
+    for (size_t i = 0; i < Message::TYPE_MAX; i++)
+        delete messages[i];
+}
+
+const Message *MessagePool::decode(BitStreamReader &reader) {
+    uint64_t rawType = reader.readVarUint();
+
+    if (reader.hasFailed()
+        || rawType <= Message::UNDEFINED
+        || rawType >= Message::TYPE_MAX)
+        return NULL;
+
+    Message::Type type = static_cast<Message::Type>(rawType);
+
+    const WireSize &size(messageWireSize(type,
+                                         reader.getOrderCodec() != NULL));
+    size_t remaining = reader.remainingBits();
+
+    if (remaining < size.minBits)
+        return NULL;
+
+    // Messages of bounded size are checked once as a whole
+    bool checked = reader.isChecked();
+    if (size.isFixed && remaining >= size.maxBits)
+        reader.setChecked(false);
+
+    Message &message(*messages[type]);
+    read(reader, message);
+
+    reader.setChecked(checked);
+
+    if (reader.hasFailed())
+        return NULL;
+
+    return &message;
+}
+
+struct MessageSizeTable {
+    WireSize sizes[2][Message::TYPE_MAX];
+
+    MessageSizeTable() {
+        for (size_t i = Message::CLIENT_CONNECT; i < Message::TYPE_MAX; i++) {
+            Message::Type type = static_cast<Message::Type>(i);
+
+            sizes[0][i] = MessagePayloadSwitch::wireSizeOf(type);
+            sizes[1][i] = sizes[0][i];
+        }
+
+        sizes[1][Message::CLIENT_ORDER] = anyOrderWireSize(true);
     }
+};
+
+static const MessageSizeTable &messageSizeTable() {
+    static const MessageSizeTable table;
+    return table;
 }
 
-void write(BitStreamWriter &writer, const Message &message) {
-    write(writer, message.type);
+const WireSize &messageWireSize(Message::Type type, bool delta) {
+    assert(type > Message::UNDEFINED && type < Message::TYPE_MAX);
+    return messageSizeTable().sizes[delta][type];
+}
 
-    switch (message.type) {
-    case Message::UNDEFINED:
-        assert(false);
-        return;
-    case Message::CLIENT_CONNECT:
-        write(writer, message.client_connect.name);
-        return;
-    case Message::CLIENT_ORDER:
-        write(writer, message.client_order.order);
-        return;
-    case Message::CLIENT_TICK_DONE:
-        return;
-    case Message::SERVER_CONNECT:
-        write(writer, message.server_connect.yourPlayerId);
-        return;
-    case Message::SERVER_TICK:
-        write(writer, message.server_tick.orders);
-        return;
-    case Message::SERVER_START:
-        write(writer, message.server_start.settings);
+void read(BitStreamReader &reader, Message::TickRange &range) {
+    TickRangeSchema::decode(reader, range);
+
+    if (range.numTicks == 0)
+        reader.fail();
+}
+
+void write(BitStreamWriter &writer, const Message::TickRange &range) {
+    assert(range.numTicks > 0);
+    TickRangeSchema::encode(writer, range);
+}
+
+// Reads the data of a snapshot or map part straight out of the packet
+// into the vector, which keeps its capacity in pooled messages. The data
+// follows varints only, so it starts at a byte boundary.
+static void readChunkData(BitStreamReader &reader,
+                          std::vector<uint8_t> &data) {
+    size_t size = reader.readVarUint();
+    if (size > reader.remainingBits() / 8) {
+        reader.fail();
         return;
     }
+
+    ByteView view(reader.readView(size));
+    data.assign(view.data, view.data + view.size);
+}
+
+void read(BitStreamReader &reader, Message::SnapshotChunk &chunk) {
+    SnapshotChunkHeaderSchema::decode(reader, chunk);
+    readChunkData(reader, chunk.data);
+}
+
+void write(BitStreamWriter &writer, const Message::SnapshotChunk &chunk) {
+    SnapshotChunkHeaderSchema::encode(writer, chunk);
+
+    writer.writeVarUint(chunk.data.size());
+    if (!chunk.data.empty())
+        writer.writeBytes(&chunk.data[0], chunk.data.size());
+}
+
+void read(BitStreamReader &reader, Message::MapChunk &chunk) {
+    MapChunkHeaderSchema::decode(reader, chunk);
+    readChunkData(reader, chunk.data);
+}
+
+void write(BitStreamWriter &writer, const Message::MapChunk &chunk) {
+    MapChunkHeaderSchema::encode(writer, chunk);
+
+    writer.writeVarUint(chunk.data.size());
+    if (!chunk.data.empty())
+        writer.writeBytes(&chunk.data[0], chunk.data.size());
+}
+
+void read(BitStreamReader &reader, Message &message) {
+    MessagePayloadSwitch::decode(message.type, reader, message);
+}
+
+void write(BitStreamWriter &writer, const Message &message) {
+    MessageHeaderSchema::encode(writer, message);
+    MessagePayloadSwitch::encode(message.type, writer, message);
 }
@@ -11,6 +11,31 @@
 
 struct BitStreamReader;
 struct BitStreamWriter;
+struct OrderCodec;
+struct OrderTraffic;
+struct WireSize;
+
+// ENet channels used by client and server
+enum {
+    // Reliable, ordered messages
+    CHANNEL_RELIABLE,
+
+    // Unsequenced SERVER_TICK and CLIENT_TICK_ACK messages, which may be
+    // lost, duplicated or arrive out of order. Also used for the clock
+    // synchronization messages.
+    CHANNEL_TICKS,
+
+    // Reliable, ordered SERVER_MAP messages, so that a large custom map
+    // does not hold up the messages on CHANNEL_RELIABLE
+    CHANNEL_MAP,
+
+    NUM_CHANNELS
+};
+
+// Connect data of peers that only watch a match, e.g. relays. It is
+// combined with the id of the match to watch, or zero for the next one.
+// Other connect data is the id of a match to rejoin, if not zero.
+static const enet_uint32 CONNECT_SPECTATE = 0x80000000;
 
 struct Message {
     enum Type {
@@ -19,49 +44,215 @@ struct Message {
         // Messages sent by client
         CLIENT_CONNECT,
         CLIENT_ORDER,
-        CLIENT_TICK_DONE,
+        CLIENT_TICK_ACK,
+        CLIENT_SNAPSHOT,
+        CLIENT_TIME_REQUEST,
+        CLIENT_STATE_HASH,
+        CLIENT_MAP_ACK,
 
         // Messages sent by server
         SERVER_CONNECT,
         SERVER_TICK,
         SERVER_START,
+        SERVER_SNAPSHOT_REQUEST,
+        SERVER_SNAPSHOT,
+        SERVER_TIME,
+        SERVER_MAP,
+
+        TYPE_MAX
     };
 
     Type type;
 
     Message(Type);
+    Message(const Message &);
     ~Message();
 
+    Message &operator=(const Message &) = delete;
+
+    // E.g. "SERVER_TICK", for logs and statistics
+    static const char *getTypeName(Type);
+
     struct ClientConnect {
         std::string name;
     };
 
-    struct ServerTick {
+    struct ClientOrder {
+        Order order;
+    };
+
+    // Progress of the client, cumulative so that lost or reordered acks
+    // do not matter
+    struct ClientTickAck {
+        // Number of ticks received so far without gaps
+        uint32_t ticksReceived;
+
+        // Number of ticks completed so far
+        uint32_t ticksDone;
+    };
+
+    // Asks the server for its clock, which is answered by SERVER_TIME.
+    // Times are in microseconds.
+    struct ClientTimeRequest {
+        // The client's clock when sending this
+        uint64_t clientTime;
+    };
+
+    // Hash of the client's game state after the given number of ticks
+    // (see Sim::hashState), if the server asked for them
+    struct ClientStateHash {
+        uint32_t tick;
+        uint32_t hash;
+    };
+
+    // Number of bytes of the custom map received so far, sent every now
+    // and then during the transfer and once it is complete
+    struct ClientMapAck {
+        uint32_t received;
+    };
+
+    struct ServerConnect {
+        PlayerId yourPlayerId;
+
+        // Can be passed when connecting again to rejoin the match
+        uint32_t matchId;
+    };
+
+    // A tick with the given orders, followed by numTicks - 1 empty ticks
+    struct TickRange {
+        uint32_t numTicks;
         std::vector<Order> orders;
     };
 
+    // Tick packets are not delivered reliably. Instead, every one repeats
+    // the ticks that the client has not acknowledged yet, starting with
+    // tick number firstTick.
+    struct ServerTick {
+        uint32_t firstTick;
+
+        // Number of ticks the server has sent ahead of
+        // the time at which they should be run
+        uint8_t ticksAhead;
+
+        std::vector<TickRange> ranges;
+    };
+
     struct ServerStart {
         GameSettings settings;
+
+        // Set if the game is already running. Its state follows as
+        // SERVER_SNAPSHOT messages, and then the ticks after it. Also
+        // sent to clients whose state is found to differ from the
+        // server's, which then continue from the server's state.
+        uint8_t lateJoin;
+
+        // Players send CLIENT_STATE_HASH after every so many ticks, if
+        // not zero. Only servers running the game themselves ask for it.
+        uint32_t stateHashInterval;
+
+        // Size of the custom map (see CustomMap) that follows as
+        // SERVER_MAP messages, or zero if the map is generated from the
+        // random seed. Not sent to late joiners, since their snapshot
+        // includes the map.
+        uint32_t mapSize;
     };
 
-    union {
-        ClientConnect client_connect;
+    // Asks a client for a snapshot of its game state, taken after it has
+    // run at least the given number of ticks
+    struct ServerSnapshotRequest {
+        uint32_t minTick;
+    };
+
+    // Part of a snapshot of the game state after the given number of
+    // ticks (see SimState::writeSnapshot). Snapshots are sent in parts
+    // of limited size, so that they don't hold up other messages.
+    struct SnapshotChunk {
+        uint32_t tick;
 
-        struct {
-            Order order;
-        } client_order;
+        // Size of the whole snapshot, and position of this part
+        uint32_t size;
+        uint32_t offset;
+
+        std::vector<uint8_t> data;
+    };
+
+    // Part of the encoded custom map. Unlike other messages, these are
+    // sent on CHANNEL_MAP, so they can arrive before SERVER_START.
+    struct MapChunk {
+        // Size of the whole map, and position of this part
+        uint32_t size;
+        uint32_t offset;
+
+        std::vector<uint8_t> data;
+    };
 
-        struct {
-            PlayerId yourPlayerId;
-        } server_connect;
+    struct ServerTime {
+        // From the request being answered
+        uint64_t clientTime;
 
+        // Time since the first tick of the match was due. Tick N is meant
+        // to be run from serverTime = N * tickLengthMs on.
+        uint64_t serverTime;
+    };
+
+    union {
+        ClientConnect client_connect;
+        ClientOrder client_order;
+        ClientTickAck client_tick_ack;
+        SnapshotChunk client_snapshot;
+        ClientTimeRequest client_time_request;
+        ClientStateHash client_state_hash;
+        ClientMapAck client_map_ack;
+        ServerConnect server_connect;
         ServerStart server_start;
         ServerTick server_tick;
+        ServerSnapshotRequest server_snapshot_request;
+        SnapshotChunk server_snapshot;
+        ServerTime server_time;
+        MapChunk server_map;
     };
 
-    ENetPacket *toPacket() const;
+    // Orders are encoded with the given codec, if any, and counted in
+    // the given traffic
+    ENetPacket *toPacket(OrderCodec *codec = NULL,
+                         enet_uint32 flags = ENET_PACKET_FLAG_RELIABLE,
+                         OrderTraffic *traffic = NULL) const;
 };
 
+// Keeps one message of every type around for decoding, so that
+// received messages reuse the storage of their predecessors
+// (e.g. the order vector of SERVER_TICK) instead of allocating.
+//
+// The returned message is only valid until the next message of
+// the same type is decoded.
+struct MessagePool {
+    MessagePool();
+    ~MessagePool();
+
+    MessagePool(const MessagePool &) = delete;
+    MessagePool &operator=(const MessagePool &) = delete;
+
+    // Reads the message type and then the message. Returns NULL if the
+    // data is malformed.
+    const Message *decode(BitStreamReader &);
+
+private:
+    Message *messages[Message::TYPE_MAX];
+};
+
+// Size bounds of message payloads (excluding the type), with or without
+// delta compression of orders by an OrderCodec
+const WireSize &messageWireSize(Message::Type, bool delta);
+
+void read(BitStreamReader &, Message::TickRange &);
+void write(BitStreamWriter &, const Message::TickRange &);
+
+void read(BitStreamReader &, Message::SnapshotChunk &);
+void write(BitStreamWriter &, const Message::SnapshotChunk &);
+
+void read(BitStreamReader &, Message::MapChunk &);
+void write(BitStreamWriter &, const Message::MapChunk &);
+
 // NOTE: Assumes message type has already been read
 void read(BitStreamReader &, Message &);
 
@@ -0,0 +1,223 @@
+#ifndef STRAT_COMMON_MESSAGE_SCHEMA_HH
+#define STRAT_COMMON_MESSAGE_SCHEMA_HH
+
+#include "Schema.hh"
+#include "Order.hh"
+#include "Message.hh"
+
+// Wire format of orders and messages. When adding a new order or message
+// type, its fields only need to be listed here.
+//
+// Sizes are known at compile time, e.g.
+// MessageSchema<Message::CLIENT_ORDER>::maxBits.
+
+// Order and building types are written with a fixed number of bits,
+// everything else as varints.
+constexpr size_t ORDER_TYPE_BITS = bitsRequired(Order::TYPE_MAX - 1);
+constexpr size_t BUILDING_TYPE_BITS = bitsRequired(BUILDING_MAX - 1);
+
+template<Order::Type Type>
+struct OrderSchema;
+
+template<>
+struct OrderSchema<Order::BUILD> : Schema<
+    NESTED_FIELD(Order::build, Schema<
+        VAR_FIELD(Order::Build::objectId),
+        BITS_FIELD(Order::Build::type, BUILDING_TYPE_BITS),
+        VAR_FIELD(Order::Build::x),
+        VAR_FIELD(Order::Build::y)>)> {
+};
+
+template<>
+struct OrderSchema<Order::CONSTRUCT> : Schema<
+    NESTED_FIELD(Order::construct, Schema<
+        VAR_FIELD(Order::Construct::queue),
+        VAR_FIELD(Order::Construct::from),
+        VAR_FIELD(Order::Construct::to)>)> {
+};
+
+template<>
+struct OrderSchema<Order::ATTACK> : Schema<
+    NESTED_FIELD(Order::attack, Schema<
+        VAR_FIELD(Order::Attack::objectId),
+        VAR_FIELD(Order::Attack::x),
+        VAR_FIELD(Order::Attack::y)>)> {
+};
+
+template<>
+struct OrderSchema<Order::STOP> : Schema<
+    NESTED_FIELD(Order::stop, Schema<
+        VAR_FIELD(Order::Stop::objectId)>)> {
+};
+
+template<>
+struct OrderSchema<Order::REMOVE> : Schema<
+    NESTED_FIELD(Order::remove, Schema<
+        VAR_FIELD(Order::Remove::objectId)>)> {
+};
+
+template<>
+struct OrderSchema<Order::RAISE_MAP> : Schema<
+    NESTED_FIELD(Order::raiseMap, Schema<
+        VAR_FIELD(Order::RaiseMap::x),
+        VAR_FIELD(Order::RaiseMap::y),
+        VAR_FIELD(Order::RaiseMap::w),
+        VAR_FIELD(Order::RaiseMap::h)>)> {
+};
+
+typedef Schema<
+    VAR_FIELD(Order::player),
+    BITS_FIELD(Order::type, ORDER_TYPE_BITS)> OrderHeaderSchema;
+
+typedef SchemaSwitch<Order::Type, OrderSchema,
+                     Order::BUILD, Order::TYPE_MAX> OrderPayloadSwitch;
+
+// Complete order: header, followed by the payload for its type
+struct OrderFormat {
+    static constexpr size_t minBits =
+        OrderHeaderSchema::minBits + OrderPayloadSwitch::minBits;
+    static constexpr size_t maxBits =
+        OrderHeaderSchema::maxBits + OrderPayloadSwitch::maxBits;
+    static constexpr bool isFixed = OrderPayloadSwitch::isFixed;
+
+    static void encode(BitStreamWriter &writer, const Order &order) {
+        OrderHeaderSchema::encode(writer, order);
+        OrderPayloadSwitch::encode(order.type, writer, order);
+    }
+
+    static void decode(BitStreamReader &reader, Order &order) {
+        OrderHeaderSchema::decode(reader, order);
+        OrderPayloadSwitch::decode(order.type, reader, order);
+    }
+};
+
+// Order inside a message. It goes through read and write for Order, so
+// that it is encoded by the stream's OrderCodec, if any. The bounds are
+// those without a codec; see messageWireSize for the others.
+struct MessageOrderFormat {
+    static constexpr size_t minBits = OrderFormat::minBits;
+    static constexpr size_t maxBits = OrderFormat::maxBits;
+    static constexpr bool isFixed = OrderFormat::isFixed;
+
+    static void encode(BitStreamWriter &writer, const Order &order) {
+        write(writer, order);
+    }
+
+    static void decode(BitStreamReader &reader, Order &order) {
+        read(reader, order);
+    }
+};
+
+template<Message::Type Type>
+struct MessageSchema;
+
+template<>
+struct MessageSchema<Message::CLIENT_CONNECT> : Schema<
+    NESTED_FIELD(Message::client_connect, Schema<
+        DYNAMIC_FIELD(Message::ClientConnect::name)>)> {
+};
+
+template<>
+struct MessageSchema<Message::CLIENT_ORDER> : Schema<
+    NESTED_FIELD(Message::client_order, Schema<
+        NESTED_FIELD(Message::ClientOrder::order, MessageOrderFormat)>)> {
+};
+
+template<>
+struct MessageSchema<Message::CLIENT_TICK_ACK> : Schema<
+    NESTED_FIELD(Message::client_tick_ack, Schema<
+        VAR_FIELD(Message::ClientTickAck::ticksReceived),
+        VAR_FIELD(Message::ClientTickAck::ticksDone)>)> {
+};
+
+typedef Schema<
+    VAR_FIELD(Message::SnapshotChunk::tick),
+    VAR_FIELD(Message::SnapshotChunk::size),
+    VAR_FIELD(Message::SnapshotChunk::offset)> SnapshotChunkHeaderSchema;
+
+template<>
+struct MessageSchema<Message::CLIENT_SNAPSHOT> : Schema<
+    DYNAMIC_FIELD(Message::client_snapshot)> {
+};
+
+template<>
+struct MessageSchema<Message::CLIENT_TIME_REQUEST> : Schema<
+    NESTED_FIELD(Message::client_time_request, Schema<
+        VAR_FIELD(Message::ClientTimeRequest::clientTime)>)> {
+};
+
+template<>
+struct MessageSchema<Message::CLIENT_STATE_HASH> : Schema<
+    NESTED_FIELD(Message::client_state_hash, Schema<
+        VAR_FIELD(Message::ClientStateHash::tick),
+        BITS_FIELD(Message::ClientStateHash::hash, 32)>)> {
+};
+
+template<>
+struct MessageSchema<Message::CLIENT_MAP_ACK> : Schema<
+    NESTED_FIELD(Message::client_map_ack, Schema<
+        VAR_FIELD(Message::ClientMapAck::received)>)> {
+};
+
+template<>
+struct MessageSchema<Message::SERVER_CONNECT> : Schema<
+    NESTED_FIELD(Message::server_connect, Schema<
+        VAR_FIELD(Message::ServerConnect::yourPlayerId),
+        VAR_FIELD(Message::ServerConnect::matchId)>)> {
+};
+
+typedef Schema<
+    VAR_FIELD(Message::TickRange::numTicks),
+    DYNAMIC_FIELD(Message::TickRange::orders)> TickRangeSchema;
+
+template<>
+struct MessageSchema<Message::SERVER_TICK> : Schema<
+    NESTED_FIELD(Message::server_tick, Schema<
+        VAR_FIELD(Message::ServerTick::firstTick),
+        VAR_FIELD(Message::ServerTick::ticksAhead),
+        DYNAMIC_FIELD(Message::ServerTick::ranges)>)> {
+};
+
+template<>
+struct MessageSchema<Message::SERVER_START> : Schema<
+    NESTED_FIELD(Message::server_start, Schema<
+        DYNAMIC_FIELD(Message::ServerStart::settings),
+        VAR_FIELD(Message::ServerStart::lateJoin),
+        VAR_FIELD(Message::ServerStart::stateHashInterval),
+        VAR_FIELD(Message::ServerStart::mapSize)>)> {
+};
+
+template<>
+struct MessageSchema<Message::SERVER_SNAPSHOT_REQUEST> : Schema<
+    NESTED_FIELD(Message::server_snapshot_request, Schema<
+        VAR_FIELD(Message::ServerSnapshotRequest::minTick)>)> {
+};
+
+template<>
+struct MessageSchema<Message::SERVER_SNAPSHOT> : Schema<
+    DYNAMIC_FIELD(Message::server_snapshot)> {
+};
+
+template<>
+struct MessageSchema<Message::SERVER_TIME> : Schema<
+    NESTED_FIELD(Message::server_time, Schema<
+        VAR_FIELD(Message::ServerTime::clientTime),
+        VAR_FIELD(Message::ServerTime::serverTime)>)> {
+};
+
+typedef Schema<
+    VAR_FIELD(Message::MapChunk::size),
+    VAR_FIELD(Message::MapChunk::offset)> MapChunkHeaderSchema;
+
+template<>
+struct MessageSchema<Message::SERVER_MAP> : Schema<
+    DYNAMIC_FIELD(Message::server_map)> {
+};
+
+typedef Schema<VAR_FIELD(Message::type)> MessageHeaderSchema;
+
+typedef SchemaSwitch<Message::Type, MessageSchema,
+                     Message::CLIENT_CONNECT, Message::TYPE_MAX>
+    MessagePayloadSwitch;
+
+#endif
@@ -1,83 +1,114 @@
 #include "Order.hh"
 
 #include "BitStream.hh"
+#include "MessageSchema.hh"
+#include "OrderCodec.hh"
+#include "Traffic.hh"
 
+#include <algorithm>
 #include <cassert>
 
-void read(BitStreamReader &reader, Order &order) {
-    read(reader, order.player);
-    read(reader, order.type);
+struct OrderSizeTable {
+    WireSize sizes[2][Order::TYPE_MAX];
+    WireSize any[2];
 
-    switch (order.type) {
-    case Order::UNDEFINED:
-        assert(false);
-        return;
-    case Order::BUILD:
-        read(reader, order.build.objectId);
-        read(reader, order.build.type);
-        read(reader, order.build.x);
-        read(reader, order.build.y);
-        return;
-    case Order::CONSTRUCT:
-        read(reader, order.construct.queue);
-        read(reader, order.construct.from);
-        read(reader, order.construct.to);
-        return;
-    case Order::ATTACK:
-        read(reader, order.attack.objectId);
-        read(reader, order.attack.x);
-        read(reader, order.attack.y);
-        return;
-    case Order::STOP:
-        read(reader, order.stop.objectId);
-        return;
-    case Order::REMOVE:
-        read(reader, order.remove.objectId);
-        return;
-    case Order::RAISE_MAP:
-        read(reader, order.raiseMap.x);
-        read(reader, order.raiseMap.y);
-        read(reader, order.raiseMap.w);
-        read(reader, order.raiseMap.h);
-        return;
+    OrderSizeTable() {
+        for (size_t delta = 0; delta < 2; delta++) {
+            any[delta].minBits = static_cast<size_t>(-1);
+            any[delta].maxBits = 0;
+            any[delta].isFixed = true;
+
+            for (size_t i = Order::BUILD; i < Order::TYPE_MAX; i++) {
+                Order::Type type = static_cast<Order::Type>(i);
+
+                WireSize &size(sizes[delta][i]);
+                if (delta) {
+                    size = OrderCodec::wireSize(type);
+                } else {
+                    size = OrderPayloadSwitch::wireSizeOf(type);
+                    size.minBits += OrderHeaderSchema::minBits;
+                    size.maxBits += OrderHeaderSchema::maxBits;
+                }
+
+                any[delta].minBits = std::min(any[delta].minBits, size.minBits);
+                any[delta].maxBits = std::max(any[delta].maxBits, size.maxBits);
+                any[delta].isFixed = any[delta].isFixed && size.isFixed;
+            }
+        }
+    }
+};
+
+// Built on first use, so that it can be used during static initialization
+static const OrderSizeTable &orderSizeTable() {
+    static const OrderSizeTable table;
+    return table;
+}
+
+const WireSize &orderWireSize(Order::Type type, bool delta) {
+    assert(type > Order::UNDEFINED && type < Order::TYPE_MAX);
+    return orderSizeTable().sizes[delta][type];
+}
+
+const WireSize &anyOrderWireSize(bool delta) {
+    return orderSizeTable().any[delta];
+}
+
+const char *Order::getTypeName(Order::Type type) {
+    switch (type) {
+    case Order::BUILD: return "BUILD";
+    case Order::CONSTRUCT: return "CONSTRUCT";
+    case Order::ATTACK: return "ATTACK";
+    case Order::STOP: return "STOP";
+    case Order::REMOVE: return "REMOVE";
+    case Order::RAISE_MAP: return "RAISE_MAP";
+    default: return "UNDEFINED";
     }
 }
 
+void read(BitStreamReader &reader, Order &order) {
+    size_t remaining = reader.remainingBits();
+
+    if (reader.getOrderCodec())
+        reader.getOrderCodec()->decode(reader, order);
+    else
+        OrderFormat::decode(reader, order);
+
+    if (reader.getOrderTraffic() && !reader.hasFailed())
+        reader.getOrderTraffic()->add(order.type,
+                                      remaining - reader.remainingBits());
+}
+
 void write(BitStreamWriter &writer, const Order &order) {
-    write(writer, order.player);
-    write(writer, order.type);
+    size_t start = writer.bitSize();
 
-    switch (order.type) {
-    case Order::UNDEFINED:
-        assert(false);
-        return;
-    case Order::BUILD:
-        write(writer, order.build.objectId);
-        write(writer, order.build.type);
-        write(writer, order.build.x);
-        write(writer, order.build.y);
-        return;
-    case Order::CONSTRUCT:
-        write(writer, order.construct.queue);
-        write(writer, order.construct.from);
-        write(writer, order.construct.to);
-        return;
-    case Order::ATTACK:
-        write(writer, order.attack.objectId);
-        write(writer, order.attack.x);
-        write(writer, order.attack.y);
-        return;
-    case Order::STOP:
-        write(writer, order.stop.objectId);
-        return;
-    case Order::REMOVE:
-        write(writer, order.remove.objectId);
-        return;
-    case Order::RAISE_MAP:
-        write(writer, order.raiseMap.x);
-        write(writer, order.raiseMap.y);
-        write(writer, order.raiseMap.w);
-        write(writer, order.raiseMap.h);
+    if (writer.getOrderCodec())
+        writer.getOrderCodec()->encode(writer, order);
+    else
+        OrderFormat::encode(writer, order);
+
+    if (writer.getOrderTraffic())
+        writer.getOrderTraffic()->add(order.type, writer.bitSize() - start);
+}
+
+void read(BitStreamReader &reader, std::vector<Order> &orders) {
+    const WireSize &size(anyOrderWireSize(reader.getOrderCodec() != nullptr));
+
+    size_t count = reader.readVarUint();
+    if (count > reader.remainingBits() / size.minBits) {
+        reader.fail();
         return;
     }
+
+    orders.resize(count);
+
+    // If even the largest orders would fit, nothing can be read out of
+    // bounds, so there is no need to check every field
+    bool checked = reader.isChecked();
+    if (count <= reader.remainingBits() / size.maxBits)
+        reader.setChecked(false);
+
+    for (auto &order : orders)
+        read(reader, order);
+
+    reader.setChecked(checked);
 }
@@ -3,8 +3,11 @@
 
 #include "Defs.hh"
 
+#include <vector>
+
 struct BitStreamReader;
 struct BitStreamWriter;
+struct WireSize;
 
 struct Order {
     enum Type {
@@ -16,46 +19,67 @@ struct Order {
         STOP,
         REMOVE,
         RAISE_MAP,
+
+        TYPE_MAX
     } type;
 
     Order(Type type = UNDEFINED)
         : type(type) {
     }
 
+    // E.g. "BUILD", for logs and statistics
+    static const char *getTypeName(Type);
+
     PlayerId player;
 
+    struct Build {
+        ObjectId objectId;
+        BuildingType type;
+        uint16_t x, y;
+    };
+
+    struct Construct {
+        uint16_t queue;
+        ObjectId from, to;
+    };
+
+    struct Attack {
+        ObjectId objectId;
+        uint16_t x, y;
+    };
+
+    struct Stop {
+        ObjectId objectId;
+    };
+
+    struct Remove {
+        ObjectId objectId;
+    };
+
+    struct RaiseMap {
+        uint16_t x, y, w, h;
+    };
+
     union {
-        struct {
-            ObjectId objectId;
-            BuildingType type;
-            uint16_t x, y;
-        } build;
-
-        struct {
-            uint16_t queue;
-            ObjectId from, to;
-        } construct;
-
-        struct {
-            ObjectId objectId;
-            uint16_t x, y;
-        } attack;
-
-        struct {
-            ObjectId objectId;
-        } stop;
-
-        struct { 
-            ObjectId objectId;
-        } remove;
-
-        struct {
-            uint16_t x, y, w, h;
-        } raiseMap;
+        Build build;
+        Construct construct;
+        Attack attack;
+        Stop stop;
+        Remove remove;
+        RaiseMap raiseMap;
     };
 };
 
 void read(BitStreamReader &, Order &);
 void write(BitStreamWriter &, const Order &);
 
+// Checks the number of orders against the remaining data once, and
+// then decodes them without checking each field if possible
+void read(BitStreamReader &, std::vector<Order> &);
+
+// Size bounds of encoded orders, with or without delta compression
+// by an OrderCodec
+const WireSize &orderWireSize(Order::Type, bool delta);
+const WireSize &anyOrderWireSize(bool delta);
+
 #endif
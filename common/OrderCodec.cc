@@ -0,0 +1,222 @@
+#include "OrderCodec.hh"
+
+#include "BitStream.hh"
+#include "MessageSchema.hh"
+
+#include <cassert>
+
+// An object id is written as one bit telling whether it is in the list
+// of recent ids, followed by either its index in the list or the
+// difference to the most recent id (new buildings get increasing ids).
+static const size_t RECENT_ID_BITS = bitsRequired(OrderCodec::NUM_RECENT_IDS - 1);
+
+// Differences are zig-zag encoded, so they take one bit more than the
+// values. Decoding reads no more than these, so the bounds below hold
+// for any data.
+static const size_t ID_DELTA_BITS = sizeof(ObjectId) * 8 + 1;
+static const size_t COORD_DELTA_BITS = sizeof(uint16_t) * 8 + 1;
+
+// Bounds for the encoded parts of an order
+static const size_t PLAYER_MIN_BITS = 1;
+static const size_t PLAYER_MAX_BITS = 1 + maxVarintBits(sizeof(PlayerId) * 8);
+static const size_t ID_MIN_BITS = 1 + RECENT_ID_BITS;
+static const size_t ID_MAX_BITS = 1 + maxVarintBits(ID_DELTA_BITS);
+static const size_t DELTA_MIN_BITS = 8;
+static const size_t DELTA_MAX_BITS = maxVarintBits(COORD_DELTA_BITS);
+static const size_t QUEUE_MIN_BITS = 8;
+static const size_t QUEUE_MAX_BITS =
+    maxVarintBits(sizeof(Order::Construct::queue) * 8);
+
+WireSize OrderCodec::wireSize(Order::Type type) {
+    WireSize size = { PLAYER_MIN_BITS + ORDER_TYPE_BITS,
+                      PLAYER_MAX_BITS + ORDER_TYPE_BITS,
+                      true };
+
+    switch (type) {
+    case Order::BUILD:
+        size.minBits += ID_MIN_BITS + BUILDING_TYPE_BITS + 2 * DELTA_MIN_BITS;
+        size.maxBits += ID_MAX_BITS + BUILDING_TYPE_BITS + 2 * DELTA_MAX_BITS;
+        break;
+    case Order::CONSTRUCT:
+        size.minBits += QUEUE_MIN_BITS + 2 * ID_MIN_BITS;
+        size.maxBits += QUEUE_MAX_BITS + 2 * ID_MAX_BITS;
+        break;
+    case Order::ATTACK:
+        size.minBits += ID_MIN_BITS + 2 * DELTA_MIN_BITS;
+        size.maxBits += ID_MAX_BITS + 2 * DELTA_MAX_BITS;
+        break;
+    case Order::STOP:
+    case Order::REMOVE:
+        size.minBits += ID_MIN_BITS;
+        size.maxBits += ID_MAX_BITS;
+        break;
+    case Order::RAISE_MAP:
+        size.minBits += 4 * DELTA_MIN_BITS;
+        size.maxBits += 4 * DELTA_MAX_BITS;
+        break;
+    default:
+        assert(false);
+        break;
+    }
+
+    return size;
+}
+
+OrderCodec::OrderCodec() {
+    reset();
+}
+
+void OrderCodec::reset() {
+    for (size_t i = 0; i < NUM_RECENT_IDS; i++)
+        recentIds[i] = 0;
+
+    lastPlayer = 0;
+    lastBuild = Order::Build();
+    lastAttack = Order::Attack();
+    lastRaiseMap = Order::RaiseMap();
+}
+
+void OrderCodec::encode(BitStreamWriter &writer, const Order &order) {
+    assert(order.type > Order::UNDEFINED && order.type < Order::TYPE_MAX);
+
+    write(writer, order.player == lastPlayer);
+    if (order.player != lastPlayer) {
+        write(writer, order.player);
+        lastPlayer = order.player;
+    }
+
+    writer.writeBits(order.type, ORDER_TYPE_BITS);
+
+    switch (order.type) {
+    case Order::BUILD:
+        encodeId(writer, order.build.objectId);
+        writer.writeBits(order.build.type, BUILDING_TYPE_BITS);
+        encodeDelta(writer, order.build.x, lastBuild.x);
+        encodeDelta(writer, order.build.y, lastBuild.y);
+        lastBuild = order.build;
+        return;
+    case Order::CONSTRUCT:
+        write(writer, order.construct.queue);
+        encodeId(writer, order.construct.from);
+        encodeId(writer, order.construct.to);
+        return;
+    case Order::ATTACK:
+        encodeId(writer, order.attack.objectId);
+        encodeDelta(writer, order.attack.x, lastAttack.x);
+        encodeDelta(writer, order.attack.y, lastAttack.y);
+        lastAttack = order.attack;
+        return;
+    case Order::STOP:
+        encodeId(writer, order.stop.objectId);
+        return;
+    case Order::REMOVE:
+        encodeId(writer, order.remove.objectId);
+        return;
+    case Order::RAISE_MAP:
+        encodeDelta(writer, order.raiseMap.x, lastRaiseMap.x);
+        encodeDelta(writer, order.raiseMap.y, lastRaiseMap.y);
+        encodeDelta(writer, order.raiseMap.w, lastRaiseMap.w);
+        encodeDelta(writer, order.raiseMap.h, lastRaiseMap.h);
+        lastRaiseMap = order.raiseMap;
+        return;
+    default:
+        assert(false);
+        return;
+    }
+}
+
+void OrderCodec::decode(BitStreamReader &reader, Order &order) {
+    bool samePlayer;
+    read(reader, samePlayer);
+    if (!samePlayer)
+        read(reader, lastPlayer);
+    order.player = lastPlayer;
+
+    order.type = static_cast<Order::Type>(reader.readBits(ORDER_TYPE_BITS));
+
+    switch (order.type) {
+    case Order::BUILD:
+        order.build.objectId = decodeId(reader);
+        order.build.type = static_cast<BuildingType>(
+            reader.readBits(BUILDING_TYPE_BITS));
+        order.build.x = decodeDelta(reader, lastBuild.x);
+        order.build.y = decodeDelta(reader, lastBuild.y);
+        lastBuild = order.build;
+        return;
+    case Order::CONSTRUCT:
+        read(reader, order.construct.queue);
+        order.construct.from = decodeId(reader);
+        order.construct.to = decodeId(reader);
+        return;
+    case Order::ATTACK:
+        order.attack.objectId = decodeId(reader);
+        order.attack.x = decodeDelta(reader, lastAttack.x);
+        order.attack.y = decodeDelta(reader, lastAttack.y);
+        lastAttack = order.attack;
+        return;
+    case Order::STOP:
+        order.stop.objectId = decodeId(reader);
+        return;
+    case Order::REMOVE:
+        order.remove.objectId = decodeId(reader);
+        return;
+    case Order::RAISE_MAP:
+        order.raiseMap.x = decodeDelta(reader, lastRaiseMap.x);
+        order.raiseMap.y = decodeDelta(reader, lastRaiseMap.y);
+        order.raiseMap.w = decodeDelta(reader, lastRaiseMap.w);
+        order.raiseMap.h = decodeDelta(reader, lastRaiseMap.h);
+        lastRaiseMap = order.raiseMap;
+        return;
+    default:
+        reader.fail();
+        return;
+    }
+}
+
+void OrderCodec::encodeId(BitStreamWriter &writer, ObjectId id) {
+    for (size_t i = 0; i < NUM_RECENT_IDS; i++) {
+        if (recentIds[i] == id) {
+            write(writer, true);
+            writer.writeBits(i, RECENT_ID_BITS);
+            useId(i, id);
+            return;
+        }
+    }
+
+    write(writer, false);
+    writer.writeVarInt(static_cast<int64_t>(id) - recentIds[0]);
+    useId(NUM_RECENT_IDS - 1, id);
+}
+
+ObjectId OrderCodec::decodeId(BitStreamReader &reader) {
+    bool recent;
+    read(reader, recent);
+
+    if (recent) {
+        size_t index = reader.readBits(RECENT_ID_BITS);
+        ObjectId id = recentIds[index];
+        useId(index, id);
+        return id;
+    } else {
+        ObjectId id = static_cast<ObjectId>(
+            recentIds[0] + reader.readVarInt(ID_DELTA_BITS));
+        useId(NUM_RECENT_IDS - 1, id);
+        return id;
+    }
+}
+
+void OrderCodec::useId(size_t index, ObjectId id) {
+    // Move to the front, dropping the entry at index
+    for (size_t i = index; i > 0; i--)
+        recentIds[i] = recentIds[i - 1];
+    recentIds[0] = id;
+}
+
+void OrderCodec::encodeDelta(BitStreamWriter &writer, uint16_t value,
+                             uint16_t last) {
+    writer.writeVarInt(static_cast<int32_t>(value) - last);
+}
+
+uint16_t OrderCodec::decodeDelta(BitStreamReader &reader, uint16_t last) {
+    return static_cast<uint16_t>(last + reader.readVarInt(COORD_DELTA_BITS));
+}
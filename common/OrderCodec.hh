@@ -0,0 +1,58 @@
+#ifndef STRAT_COMMON_ORDER_CODEC_HH
+#define STRAT_COMMON_ORDER_CODEC_HH
+
+#include "Order.hh"
+
+struct BitStreamReader;
+struct BitStreamWriter;
+struct WireSize;
+
+// Stateful order encoding for one direction of one connection.
+//
+// Object ids are looked up in a small list of recently used ids, and
+// coordinates are written as deltas to the last order of the same type.
+// Consecutive orders from the same buildings or next to each other thus
+// only take a few bits.
+//
+// Encoder and decoder keep their state in sync by seeing the same orders
+// in the same sequence, so this must only be used on a reliable and
+// sequenced channel, with one OrderCodec on each end.
+//
+// A codec is used by setting it on a BitStreamWriter or BitStreamReader;
+// read/write for Order then go through it.
+struct OrderCodec {
+    OrderCodec();
+
+    void encode(BitStreamWriter &, const Order &);
+    void decode(BitStreamReader &, Order &);
+
+    void reset();
+
+    // Bounds for the size of an encoded order
+    static WireSize wireSize(Order::Type);
+
+    enum {
+        NUM_RECENT_IDS = 8
+    };
+
+private:
+
+    // Most recently used first
+    ObjectId recentIds[NUM_RECENT_IDS];
+
+    PlayerId lastPlayer;
+
+    // Coordinates are relative to these
+    Order::Build lastBuild;
+    Order::Attack lastAttack;
+    Order::RaiseMap lastRaiseMap;
+
+    void encodeId(BitStreamWriter &, ObjectId);
+    ObjectId decodeId(BitStreamReader &);
+    void useId(size_t index, ObjectId);
+
+    void encodeDelta(BitStreamWriter &, uint16_t value, uint16_t last);
+    uint16_t decodeDelta(BitStreamReader &, uint16_t last);
+};
+
+#endif
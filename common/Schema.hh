@@ -0,0 +1,241 @@
+#ifndef STRAT_COMMON_SCHEMA_HH
+#define STRAT_COMMON_SCHEMA_HH
+
+#include "BitStream.hh"
+
+#include <cstddef>
+#include <cassert>
+#include <type_traits>
+
+// A Schema describes the wire format of a struct as a list of fields.
+// Both encoding and decoding are generated from the same description,
+// so they can not get out of sync.
+//
+// Every field knows how many bits it takes up on the wire at least and
+// at most. For fields of variable length (strings, vectors) isFixed is
+// false and maxBits only counts what is known statically.
+
+// Most bits that BitStreamReader::readVarUint(valueBits) reads
+constexpr size_t maxVarintBits(size_t valueBits) {
+    return (valueBits + 6) / 7 * 8;
+}
+
+constexpr size_t constMin(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+constexpr size_t constMax(size_t a, size_t b) {
+    return a > b ? a : b;
+}
+
+// Integer or enum, written as a varint
+template<typename MemberPtr, MemberPtr Member>
+struct VarField;
+
+template<typename Struct, typename T, T Struct::*Member>
+struct VarField<T Struct::*, Member> {
+    static_assert(std::is_integral<T>::value || std::is_enum<T>::value,
+                  "VarField needs an integer or enum");
+
+    static constexpr size_t minBits = 8;
+    static constexpr size_t maxBits = maxVarintBits(sizeof(T) * 8);
+    static constexpr bool isFixed = true;
+
+    static void encode(BitStreamWriter &writer, const Struct &s) {
+        write(writer, s.*Member);
+    }
+
+    static void decode(BitStreamReader &reader, Struct &s) {
+        read(reader, s.*Member);
+    }
+};
+
+// Integer or enum with a known range, written with a fixed number of bits
+template<typename MemberPtr, MemberPtr Member, size_t Bits>
+struct BitsField;
+
+template<typename Struct, typename T, T Struct::*Member, size_t Bits>
+struct BitsField<T Struct::*, Member, Bits> {
+    static_assert(Bits <= 32, "BitsField can have at most 32 bits");
+
+    static constexpr size_t minBits = Bits;
+    static constexpr size_t maxBits = Bits;
+    static constexpr bool isFixed = true;
+
+    static void encode(BitStreamWriter &writer, const Struct &s) {
+        writer.writeBits(static_cast<uint32_t>(s.*Member), Bits);
+    }
+
+    static void decode(BitStreamReader &reader, Struct &s) {
+        s.*Member = static_cast<T>(reader.readBits(Bits));
+    }
+};
+
+// Anything of variable length that has its own read/write functions,
+// e.g. strings and vectors. At least a length prefix is written.
+template<typename MemberPtr, MemberPtr Member>
+struct DynamicField;
+
+template<typename Struct, typename T, T Struct::*Member>
+struct DynamicField<T Struct::*, Member> {
+    static constexpr size_t minBits = 8;
+    static constexpr size_t maxBits = 8;
+    static constexpr bool isFixed = false;
+
+    static void encode(BitStreamWriter &writer, const Struct &s) {
+        write(writer, s.*Member);
+    }
+
+    static void decode(BitStreamReader &reader, Struct &s) {
+        read(reader, s.*Member);
+    }
+};
+
+// Member described by another schema
+template<typename MemberPtr, MemberPtr Member, typename MemberSchema>
+struct NestedField;
+
+template<typename Struct, typename T, T Struct::*Member, typename MemberSchema>
+struct NestedField<T Struct::*, Member, MemberSchema> {
+    static constexpr size_t minBits = MemberSchema::minBits;
+    static constexpr size_t maxBits = MemberSchema::maxBits;
+    static constexpr bool isFixed = MemberSchema::isFixed;
+
+    static void encode(BitStreamWriter &writer, const Struct &s) {
+        MemberSchema::encode(writer, s.*Member);
+    }
+
+    static void decode(BitStreamReader &reader, Struct &s) {
+        MemberSchema::decode(reader, s.*Member);
+    }
+};
+
+#define VAR_FIELD(member) VarField<decltype(&member), &member>
+#define BITS_FIELD(member, bits) BitsField<decltype(&member), &member, bits>
+#define DYNAMIC_FIELD(member) DynamicField<decltype(&member), &member>
+#define NESTED_FIELD(member, ...) \
+    NestedField<decltype(&member), &member, __VA_ARGS__>
+
+template<typename... Fields>
+struct Schema;
+
+template<>
+struct Schema<> {
+    static constexpr size_t minBits = 0;
+    static constexpr size_t maxBits = 0;
+    static constexpr bool isFixed = true;
+
+    template<typename Struct>
+    static void encode(BitStreamWriter &, const Struct &) {
+    }
+
+    template<typename Struct>
+    static void decode(BitStreamReader &, Struct &) {
+    }
+};
+
+template<typename Field, typename... Rest>
+struct Schema<Field, Rest...> {
+    static constexpr size_t minBits = Field::minBits + Schema<Rest...>::minBits;
+    static constexpr size_t maxBits = Field::maxBits + Schema<Rest...>::maxBits;
+    static constexpr bool isFixed = Field::isFixed && Schema<Rest...>::isFixed;
+
+    template<typename Struct>
+    static void encode(BitStreamWriter &writer, const Struct &s) {
+        Field::encode(writer, s);
+        Schema<Rest...>::encode(writer, s);
+    }
+
+    template<typename Struct>
+    static void decode(BitStreamReader &reader, Struct &s) {
+        Field::decode(reader, s);
+        Schema<Rest...>::decode(reader, s);
+    }
+};
+
+// Selects one schema out of SchemaFor<Type> for First <= Type < End
+// depending on a type tag known at runtime, as is needed for the payloads
+// of tagged unions such as Order and Message.
+template<typename Enum, template<Enum> class SchemaFor, int Type, int End>
+struct SchemaSwitch {
+    typedef SchemaFor<static_cast<Enum>(Type)> Current;
+    typedef SchemaSwitch<Enum, SchemaFor, Type + 1, End> Next;
+
+    static constexpr size_t minBits = constMin(Current::minBits, Next::minBits);
+    static constexpr size_t maxBits = constMax(Current::maxBits, Next::maxBits);
+    static constexpr bool isFixed = Current::isFixed && Next::isFixed;
+
+    template<typename Struct>
+    static void encode(Enum type, BitStreamWriter &writer, const Struct &s) {
+        if (type == Type)
+            Current::encode(writer, s);
+        else
+            Next::encode(type, writer, s);
+    }
+
+    template<typename Struct>
+    static void decode(Enum type, BitStreamReader &reader, Struct &s) {
+        if (type == Type)
+            Current::decode(reader, s);
+        else
+            Next::decode(type, reader, s);
+    }
+
+    static size_t minBitsOf(Enum type) {
+        return type == Type ? Current::minBits : Next::minBitsOf(type);
+    }
+
+    static size_t maxBitsOf(Enum type) {
+        return type == Type ? Current::maxBits : Next::maxBitsOf(type);
+    }
+
+    static bool isFixedOf(Enum type) {
+        return type == Type ? Current::isFixed : Next::isFixedOf(type);
+    }
+
+    static WireSize wireSizeOf(Enum type) {
+        WireSize size = { minBitsOf(type), maxBitsOf(type), isFixedOf(type) };
+        return size;
+    }
+};
+
+template<typename Enum, template<Enum> class SchemaFor, int End>
+struct SchemaSwitch<Enum, SchemaFor, End, End> {
+    static constexpr size_t minBits = static_cast<size_t>(-1);
+    static constexpr size_t maxBits = 0;
+    static constexpr bool isFixed = true;
+
+    template<typename Struct>
+    static void encode(Enum, BitStreamWriter &, const Struct &) {
+        assert(false);
+    }
+
+    // Unknown type tag in received data
+    template<typename Struct>
+    static void decode(Enum, BitStreamReader &reader, Struct &) {
+        reader.fail();
+    }
+
+    static size_t minBitsOf(Enum) {
+        assert(false);
+        return 0;
+    }
+
+    static size_t maxBitsOf(Enum) {
+        assert(false);
+        return 0;
+    }
+
+    static bool isFixedOf(Enum) {
+        assert(false);
+        return false;
+    }
+
+    static WireSize wireSizeOf(Enum) {
+        assert(false);
+        WireSize size = { 0, 0, true };
+        return size;
+    }
+};
+
+#endif
@@ -0,0 +1,66 @@
+#include "Traffic.hh"
+
+#include "Connection.hh"
+
+#include <algorithm>
+
+void OrderTraffic::add(const OrderTraffic &other) {
+    for (size_t i = 0; i < Order::TYPE_MAX; i++) {
+        orders[i] += other.orders[i];
+        bits[i] += other.bits[i];
+    }
+}
+
+void OrderTraffic::reset() {
+    std::fill(orders, orders + Order::TYPE_MAX, 0);
+    std::fill(bits, bits + Order::TYPE_MAX, 0);
+}
+
+void MessageTraffic::add(OutgoingMessage &message, size_t numBytes) {
+    add(message.getMessage().type, numBytes, message.takeEncodeTime());
+
+    // Messages passed on as they are do not contain encoded orders
+    if (numBytes > 0)
+        orders.add(message.getOrderTraffic());
+}
+
+void MessageTraffic::add(const MessageTraffic &other) {
+    for (size_t i = 0; i < Message::TYPE_MAX; i++) {
+        messages[i] += other.messages[i];
+        bytes[i] += other.bytes[i];
+        time[i] += other.time[i];
+    }
+
+    orders.add(other.orders);
+}
+
+void MessageTraffic::reset() {
+    std::fill(messages, messages + Message::TYPE_MAX, 0);
+    std::fill(bytes, bytes + Message::TYPE_MAX, 0);
+    std::fill(time, time + Message::TYPE_MAX, 0);
+
+    orders.reset();
+}
+
+void MessageTraffic::print(std::ostream &out) const {
+    for (size_t i = 0; i < Message::TYPE_MAX; i++) {
+        if (messages[i] == 0)
+            continue;
+
+        out << Message::getTypeName(static_cast<Message::Type>(i)) << ": "
+            << messages[i] << " messages, "
+            << static_cast<double>(bytes[i]) / messages[i]
+            << " bytes/message, "
+            << time[i] * 1e6 / messages[i] << "us/message" << std::endl;
+    }
+
+    for (size_t i = 0; i < Order::TYPE_MAX; i++) {
+        if (orders.orders[i] == 0)
+            continue;
+
+        out << "  " << Order::getTypeName(static_cast<Order::Type>(i)) << ": "
+            << orders.orders[i] << " orders, "
+            << static_cast<double>(orders.bits[i]) / orders.orders[i]
+            << " bits/order" << std::endl;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef STRAT_COMMON_TRAFFIC_HH
+#define STRAT_COMMON_TRAFFIC_HH
+
+#include "Message.hh"
+
+#include <ostream>
+
+struct OutgoingMessage;
+
+// Number and encoded size of orders, by order type. Counted by read and
+// write for Order if set on the stream (see BitStreamWriter).
+struct OrderTraffic {
+    size_t orders[Order::TYPE_MAX];
+    size_t bits[Order::TYPE_MAX];
+
+    OrderTraffic() { reset(); }
+
+    void add(Order::Type type, size_t numBits) {
+        orders[type]++;
+        bits[type] += numBits;
+    }
+
+    void add(const OrderTraffic &);
+    void reset();
+};
+
+// Messages going in one direction, by message type, and the orders in
+// them. Bytes are the payload as encoded, without ENet's headers.
+struct MessageTraffic {
+    size_t messages[Message::TYPE_MAX];
+    size_t bytes[Message::TYPE_MAX];
+
+    // Time spent encoding or decoding, in seconds
+    double time[Message::TYPE_MAX];
+
+    OrderTraffic orders;
+
+    MessageTraffic() { reset(); }
+
+    void add(Message::Type type, size_t numBytes, double seconds) {
+        messages[type]++;
+        bytes[type] += numBytes;
+        time[type] += seconds;
+    }
+
+    // For a message that has been sent with the given number of bytes.
+    // Messages shared by several connections are encoded once, so the
+    // time counts only once, but the orders count for every connection
+    // that the message went over encoded.
+    void add(OutgoingMessage &, size_t numBytes);
+
+    void add(const MessageTraffic &);
+    void reset();
+
+    // One line per type that has been seen, e.g.
+    // "SERVER_TICK: 400 messages, 5.2 bytes/message, 3.1us/message"
+    void print(std::ostream &) const;
+};
+
+#endif
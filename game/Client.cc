@@ -1,25 +1,70 @@
 #include "Client.hh"
 #include "common/BitStream.hh"
+#include "common/CustomMap.hh"
 #include "util/Profiling.hh"
 
-#include <GLFW/glfw3.h>
-
 #include <stdexcept>
 #include <iostream>
+#include <algorithm>
 #include <cassert>
 
+// Speed up per tick that we are behind the server
+static const double CATCH_UP_SPEED = 0.25;
+static const double MAX_CATCH_UP_SPEED = 4.0;
+
+// If we are further behind than this, e.g. after a hiccup, queued
+// ticks are run right away without interpolation
+static const size_t MAX_LAG_TICKS = 10;
+
+// The first few time requests are sent quickly one after another
+static const size_t FAST_TIME_REQUESTS = 10;
+static const double FAST_TIME_REQUEST_INTERVAL_S = 0.1;
+static const double TIME_REQUEST_INTERVAL_S = 1.0;
+
+// Completed ticks are acknowledged at least this often if no ticks are
+// arriving, e.g. when runs of empty ticks are sent ahead
+static const size_t TICKS_DONE_ACK_INTERVAL = 5;
+
+// Players acknowledge custom maps this many times while receiving them,
+// which is also how often the progress is shown
+static const size_t MAP_ACKS_PER_TRANSFER = 10;
+
+// Larger custom maps are rejected
+static const size_t MAX_MAP_SIZE = 16 * 1024 * 1024;
+
+// Snapshots are sent to the server in parts of this size
+static const size_t SNAPSHOT_CHUNK_SIZE = 1024;
+
 Client::Client(const std::string &username)
     : username(username),
       client(NULL),
-      peer(NULL),
+      connection(NULL),
+      loopback(NULL),
+      disconnected(false),
       sim(NULL),
       playerId(0), 
+      matchId(0),
+      spectating(false),
       tickRunning(false),
       interp(settings),
-      haveQueuedTick(false) {
+      clockStart(std::chrono::steady_clock::now()),
+      nextTimeRequest(0),
+      numTimeRequests(0),
+      numQueuedTicks(0),
+      ticksAhead(0),
+      ticksReceived(0),
+      ticksDone(0),
+      ticksDoneAcked(0),
+      stateHashInterval(0),
+      mapSize(0),
+      resyncing(false),
+      snapshotRequested(false),
+      snapshotMinTick(0) {
 }
 
 Client::~Client() {
+    delete connection;
+
     if (client)
         enet_host_destroy(client);
 
@@ -27,10 +72,47 @@ Client::~Client() {
         delete sim;
 }
 
-void Client::connect(const std::string &host, int port) {
+void Client::connect(const std::string &host, int port, uint32_t matchId) {
+    connectPeer(host, port, matchId);
+    sayHello();
+}
+
+void Client::connect(LoopbackHost &host, uint32_t matchId) {
+    assert(!connection);
+
+    loopback = host.connect(matchId);
+    connection = loopback;
+    sayHello();
+}
+
+void Client::spectate(const std::string &host, int port, uint32_t matchId) {
+    assert(!(matchId & CONNECT_SPECTATE));
+
+    spectating = true;
+    connectPeer(host, port, CONNECT_SPECTATE | matchId);
+}
+
+void Client::spectate(LoopbackHost &host, uint32_t matchId) {
+    assert(!(matchId & CONNECT_SPECTATE));
+    assert(!connection);
+
+    spectating = true;
+    loopback = host.connect(CONNECT_SPECTATE | matchId);
+    connection = loopback;
+}
+
+void Client::sayHello() {
+    Message message(Message::CLIENT_CONNECT);
+    message.client_connect.name = username;
+    sendMessage(message);
+}
+
+void Client::connectPeer(const std::string &host, int port, enet_uint32 data) {
+    assert(!connection);
+
     std::cout << "Connecting to " << host << ":" << port << std::endl;
 
-    client = enet_host_create(NULL, 1, 2, 0, 0);
+    client = enet_host_create(NULL, 1, NUM_CHANNELS, 0, 0);
 
     if (client == NULL)
         throw std::runtime_error("Failed to create ENet client");
@@ -39,7 +121,7 @@ void Client::connect(const std::string &host, int port) {
     enet_address_set_host(&address, host.c_str());
     address.port = port;
 
-    peer = enet_host_connect(client, &address, 2, 0);
+    ENetPeer *peer = enet_host_connect(client, &address, NUM_CHANNELS, data);
 
     ENetEvent event;
     if (enet_host_service(client, &event, 5000) > 0 &&
@@ -51,34 +133,68 @@ void Client::connect(const std::string &host, int port) {
         throw std::runtime_error("Failed to connect");
     }
 
-    // Say hello
-    Message message(Message::CLIENT_CONNECT);
-    message.client_connect.name = username;
-    sendMessage(message);
+    connection = new ENetConnection(peer);
 }
 
 void Client::update(double dt) {
-    interp.update(dt);
-
-    if (tickRunning && interp.isTickDone()) {
-        tickRunning = false;
+    double localTime = getLocalTime();
 
-        // Inform the server that we have completed a tick
-        Message message(Message::CLIENT_TICK_DONE);
-        sendMessage(message);
+    // Spectators might be watching through a relay, which does not
+    // answer, and are fine running at their own pace
+    if (sim && !spectating && localTime >= nextTimeRequest)
+        sendTimeRequest(localTime);
 
-        // Start queued tick if we already received one
-        if (haveQueuedTick) {
-            sim->runTick(queuedOrders);
-            interp.startTick();
-            tickRunning = true;
-            haveQueuedTick = false;
+    if (clockSync.isSynced()) {
+        interp.updateClock(clockSync.getServerTime(localTime));
+    } else {
+        double speed = 1.0;
+        if (numQueuedTicks > ticksAhead) {
+            speed += CATCH_UP_SPEED * (numQueuedTicks - ticksAhead);
+            speed = std::min(speed, MAX_CATCH_UP_SPEED);
         }
+
+        interp.update(dt * speed);
+    }
+
+    // Spectators can receive ticks while the map is still on its way
+    if (!sim) {
+        receiveMessages();
+        return;
     }
 
+    if (tickRunning && interp.isTickDone())
+        finishTick();
+
+    while (numQueuedTicks > ticksAhead + MAX_LAG_TICKS) {
+        if (tickRunning)
+            finishTick();
+        runQueuedTick();
+    }
+
+    // Start queued tick if we already received one
+    if (!tickRunning && numQueuedTicks > 0)
+        runQueuedTick();
+
     /*if (!tickRunning)
         std::cout << "WAITING FOR TICK" << std::endl;*/
 
+    receiveMessages();
+}
+
+void Client::receiveMessages() {
+    if (loopback) {
+        while (const Message *message = loopback->receive()) {
+            receivedTraffic.add(message->type, 0, 0);
+            handleMessage(*message);
+        }
+
+        if (!disconnected && loopback->isDisconnected()) {
+            std::cout << "Got disconnected" << std::endl;
+            disconnected = true;
+        }
+        return;
+    }
+
     ENetEvent event;
     while (enet_host_service(client, &event, 0) > 0) {
         switch (event.type) {
@@ -86,14 +202,22 @@ void Client::update(double dt) {
             break;
         case ENET_EVENT_TYPE_RECEIVE: {
             BitStreamReader reader(event.packet->data, event.packet->dataLength);
-
-            Message::Type messageType;
-            read(reader, messageType);
-
-            Message message(messageType);
-            read(reader, message);
-
-            handleMessage(message);
+            tickCodec.reset();
+            reader.setOrderCodec(&tickCodec);
+            reader.setOrderTraffic(&receivedTraffic.orders);
+
+            std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+            const Message *message = messagePool.decode(reader);
+
+            if (message) {
+                receivedTraffic.add(message->type, event.packet->dataLength,
+                    std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count());
+                handleMessage(*message);
+            } else {
+                std::cout << "Ignoring malformed message" << std::endl;
+            }
 
             enet_packet_destroy(event.packet);
             break;
@@ -106,55 +230,409 @@ void Client::update(double dt) {
     }
 }
 
-void Client::order(const Order &order) {
+bool Client::order(const Order &order) {
     assert(sim);
 
+    if (spectating)
+        return false;
+
     Order o(order);
     o.player = playerId;
 
-    if (sim->getState().isOrderValid(o)) {
-        Message message(Message::CLIENT_ORDER);
-        message.client_order.order = o;
-        sendMessage(message);
+    if (!sim->getState().isOrderValid(o))
+        return false;
+
+    Message message(Message::CLIENT_ORDER);
+    message.client_order.order = o;
+    sendMessage(message);
+
+    // ENet puts the ack into the same datagram as the order
+    if (ticksDone > ticksDoneAcked)
+        sendTickAck();
+
+    return true;
+}
+
+void Client::queueTicks(const std::vector<Order> &orders, size_t numTicks) {
+    assert(numTicks > 0);
+    numQueuedTicks += numTicks;
+
+    if (orders.empty() && !queuedTicks.empty()) {
+        queuedTicks.back().numTicks += numTicks;
+        return;
+    }
+
+    queuedTicks.push_back(Message::TickRange());
+
+    if (!spareTicks.empty()) {
+        queuedTicks.back().orders.swap(spareTicks.back().orders);
+        spareTicks.pop_back();
+    }
+
+    queuedTicks.back().numTicks = numTicks;
+    queuedTicks.back().orders = orders;
+}
+
+void Client::runQueuedTick() {
+    assert(!tickRunning);
+    assert(numQueuedTicks > 0);
+
+    Message::TickRange &range(queuedTicks.front());
+
+    sim->runTick(range.orders);
+    interp.startTick(ticksReceived - numQueuedTicks);
+    tickRunning = true;
+
+    numQueuedTicks--;
+
+    // The rest of the range consists of empty ticks
+    range.numTicks--;
+    range.orders.clear();
+
+    if (range.numTicks == 0) {
+        spareTicks.push_back(Message::TickRange());
+        spareTicks.back().orders.swap(range.orders);
+        queuedTicks.pop_front();
     }
+
+    if (snapshotRequested && ticksReceived - numQueuedTicks >= snapshotMinTick)
+        sendSnapshot();
+}
+
+void Client::finishTick() {
+    assert(tickRunning);
+    tickRunning = false;
+
+    ticksDone++;
+
+    if (ticksDone >= ticksDoneAcked + TICKS_DONE_ACK_INTERVAL)
+        sendTickAck();
+
+    if (stateHashInterval > 0 && ticksDone % stateHashInterval == 0)
+        sendStateHash();
 }
 
 void Client::sendMessage(const Message &message) {
-    ENetPacket *packet = message.toPacket();
-    enet_peer_send(peer, 0, packet);
+    OutgoingMessage outgoing(message, CHANNEL_RELIABLE, &sendCodec);
+    sentTraffic.add(outgoing, connection->send(outgoing));
+}
+
+void Client::sendTickAck() {
+    // Spectators get their ticks reliably
+    if (spectating)
+        return;
+
+    Message message(Message::CLIENT_TICK_ACK);
+    message.client_tick_ack.ticksReceived =
+        static_cast<uint32_t>(ticksReceived);
+    message.client_tick_ack.ticksDone = static_cast<uint32_t>(ticksDone);
+    ticksDoneAcked = ticksDone;
+
+    // If the ack is lost, the server just repeats the ticks
+    OutgoingMessage outgoing(message, CHANNEL_TICKS);
+    sentTraffic.add(outgoing, connection->send(outgoing));
+}
+
+void Client::resetTraffic() {
+    sentTraffic.reset();
+    receivedTraffic.reset();
+}
+
+double Client::getLocalTime() const {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - clockStart).count();
+}
+
+void Client::sendTimeRequest(double localTime) {
+    Message message(Message::CLIENT_TIME_REQUEST);
+    message.client_time_request.clientTime =
+        static_cast<uint64_t>(localTime * 1e6);
+
+    // Requests can be lost, there will be another one
+    OutgoingMessage outgoing(message, CHANNEL_TICKS);
+    sentTraffic.add(outgoing, connection->send(outgoing));
+
+    numTimeRequests++;
+    nextTimeRequest = localTime + (numTimeRequests < FAST_TIME_REQUESTS ?
+                                   FAST_TIME_REQUEST_INTERVAL_S :
+                                   TIME_REQUEST_INTERVAL_S);
+}
+
+void Client::sendStateHash() {
+    if (spectating)
+        return;
+
+    Message message(Message::CLIENT_STATE_HASH);
+    message.client_state_hash.tick = static_cast<uint32_t>(ticksDone);
+    message.client_state_hash.hash = sim->hashState();
+    sendMessage(message);
+}
+
+void Client::sendSnapshot() {
+    assert(sim);
+    snapshotRequested = false;
+
+    BitStreamWriter writer;
+    sim->writeSnapshot(writer);
+
+    size_t tick = ticksReceived - numQueuedTicks;
+    std::cout << "Sending snapshot of tick " << tick << " ("
+              << writer.size() << " bytes)" << std::endl;
+
+    const uint8_t *data = writer.ptr();
+    for (size_t offset = 0; offset < writer.size();
+         offset += SNAPSHOT_CHUNK_SIZE) {
+        size_t size = std::min(SNAPSHOT_CHUNK_SIZE, writer.size() - offset);
+
+        Message message(Message::CLIENT_SNAPSHOT);
+        Message::SnapshotChunk &chunk(message.client_snapshot);
+        chunk.tick = static_cast<uint32_t>(tick);
+        chunk.size = static_cast<uint32_t>(writer.size());
+        chunk.offset = static_cast<uint32_t>(offset);
+        chunk.data.assign(data + offset, data + offset + size);
+        sendMessage(message);
+    }
+}
+
+void Client::receiveMap(const Message::MapChunk &chunk) {
+    if (sim || chunk.size > MAX_MAP_SIZE || chunk.offset != map.size()
+        || chunk.data.size() > chunk.size - map.size()) {
+        std::cout << "Ignoring map part at " << chunk.offset << std::endl;
+        return;
+    }
+
+    size_t step = std::max<size_t>(chunk.size / MAP_ACKS_PER_TRANSFER, 1);
+    bool progressed = (map.size() + chunk.data.size()) / step
+                      > map.size() / step;
+
+    map.insert(map.end(), chunk.data.begin(), chunk.data.end());
+
+    if (progressed || map.size() == chunk.size) {
+        std::cout << "Received " << map.size() * 100 / chunk.size
+                  << "% of the map" << std::endl;
+
+        if (!spectating) {
+            Message message(Message::CLIENT_MAP_ACK);
+            message.client_map_ack.received = static_cast<uint32_t>(map.size());
+            sendMessage(message);
+        }
+    }
+
+    // SERVER_START might still be on its way
+    if (mapSize > 0 && map.size() == mapSize)
+        startWithMap();
+}
+
+void Client::startWithMap() {
+    assert(!sim && map.size() == mapSize);
+
+    CustomMap custom;
+    BitStreamReader reader(map);
+    read(reader, custom);
+
+    if (reader.hasFailed() || custom.sizeX != settings.mapW
+        || custom.sizeY != settings.mapH) {
+        std::cout << "Received malformed map; disconnecting" << std::endl;
+        connection->disconnect();
+        return;
+    }
+
+    std::cout << "Initializing simulation with a custom map of "
+              << custom.sizeX << "x" << custom.sizeY << " points" << std::endl;
+
+    sim = new Sim(settings, &custom);
+
+    std::vector<uint8_t>().swap(map);
+}
+
+void Client::startResync() {
+    assert(sim);
+
+    std::cout << "Our state differs from the server's; waiting for its "
+              << "snapshot" << std::endl;
+
+    // The ticks we have are of no use, since the snapshot is of the
+    // latest tick the server has started
+    tickRunning = false;
+
+    while (!queuedTicks.empty()) {
+        spareTicks.push_back(Message::TickRange());
+        spareTicks.back().orders.swap(queuedTicks.front().orders);
+        queuedTicks.pop_front();
+    }
+    numQueuedTicks = 0;
+
+    snapshotRequested = false;
+    snapshot.clear();
+    resyncing = true;
+}
+
+void Client::receiveSnapshot(const Message::SnapshotChunk &chunk) {
+    // A snapshot of a later tick replaces the one we have been receiving
+    if (chunk.offset == 0)
+        snapshot.clear();
+
+    if ((sim && !resyncing) || chunk.offset != snapshot.size()
+        || chunk.data.size() > chunk.size - snapshot.size()) {
+        std::cout << "Ignoring snapshot part at " << chunk.offset
+                  << std::endl;
+        return;
+    }
+
+    snapshot.insert(snapshot.end(), chunk.data.begin(), chunk.data.end());
+
+    if (snapshot.size() < chunk.size)
+        return;
+
+    BitStreamReader reader(snapshot);
+    if (sim) {
+        // Keeps everything that refers to the Sim, e.g. event receivers
+        sim->restoreSnapshot(reader);
+    } else {
+        sim = new Sim(settings, reader);
+    }
+
+    if (reader.hasFailed()) {
+        std::cout << "Received malformed snapshot; disconnecting" << std::endl;
+
+        // The Sim is broken, but it has to stay around while resyncing
+        if (!resyncing) {
+            delete sim;
+            sim = NULL;
+        }
+
+        snapshot.clear();
+        connection->disconnect();
+        return;
+    }
+
+    std::cout << "Continuing game from snapshot of tick " << chunk.tick
+              << std::endl;
+
+    // The server continues with the ticks after the snapshot
+    ticksReceived = chunk.tick;
+    ticksDone = chunk.tick;
+    ticksDoneAcked = chunk.tick;
+    snapshot.clear();
+    resyncing = false;
 }
 
 void Client::handleMessage(const Message &message) {
     switch (message.type) {
     case Message::SERVER_CONNECT:
         std::cout << "Connected to server with player id "
-                  << message.server_connect.yourPlayerId << std::endl;
+                  << message.server_connect.yourPlayerId << " in match "
+                  << message.server_connect.matchId << std::endl;
         playerId = message.server_connect.yourPlayerId;
+        matchId = message.server_connect.matchId;
         return;
 
     case Message::SERVER_START:
+        stateHashInterval = message.server_start.stateHashInterval;
+
+        // We are already running the game, but the server does not agree
+        if (sim) {
+            if (message.server_start.lateJoin)
+                startResync();
+            return;
+        }
+
+        settings = message.server_start.settings;
+
+        // Late joiners wait for a snapshot of the game state
+        if (message.server_start.lateJoin) {
+            std::cout << "Waiting for snapshot" << std::endl;
+            return;
+        }
+
+        if (message.server_start.mapSize > 0) {
+            mapSize = message.server_start.mapSize;
+
+            if (map.size() == mapSize) {
+                startWithMap();
+            } else {
+                std::cout << "Waiting for map (" << mapSize << " bytes)"
+                          << std::endl;
+            }
+            return;
+        }
+
         std::cout << "Initializing simulation with seed "
                   << message.server_start.settings.randomSeed << std::endl;
 
-        settings = message.server_start.settings;
         sim = new Sim(settings);
         return;
 
-    case Message::SERVER_TICK:
-        assert(!haveQueuedTick);
+    case Message::SERVER_SNAPSHOT:
+        receiveSnapshot(message.server_snapshot);
+        return;
 
-        if (sim) {
-            if (!tickRunning) {
-                sim->runTick(message.server_tick.orders);
-                interp.startTick();
-                tickRunning = true;
-            } else {
-                queuedOrders = message.server_tick.orders;
-                haveQueuedTick = true;
-                //std::cout << "Queued tick at t=" << interp.getT() << std::endl;
+    case Message::SERVER_MAP:
+        receiveMap(message.server_map);
+        return;
+
+    case Message::SERVER_TIME:
+        clockSync.addSample(message.server_time.clientTime / 1e6,
+                            message.server_time.serverTime / 1e6,
+                            getLocalTime());
+        return;
+
+    case Message::SERVER_SNAPSHOT_REQUEST:
+        if (!sim)
+            return;
+
+        snapshotRequested = true;
+        snapshotMinTick = message.server_snapshot_request.minTick;
+
+        if (ticksReceived - numQueuedTicks >= snapshotMinTick)
+            sendSnapshot();
+        return;
+
+    case Message::SERVER_TICK: {
+        // Ticks can arrive before the simulation has been created, i.e.
+        // before SERVER_START or the snapshot; they will be repeated.
+        // Spectators are sent them only once, so they are kept while
+        // waiting for the map.
+        if ((!sim && mapSize == 0) || resyncing)
+            return;
+
+        const Message::ServerTick &tick(message.server_tick);
+
+        // Packets start with the first tick that the server knows we are
+        // missing, so there can be no gaps, but some of the ticks might
+        // have been received already
+        if (tick.firstTick > ticksReceived) {
+            std::cout << "Ignoring ticks starting at " << tick.firstTick
+                      << ", expected " << ticksReceived << std::endl;
+            return;
+        }
+
+        ticksAhead = tick.ticksAhead;
+
+        size_t firstTick = tick.firstTick;
+        for (auto &range : tick.ranges) {
+            size_t endTick = firstTick + range.numTicks;
+
+            if (endTick > ticksReceived) {
+                if (firstTick == ticksReceived) {
+                    queueTicks(range.orders, range.numTicks);
+                } else {
+                    // Only the empty ticks at the end are new
+                    queueTicks(std::vector<Order>(), endTick - ticksReceived);
+                }
+
+                ticksReceived = endTick;
             }
+
+            firstTick = endTick;
         }
+
+        sendTickAck();
+
+        if (sim && !tickRunning && numQueuedTicks > 0)
+            runQueuedTick();
         return;
+    }
 
     default:
         return;
@@ -3,23 +3,65 @@
 
 #include "Sim.hh"
 #include "InterpState.hh"
+#include "ClockSync.hh"
 #include "common/Message.hh"
+#include "common/OrderCodec.hh"
+#include "common/Connection.hh"
+#include "common/Loopback.hh"
+#include "common/Traffic.hh"
 
 #include <enet/enet.h>
 #include <entityx/entityx.h>
 
 #include <string>
+#include <deque>
+#include <chrono>
 
 // The client connects to the specified game server,
 // and then runs a game simulation with the settings given by the server.
 //
 // Everytime the server sends a tick to the client, it is
-// executed in the local simulation.
+// executed in the local simulation. The server sends ticks a few
+// ticks ahead of time. We estimate the server's clock and run every
+// tick when the server means it to be run, so we neither fall behind
+// nor run out of ticks. Until we know the server's clock, we run ticks
+// at our own pace; if we have more ticks queued than the server sent
+// ahead, we have fallen behind and run them faster to catch up. Runs of
+// empty ticks are sent as one range.
+//
+// Our progress is reported to the server in cumulative acks, which are
+// sent when ticks arrive, along with orders, and otherwise every few
+// completed ticks.
+//
+// A client that lost its connection can reconnect to its match. It then
+// starts from a snapshot of the game state, which the server gets by
+// asking one of the other clients to send theirs, unless it runs the
+// game itself. Only such servers keep a match that everyone has left, so
+// without one, the last player can not come back. They also ask for
+// hashes of our state every few ticks, and send us their state if ours
+// turns out to differ.
+//
+// Matches can be played on a custom map, which the server sends after
+// SERVER_START. Players report their progress, and the first tick only
+// comes once every player has the whole map.
+//
+// Spectators only receive the ticks of a match, from its start. They do
+// not send anything to the server. Their ticks are queued while the map
+// is still on its way.
+//
+// The server can also be in the same process, e.g. when playing alone,
+// in which case messages are passed over a loopback connection.
 struct Client {
     Client(const std::string &username);
     ~Client();
 
-    void connect(const std::string &host, int port);
+    // With a matchId, we rejoin a match that is already running
+    void connect(const std::string &host, int port, uint32_t matchId = 0);
+    void connect(LoopbackHost &host, uint32_t matchId = 0);
+
+    // Watches the given match, or the next one, from a server or relay
+    void spectate(const std::string &host, int port, uint32_t matchId = 0);
+    void spectate(LoopbackHost &host, uint32_t matchId = 0);
 
     Sim &getSim() {
         assert(sim != NULL);
@@ -33,7 +75,8 @@ struct Client {
 
     void update(double dt);
 
-    void order(const Order &order);
+    // Sends the order to the server if it is valid in the current state
+    bool order(const Order &order);
 
     bool isStarted() const {
         return sim != NULL;
@@ -43,29 +86,135 @@ struct Client {
         return interp;
     }
 
+    bool isSpectating() const { return spectating; }
+
     PlayerId getPlayerId() const {
         assert(playerId > 0);
         return playerId;
     }
 
+    // For reconnecting after losing the connection
+    uint32_t getMatchId() const { return matchId; }
+
+    // Ticks received from the server and ticks not run yet
+    size_t getTicksReceived() const { return ticksReceived; }
+    size_t getNumQueuedTicks() const { return numQueuedTicks; }
+
+    const ClockSync &getClockSync() const { return clockSync; }
+
+    // For traffic statistics, if connected over ENet
+    const ENetHost *getHost() const { return client; }
+
+    const Connection *getConnection() const { return connection; }
+
+    // Messages sent and received since the last reset
+    const MessageTraffic &getSentTraffic() const { return sentTraffic; }
+    const MessageTraffic &getReceivedTraffic() const {
+        return receivedTraffic;
+    }
+
+    void resetTraffic();
+
 private:
     std::string username;
 
+    // ENet's host and the connection over its peer, or the loopback
+    // connection
     ENetHost *client;
-    ENetPeer *peer;
+    Connection *connection;
+    LoopbackConnection *loopback;
+
+    // Whether the loopback connection has been closed
+    bool disconnected;
 
     GameSettings settings;
     Sim *sim;
 
     PlayerId playerId;
+    uint32_t matchId;
+    bool spectating;
 
     bool tickRunning;
     InterpState interp;
 
-    bool haveQueuedTick;
-    std::vector<Order> queuedOrders;
+    // Estimate of the server's tick clock. Time requests are sent
+    // frequently at first, then every now and then to follow the skew.
+    ClockSync clockSync;
+    std::chrono::steady_clock::time_point clockStart;
+    double nextTimeRequest;
+    size_t numTimeRequests;
+
+    // Ticks received but not yet run, as ranges of a tick with orders
+    // followed by empty ticks. Ranges that have been run are kept
+    // around for reusing their order vectors.
+    std::deque<Message::TickRange> queuedTicks;
+    std::vector<Message::TickRange> spareTicks;
+    size_t numQueuedTicks;
+
+    // Number of ticks the server has sent ahead, as of its last packet
+    size_t ticksAhead;
+
+    // Number of ticks received so far without gaps
+    size_t ticksReceived;
+
+    // Number of ticks completed so far, and as of the last ack
+    size_t ticksDone;
+    size_t ticksDoneAcked;
+
+    MessagePool messagePool;
+
+    MessageTraffic sentTraffic;
+    MessageTraffic receivedTraffic;
+
+    // Delta compression state of the orders sent to the server
+    OrderCodec sendCodec;
+
+    // Orders received from the server only come in tick packets, which
+    // are delta compressed on their own
+    OrderCodec tickCodec;
+
+    // Ticks after which a hash of our state is sent, if not zero
+    size_t stateHashInterval;
+
+    // Custom map being received, and its size as of SERVER_START, which
+    // can come after the first parts
+    std::vector<uint8_t> map;
+    size_t mapSize;
+
+    // Snapshot being received when joining a running match, or when the
+    // server has found our state to differ from its own. In the latter
+    // case, we are resyncing and stop running ticks until it is there.
+    std::vector<uint8_t> snapshot;
+    bool resyncing;
+
+    // The server wants a snapshot taken after this many ticks, for
+    // another client that is joining
+    bool snapshotRequested;
+    size_t snapshotMinTick;
+
+    // Queues a tick with the given orders, followed by numTicks - 1
+    // empty ticks
+    void queueTicks(const std::vector<Order> &orders, size_t numTicks);
+    void runQueuedTick();
+    void finishTick();
+
+    void connectPeer(const std::string &host, int port, enet_uint32 data);
+    void sayHello();
 
+    void receiveMessages();
     void sendMessage(const Message &);
+    void sendTickAck();
+
+    // Seconds since the client was created
+    double getLocalTime() const;
+    void sendTimeRequest(double localTime);
+    void sendStateHash();
+    void sendSnapshot();
+    void receiveMap(const Message::MapChunk &);
+    void startWithMap();
+
+    void startResync();
+    void receiveSnapshot(const Message::SnapshotChunk &);
     void handleMessage(const Message &);
 };
 
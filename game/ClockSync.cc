@@ -0,0 +1,126 @@
+#include "ClockSync.hh"
+
+#include <algorithm>
+#include <cmath>
+
+// Number of exchanges the estimate is based on
+static const size_t MAX_SAMPLES = 32;
+
+// Exchanges are used if their round trip time is within this factor of
+// the fastest one, or within the absolute tolerance
+static const double ROUND_TRIP_FACTOR = 1.5;
+static const double ROUND_TRIP_TOLERANCE_S = 0.002;
+
+// The skew is only fitted over this many exchanges spanning this long,
+// and limited to what real clocks might differ by
+static const size_t MIN_SKEW_SAMPLES = 4;
+static const double MIN_SKEW_SPAN_S = 2.0;
+static const double MAX_SKEW = 0.001;
+
+// Errors of the estimate are corrected by running our idea of the server
+// clock at most this much faster or slower, unless they are larger than
+// MAX_SLEW_ERROR_S
+static const double MAX_SLEW_RATE = 0.05;
+static const double MAX_SLEW_ERROR_S = 0.1;
+
+ClockSync::ClockSync()
+    : synced(false), offset(0), skew(0), referenceTime(0),
+      minRoundTripTime(0), smoothed(false), lastLocalTime(0),
+      lastServerTime(0) {
+}
+
+void ClockSync::addSample(double sendTime, double serverTime,
+                          double receiveTime) {
+    if (receiveTime < sendTime)
+        return;
+
+    Sample sample;
+    sample.localTime = (sendTime + receiveTime) / 2;
+    sample.offset = serverTime - sample.localTime;
+    sample.roundTripTime = receiveTime - sendTime;
+
+    samples.push_back(sample);
+    if (samples.size() > MAX_SAMPLES)
+        samples.pop_front();
+
+    estimate();
+    synced = true;
+}
+
+void ClockSync::estimate() {
+    minRoundTripTime = samples.front().roundTripTime;
+    for (auto &sample : samples)
+        minRoundTripTime = std::min(minRoundTripTime, sample.roundTripTime);
+
+    double maxRoundTripTime = std::max(minRoundTripTime * ROUND_TRIP_FACTOR,
+                                       minRoundTripTime + ROUND_TRIP_TOLERANCE_S);
+
+    // Least squares fit of the offsets of the good samples over time
+    size_t n = 0;
+    double sumTime = 0, sumOffset = 0;
+    double firstTime = 0, lastTime = 0;
+    for (auto &sample : samples) {
+        if (sample.roundTripTime > maxRoundTripTime)
+            continue;
+
+        if (n == 0)
+            firstTime = sample.localTime;
+        lastTime = sample.localTime;
+
+        n++;
+        sumTime += sample.localTime;
+        sumOffset += sample.offset;
+    }
+
+    referenceTime = sumTime / n;
+    offset = sumOffset / n;
+    skew = 0;
+
+    if (n < MIN_SKEW_SAMPLES || lastTime - firstTime < MIN_SKEW_SPAN_S)
+        return;
+
+    double covariance = 0, variance = 0;
+    for (auto &sample : samples) {
+        if (sample.roundTripTime > maxRoundTripTime)
+            continue;
+
+        double dt = sample.localTime - referenceTime;
+        covariance += dt * (sample.offset - offset);
+        variance += dt * dt;
+    }
+
+    if (variance > 0) {
+        skew = covariance / variance;
+        skew = std::max(std::min(skew, MAX_SKEW), -MAX_SKEW);
+    }
+}
+
+double ClockSync::getServerTime(double localTime) {
+    double target = localTime + offset + skew * (localTime - referenceTime);
+
+    if (!smoothed) {
+        smoothed = true;
+        lastLocalTime = localTime;
+        lastServerTime = target;
+        return target;
+    }
+
+    if (localTime <= lastLocalTime)
+        return lastServerTime;
+
+    double dt = localTime - lastLocalTime;
+    double predicted = lastServerTime + dt * (1 + skew);
+    double error = target - predicted;
+
+    double serverTime;
+    if (std::abs(error) > MAX_SLEW_ERROR_S) {
+        serverTime = target;
+    } else {
+        double maxSlew = MAX_SLEW_RATE * dt;
+        serverTime = predicted + std::max(std::min(error, maxSlew), -maxSlew);
+    }
+
+    lastLocalTime = localTime;
+    lastServerTime = std::max(serverTime, lastServerTime);
+    return lastServerTime;
+}
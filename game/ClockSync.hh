@@ -0,0 +1,59 @@
+#ifndef STRAT_GAME_CLOCK_SYNC_HH
+#define STRAT_GAME_CLOCK_SYNC_HH
+
+#include <deque>
+
+// Estimates the server's clock from NTP-style exchanges: we send our
+// local time, and the server answers with it and its own time. Assuming
+// that both ways take equally long, the server's time was read halfway
+// between sending and receiving.
+//
+// Exchanges that took much longer than the fastest ones have been held
+// up somewhere and are ignored. The offset of the remaining ones is
+// fitted over time, giving the skew between the clocks.
+//
+// All times are in seconds.
+struct ClockSync {
+    ClockSync();
+
+    void addSample(double sendTime, double serverTime, double receiveTime);
+
+    // Whether we have heard back from the server at all
+    bool isSynced() const { return synced; }
+
+    // Estimated server time at the given local time. Corrections of the
+    // estimate are spread over time, so that the result is smooth and
+    // does not go backwards; only large errors are corrected at once.
+    double getServerTime(double localTime);
+
+    double getSkew() const { return skew; }
+    double getRoundTripTime() const { return minRoundTripTime; }
+
+private:
+    struct Sample {
+        double localTime;
+        double offset;
+        double roundTripTime;
+    };
+
+    std::deque<Sample> samples;
+
+    bool synced;
+
+    // The server time at local time t is estimated as
+    // t + offset + skew * (t - referenceTime)
+    double offset;
+    double skew;
+    double referenceTime;
+
+    double minRoundTripTime;
+
+    // Last result of getServerTime
+    bool smoothed;
+    double lastLocalTime;
+    double lastServerTime;
+
+    void estimate();
+};
+
+#endif
@@ -6,6 +6,7 @@
 #include "Terrain.hh"
 #include "Config.hh"
 #include "util/Profiling.hh"
+#include "util/Log.hh"
 
 #define GLM_FORCE_RADIANS
 #include <GL/glu.h>
@@ -14,6 +15,8 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <inline_variant_visitor/inline_variant.hpp>
 
+#include <sstream>
+
 #define DOUBLE_CLICK_S 0.4f
 
 using namespace glm;
@@ -416,10 +419,29 @@ void Input::onMouseButton(GLFWwindow *window,
     }
 }
 
+// Logs the client's traffic since the last dump, like ProfilingData::dump
+static void dumpTraffic(Client &client) {
+    std::stringstream ss;
+    ss << "sent:" << std::endl;
+    client.getSentTraffic().print(ss);
+    ss << "received:" << std::endl;
+    client.getReceivedTraffic().print(ss);
+
+    std::string line;
+    while (std::getline(ss, line))
+        INFO(traffic) << line;
+
+    client.resetTraffic();
+}
+
 void Input::onKey(GLFWwindow *window, int key, int, int action, int mods) {
-    if (action == GLFW_PRESS && key == GLFW_KEY_P)
+    if (action == GLFW_PRESS && key == GLFW_KEY_P) {
         ProfilingData::dump();
 
+        if (g_input)
+            dumpTraffic(g_input->client);
+    }
+
     if (Input *self = g_input) {
         match(self->mode,
             [&](const DefaultMode &) {
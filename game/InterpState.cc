@@ -3,11 +3,12 @@
 #include <iostream>
 
 InterpState::InterpState(const GameSettings &settings)
-    : settings(settings), t(0) {
+    : settings(settings), tick(0), t(0) {
 
 }
 
-void InterpState::startTick() {
+void InterpState::startTick(size_t tick) {
+    this->tick = tick;
     t = 0;
 }
 
@@ -20,6 +21,17 @@ void InterpState::update(double dt) {
         t = 1.0;
 }
 
+void InterpState::updateClock(double serverTime) {
+    double tickLengthS = settings.tickLengthMs / 1000.0;
+
+    t = serverTime / tickLengthS - tick;
+
+    if (t < 0.0)
+        t = 0.0;
+    if (t >= 1.0)
+        t = 1.0;
+}
+
 double InterpState::getT() const {
     return t;
 }
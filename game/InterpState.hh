@@ -3,12 +3,21 @@
 
 #include "common/GameSettings.hh"
 
+#include <cstddef>
+
 struct InterpState {
     InterpState(const GameSettings &);
 
-    void startTick();
+    // Tick number N is the N+1th tick of the game
+    void startTick(size_t tick);
+
+    // Advances by the local time passed
     void update(double dt);
 
+    // Follows the server's tick clock instead, in seconds since the first
+    // tick was due. Tick N is meant to run from N tick lengths on.
+    void updateClock(double serverTime);
+
     // 0 <= getT() <= 1
     double getT() const; 
 
@@ -17,6 +26,7 @@ struct InterpState {
 private:
     const GameSettings &settings;
 
+    size_t tick;
     double t;
 };
 
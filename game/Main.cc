@@ -7,6 +7,8 @@
 #include "Terrain.hh"
 #include "util/Log.hh"
 #include "util/Profiling.hh"
+#include "common/ENetPool.hh"
+#include "server/Worker.hh"
 
 #include <entityx/entityx.h>
 
@@ -20,6 +22,7 @@
 
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 void errorCallback(int error, const char *description) {
     std::cerr << "GLFW error: " << description << std::endl;
@@ -53,13 +56,30 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if (enet_initialize() != 0) {
+    if (initializeENetWithPool() != 0) {
         std::cerr << "Failed to initialize ENet" << std::endl;
         return 1;
     }
 
+    // Usage: game [host] [port]
+    // Without a host, we play alone on a server in this process
+    ServerConfig serverConfig;
+    serverConfig.port = 0;
+
+    Worker *server = NULL;
+    std::thread serverThread;
+
     Client client("leo");
-    client.connect("localhost", 1234);
+
+    if (argc > 1) {
+        client.connect(argv[1], argc > 2 ? atoi(argv[2]) : 1234);
+    } else {
+        server = new Worker(serverConfig, 0, NULL);
+        server->init();
+        serverThread = std::thread(&Worker::run, server);
+
+        client.connect(server->getLoopbackHost());
+    }
 
     std::cout << "Waiting for the game to start" << std::endl;
     while (!client.isStarted()) {
@@ -178,6 +198,12 @@ int main(int argc, char *argv[]) {
         glfwSetWindowTitle(window, ss.str().c_str());
     } 
 
+    if (server) {
+        server->stop();
+        serverThread.join();
+        delete server;
+    }
+
     enet_deinitialize();
     glfwTerminate();
 
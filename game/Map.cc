@@ -1,6 +1,8 @@
 #include "Map.hh"
 
 #include "Math.hh"
+#include "common/BitStream.hh"
+#include "common/CustomMap.hh"
 
 #include <cstdlib>
 
@@ -8,6 +10,7 @@ Map::Map(size_t sizeX, size_t sizeY)
     : sizeX(sizeX),
       sizeY(sizeY),
       maxHeight(0),
+      fixedWaterSources(false),
       points(sizeX * sizeY) {
     assert(sizeX > 0 && sizeY > 0);
 
@@ -20,13 +23,10 @@ Map::Map(size_t sizeX, size_t sizeY)
 
 Map Map::generate(size_t sizeX, size_t sizeY,
                   size_t heightLimit, size_t seed) {
-    // HACK: Maybe use C++11's random generators to ensure determinism
-    srand(seed);
-
     Map map(sizeX, sizeY);
 
     PerlinNoise noise(sizeX, sizeY);
-    noise.generate(8, 0.4);
+    noise.generate(static_cast<uint32_t>(seed), 8, 0.4);
 
     size_t minHeight = heightLimit;
 
@@ -56,6 +56,26 @@ Map Map::generate(size_t sizeX, size_t sizeY,
     return std::move(map); 
 }
 
+Map Map::fromCustom(const CustomMap &custom) {
+    Map map(custom.sizeX, custom.sizeY);
+
+    for (size_t x = 0; x < map.sizeX; x++) {
+        for (size_t y = 0; y < map.sizeY; y++) {
+            size_t i = y * map.sizeX + x;
+
+            map.point(x, y).height = custom.heights[i];
+            map.maxHeight = std::max(map.maxHeight, map.point(x, y).height);
+
+            if (!custom.waterSources.empty())
+                map.point(x, y).waterSource = custom.waterSources[i];
+        }
+    }
+
+    map.fixedWaterSources = !custom.waterSources.empty();
+
+    return map;
+}
+
 void Map::crater(const Pos &p, size_t depth) {
     GridPoint &gp(point(p));
     gp.growthTarget = -static_cast<int>(std::min(gp.height, depth));
@@ -169,6 +189,9 @@ void Map::tick(entityx::EntityManager &entities, Fixed tickLengthS) {
 }
 
 void Map::raiseWaterLevel(size_t waterLevel) {
+    if (fixedWaterSources)
+        return;
+
     for (size_t x = 0; x < getSizeX(); x++) {
         for (size_t y = 0; y < getSizeY(); y++) {
             GridPoint &p(point(x, y));
@@ -220,3 +243,139 @@ void Map::waterTick(Fixed tickLengthS, size_t waterLevel) {
     }
 }
 
+
+static bool isGrowing(const GridPoint &p) {
+    return p.growthTarget != 0 || p.growthProgress != Fixed(0)
+           || p.growthCascadeUp || p.growthCascadeDown;
+}
+
+// Whether the points are the same, apart from their position and entity.
+// The growth speed is only compared while growing, since it is set anew
+// whenever a point starts to grow.
+static bool sameSnapshotPoint(const GridPoint &a, const GridPoint &b) {
+    if (a.height != b.height
+        || a.waterSource != b.waterSource
+        || a.water != b.water
+        || isGrowing(a) != isGrowing(b))
+        return false;
+
+    return !isGrowing(a)
+           || (a.growthTarget == b.growthTarget
+               && a.growthProgress == b.growthProgress
+               && a.growthCascadeUp == b.growthCascadeUp
+               && a.growthCascadeDown == b.growthCascadeDown
+               && a.growthPerS == b.growthPerS);
+}
+
+static void copySnapshotPoint(const GridPoint &from, GridPoint &to) {
+    to.height = from.height;
+    to.growthTarget = from.growthTarget;
+    to.growthProgress = from.growthProgress;
+    to.growthCascadeUp = from.growthCascadeUp;
+    to.growthCascadeDown = from.growthCascadeDown;
+    to.growthPerS = from.growthPerS;
+    to.waterSource = from.waterSource;
+    to.water = from.water;
+
+    // The entities are recreated by SimState::readSnapshot, which points
+    // the grid at them again. Old handles could otherwise alias the new
+    // entities, since restoring resets the entity versions.
+    to.entity = entityx::Entity();
+}
+
+void Map::writeSnapshot(BitStreamWriter &writer) const {
+    writer.writeVarUint(maxHeight);
+    write(writer, fixedWaterSources);
+
+    // Points are written in runs of equal points, which cover most of
+    // the terrain
+    for (size_t i = 0; i < points.size();) {
+        const GridPoint &p(points[i]);
+
+        size_t run = 1;
+        while (i + run < points.size() && sameSnapshotPoint(p, points[i + run]))
+            run++;
+
+        writer.writeVarUint(run);
+        writer.writeVarUint(p.height);
+        write(writer, p.waterSource);
+        writer.writeVarInt(p.water.toRaw());
+
+        write(writer, isGrowing(p));
+        if (isGrowing(p)) {
+            writer.writeVarInt(p.growthTarget);
+            writer.writeVarInt(p.growthProgress.toRaw());
+            write(writer, p.growthCascadeUp);
+            write(writer, p.growthCascadeDown);
+            writer.writeVarInt(p.growthPerS.toRaw());
+        }
+
+        i += run;
+    }
+
+    writer.writeVarUint(growingPoints.size());
+    for (auto &pos : growingPoints) {
+        writer.writeVarUint(pos.x);
+        writer.writeVarUint(pos.y);
+    }
+}
+
+void Map::readSnapshot(BitStreamReader &reader) {
+    maxHeight = reader.readVarUint();
+    read(reader, fixedWaterSources);
+
+    for (size_t i = 0; i < points.size();) {
+        size_t run = reader.readVarUint();
+        if (run == 0 || run > points.size() - i) {
+            reader.fail();
+            return;
+        }
+
+        GridPoint p;
+        p.height = reader.readVarUint();
+        read(reader, p.waterSource);
+        p.water = Fixed::fromRaw(static_cast<int>(reader.readVarInt()));
+
+        bool growing;
+        read(reader, growing);
+        if (growing) {
+            p.growthTarget = static_cast<int>(reader.readVarInt());
+            p.growthProgress = Fixed::fromRaw(static_cast<int>(reader.readVarInt()));
+            read(reader, p.growthCascadeUp);
+            read(reader, p.growthCascadeDown);
+            p.growthPerS = Fixed::fromRaw(static_cast<int>(reader.readVarInt()));
+        }
+
+        // Growing below zero would trip up Map::tick
+        if (reader.hasFailed()
+            || static_cast<int>(p.height) + p.growthTarget < 0) {
+            reader.fail();
+            return;
+        }
+
+        for (size_t j = i; j < i + run; j++)
+            copySnapshotPoint(p, points[j]);
+
+        i += run;
+    }
+
+    size_t numGrowingPoints = reader.readVarUint();
+    if (numGrowingPoints > points.size()) {
+        reader.fail();
+        return;
+    }
+
+    growingPoints.clear();
+    for (size_t i = 0; i < numGrowingPoints; i++) {
+        Pos pos;
+        pos.x = reader.readVarUint();
+        pos.y = reader.readVarUint();
+
+        if (reader.hasFailed() || !isPoint(pos)) {
+            reader.fail();
+            return;
+        }
+
+        growingPoints.insert(pos);
+    }
+}
@@ -9,6 +9,10 @@
 #include <cassert>
 #include <vector>
 
+struct BitStreamReader;
+struct BitStreamWriter;
+struct CustomMap;
+
 struct GridPoint {
     glm::ivec2 pos;
 
@@ -96,6 +100,10 @@ struct Map {
     static Map generate(size_t sizeX, size_t sizeY,
                         size_t heightLimit, size_t seed);
 
+    // Terrain made outside of the game. If it has its own water sources,
+    // raising the water level adds no others.
+    static Map fromCustom(const CustomMap &);
+
     template<typename F>
     void forNeighbors(const Pos &p, F f) {
         assert(isPoint(p));
@@ -135,12 +143,20 @@ struct Map {
     void raiseWaterLevel(size_t waterLevel);
     void waterTick(Fixed tickLengthS, size_t waterLevel);
 
+    // Terrain part of a snapshot of the game state (see SimState). The
+    // entities on the grid points are not included; they are restored
+    // with the entities themselves.
+    void writeSnapshot(BitStreamWriter &) const;
+    void readSnapshot(BitStreamReader &);
+
 private:
     size_t sizeX;
     size_t sizeY;
 
     size_t maxHeight;
 
+    bool fixedWaterSources;
+
     std::vector<GridPoint> points; // 2d array
 
     struct PosLess {
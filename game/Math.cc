@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <iostream>
 #include <limits>
+#include <random>
 
 bool intersectTriangleWithRay(const Ray &ray,
                               const glm::vec3 &a,
@@ -80,10 +81,10 @@ PerlinNoise::PerlinNoise(size_t width, size_t height)
     , noise (width * height) {
 }
 
-void PerlinNoise::generate(size_t octaves, float persistence) {
+void PerlinNoise::generate(uint32_t seed, size_t octaves, float persistence) {
     assert(octaves > 0);
 
-    generateWhiteNoise();
+    generateWhiteNoise(seed);
 
     float amplitude = 1.0f;
     float totalAmplitude = 0.0f; 
@@ -138,10 +139,13 @@ void PerlinNoise::smooth() {
     noise = newNoise;
 }
 
-void PerlinNoise::generateWhiteNoise() {
+void PerlinNoise::generateWhiteNoise(uint32_t seed) {
+    std::minstd_rand random(seed);
+    float range = static_cast<float>(random.max() - random.min());
+
     for (size_t x = 0; x < width; x++) {
         for (size_t y = 0; y < height; y++) {
-            whiteNoise[y*width + x] = randomFloat();
+            whiteNoise[y*width + x] = (random() - random.min()) / range;
         }
     }
 }
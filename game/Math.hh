@@ -46,7 +46,9 @@ struct AABB {
 struct PerlinNoise {
     PerlinNoise(size_t width, size_t height);
 
-    void generate(size_t octaves, float persistence = 0.5f);
+    // The same seed gives the same noise everywhere, unlike rand(),
+    // which is shared by all threads and differs between C libraries
+    void generate(uint32_t seed, size_t octaves, float persistence = 0.5f);
     void smooth();
 
     float &get(size_t x, size_t y) {
@@ -64,7 +66,7 @@ private:
     std::vector<float> whiteNoise;
     std::vector<float> noise;
 
-    void generateWhiteNoise();
+    void generateWhiteNoise(uint32_t seed);
     float generateSmoothNoise(size_t octave, size_t x, size_t y);
 };
 
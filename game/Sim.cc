@@ -1,10 +1,11 @@
 #include "Sim.hh"
 
 #include "Map.hh"
+#include "common/BitStream.hh"
 #include "util/Profiling.hh"
 
-Sim::Sim(const GameSettings &settings)
-    : state(settings),
+Sim::Sim(const GameSettings &settings, const CustomMap *customMap)
+    : state(settings, customMap),
       flyingBlockSystem(state.entities),
       flyingResourceSystem(state),
       rocketSystem(state.getMap()) {
@@ -15,14 +16,76 @@ Sim::Sim(const GameSettings &settings)
     rocketSystem.configure(state.events);
 }
 
+Sim::Sim(const GameSettings &settings, BitStreamReader &reader)
+    : state(settings, reader),
+      flyingBlockSystem(state.entities),
+      flyingResourceSystem(state),
+      rocketSystem(state.getMap()) {
+    flyingBlockSystem.configure(state.events);
+    flyingResourceSystem.configure(state.events);
+    rocketSystem.configure(state.events);
+}
+
+void Sim::writeSnapshot(BitStreamWriter &writer) const {
+    state.writeSnapshot(writer);
+}
+
+void Sim::restoreSnapshot(BitStreamReader &reader) {
+    state.restoreSnapshot(reader);
+}
+
+uint32_t Sim::hashState() const {
+    BitStreamWriter writer;
+    state.writeSnapshot(writer);
+
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < writer.size(); i++) {
+        hash ^= writer.ptr()[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 void Sim::runTick(const std::vector<Order> &orders) {
     PROFILE(tick);
 
     for (auto &order : orders) {
-        if (state.isOrderValid(order))
+        bool valid = state.isOrderValid(order);
+
+        if (valid)
             state.runOrder(order);
+
+        state.events.emit<OrderRun>(order, valid);
     }
 
+    finishTick();
+}
+
+size_t Sim::runTickRemovingInvalid(std::vector<Order> &orders) {
+    PROFILE(tick);
+
+    size_t numValid = 0;
+    for (size_t i = 0; i < orders.size(); i++) {
+        bool valid = state.isOrderValid(orders[i]);
+
+        if (valid) {
+            state.runOrder(orders[i]);
+            orders[numValid++] = orders[i];
+        }
+
+        state.events.emit<OrderRun>(orders[i], valid);
+    }
+
+    size_t numInvalid = orders.size() - numValid;
+    orders.resize(numValid);
+
+    finishTick();
+    return numInvalid;
+}
+
+void Sim::finishTick() {
     state.tick();
 
     {
@@ -24,10 +24,32 @@
 // The only part where the SimState is meant to be changed
 // is in the function executing those orders: Sim::runTick.
 struct Sim {
-    Sim(const GameSettings &);
+    // With a custom map, it is played on instead of a generated one
+    Sim(const GameSettings &, const CustomMap *customMap = NULL);
+
+    // Continues a game from a snapshot written by writeSnapshot. If the
+    // snapshot is malformed, the reader fails and the Sim must not be
+    // used.
+    Sim(const GameSettings &, BitStreamReader &);
+
+    void writeSnapshot(BitStreamWriter &) const;
+
+    // Replaces the state by a snapshot, keeping the Sim itself and the
+    // subscriptions to its events. If the snapshot is malformed, the
+    // reader fails and the Sim must not be used.
+    void restoreSnapshot(BitStreamReader &);
+
+    // Hash of the snapshot of the state, for checking that simulations
+    // in different places agree
+    uint32_t hashState() const;
 
     void runTick(const std::vector<Order> &orders);
 
+    // Like runTick, but removes the orders that turn out to be invalid
+    // when they are run, and returns their number. Running the remaining
+    // orders has the same effect, since invalid orders change nothing.
+    size_t runTickRemovingInvalid(std::vector<Order> &orders);
+
     const SimState &getState() const;
 
     entityx::EntityManager &getEntities() {
@@ -45,6 +67,9 @@ struct Sim {
 private:
     SimState state;
 
+    // Everything after the orders
+    void finishTick();
+
     MinerBuildingSystem minerBuildingSystem;
     FlyingObjectSystem flyingObjectSystem;
     FlyingBlockSystem flyingBlockSystem;
@@ -4,6 +4,7 @@
 #include "Map.hh"
 #include "Math.hh"
 #include "common/Defs.hh"
+#include "common/Order.hh"
 
 #include <entityx/entityx.h>
 #include <Fixed.hh>
@@ -38,6 +39,7 @@ struct FlyingBlock : entityx::Component<FlyingBlock> {
 
 struct Building : entityx::Component<Building> {
     friend struct MainBuildingSystem;
+    friend struct SimState;
 
     Building(BuildingType type, const glm::uvec3 &position,
              const GridPoint &gridPoint, bool finished)
@@ -134,6 +136,7 @@ private:
 
 struct MainBuilding : entityx::Component<MainBuilding> {
     friend struct MainBuildingSystem;
+    friend struct SimState;
 
     size_t getBuildRange() const { return 100; }
     Fixed getBuildSpeed() const { return Fixed(1); }
@@ -167,6 +170,7 @@ private:
 
 struct MinerBuilding : entityx::Component<MinerBuilding> {
     friend struct MinerBuildingSystem;
+    friend struct SimState;
 
     MinerBuilding(ResourceType resource)
         : resource(resource), amountStored(0) {
@@ -204,6 +208,7 @@ private:
 
 public:
     friend struct FlyingObjectSystem;
+    friend struct SimState;
 
     const fvec3 fromPosition;
     const fvec3 toPosition;
@@ -245,4 +250,16 @@ struct BuildingCreated : entityx::Event<BuildingCreated> {
     }
 };
 
+// Emitted by Sim::runTick and Sim::runTickRemovingInvalid for every
+// order of the tick, including invalid ones. valid tells whether the
+// order was run.
+struct OrderRun : entityx::Event<OrderRun> {
+    Order order;
+    bool valid;
+
+    OrderRun(const Order &order, bool valid)
+        : order(order), valid(valid) {
+    }
+};
+
 #endif
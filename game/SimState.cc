@@ -1,8 +1,9 @@
 #include "SimState.hh"
 
 #include "SimComponents.hh"
+#include "common/BitStream.hh"
 
-#include <cstdlib>
+#include <random>
 
 PlayerState::PlayerState(const PlayerInfo &info)
     : info(info) {
@@ -10,21 +11,30 @@ PlayerState::PlayerState(const PlayerInfo &info)
         r = 30;
 }
 
-SimState::SimState(const GameSettings &settings)
+SimState::SimState(const GameSettings &settings, const CustomMap *customMap)
     : settings(settings),
-      map(Map::generate(settings.mapW, settings.mapH,
-                        settings.heightLimit,
-                        settings.randomSeed)),
+      map(customMap ? Map::fromCustom(*customMap) :
+                      Map::generate(settings.mapW, settings.mapH,
+                                    settings.heightLimit,
+                                    settings.randomSeed)),
       players(playersFromSettings(settings)),
       entityCounter(0),
       time(0),
-      waterLevel(0) {
+      waterLevel(0),
+      randomState(settings.randomSeed) {
+    events.subscribe<entityx::EntityCreatedEvent>(freeList);
+    events.subscribe<entityx::EntityDestroyedEvent>(freeList);
+
+    // Not rand(), since other threads might be using it, e.g. a server
+    // running a simulation of its own
+    std::minstd_rand placement(settings.randomSeed);
+
     // Place random spawn points for now...
     for (auto &player : settings.players) {
         size_t x, y;
         do {
-            x = rand() % settings.mapW;
-            y = rand() % settings.mapH;
+            x = placement() % map.getSizeX();
+            y = placement() % map.getSizeY();
         } while (!canPlaceBuilding(BUILDING_MAIN, glm::uvec2(x, y)));
 
         addBuilding(player.id, BUILDING_MAIN, glm::uvec2(x, y), true);
@@ -36,8 +46,8 @@ SimState::SimState(const GameSettings &settings)
     for (size_t i = 0; i < numTrees; i++) {
         size_t x, y;
         do {
-            x = rand() % settings.mapW;
-            y = rand() % settings.mapH;
+            x = placement() % map.getSizeX();
+            y = placement() % map.getSizeY();
         } while (!map.point(x, y).usable());
 
         placeTree(Map::Pos(x, y));
@@ -234,10 +244,9 @@ void SimState::runOrder(const Order &order) {
         case Order::ATTACK: {
             entityx::Entity entity = getGameObject(order.attack.objectId);
 
-            // TODO: Random numbers again..
             int radius = 10;
-            int dx = rand() % radius - radius / 2;
-            int dy = rand() % radius - radius / 2;
+            int dx = static_cast<int>(random() % radius) - radius / 2;
+            int dy = static_cast<int>(random() % radius) - radius / 2;
 
             int x = order.attack.x + dx;
             int y = order.attack.y + dy;
@@ -420,6 +429,478 @@ void SimState::tick() {
     }
 }
 
+// Components of entities in snapshots, as bits of a mask
+enum {
+    SNAPSHOT_BUILDING = 1 << 0,
+    SNAPSHOT_MAIN_BUILDING = 1 << 1,
+    SNAPSHOT_MINER_BUILDING = 1 << 2,
+    SNAPSHOT_TREE = 1 << 3,
+    SNAPSHOT_FLYING_OBJECT = 1 << 4,
+    SNAPSHOT_FLYING_RESOURCE = 1 << 5,
+    SNAPSHOT_FLYING_BLOCK = 1 << 6,
+    SNAPSHOT_ROCKET = 1 << 7,
+
+    SNAPSHOT_COMPONENT_BITS = 8
+};
+
+static void writeFixed(BitStreamWriter &writer, Fixed value) {
+    writer.writeVarInt(value.toRaw());
+}
+
+static Fixed readFixed(BitStreamReader &reader) {
+    return Fixed::fromRaw(static_cast<int>(reader.readVarInt()));
+}
+
+static void writeVec(BitStreamWriter &writer, const glm::uvec3 &v) {
+    writer.writeVarUint(v.x);
+    writer.writeVarUint(v.y);
+    writer.writeVarUint(v.z);
+}
+
+static glm::uvec3 readVec(BitStreamReader &reader) {
+    glm::uvec3 v;
+    v.x = static_cast<unsigned int>(reader.readVarUint());
+    v.y = static_cast<unsigned int>(reader.readVarUint());
+    v.z = static_cast<unsigned int>(reader.readVarUint());
+    return v;
+}
+
+static void writeVec(BitStreamWriter &writer, const fvec3 &v) {
+    writeFixed(writer, v.x);
+    writeFixed(writer, v.y);
+    writeFixed(writer, v.z);
+}
+
+static fvec3 readFixedVec(BitStreamReader &reader) {
+    fvec3 v;
+    v.x = readFixed(reader);
+    v.y = readFixed(reader);
+    v.z = readFixed(reader);
+    return v;
+}
+
+static void writeBlock(BitStreamWriter &writer,
+                       const BuildingTypeInfo::Block &block) {
+    writer.writeVarUint(block.resource);
+    writeVec(writer, block.pos);
+}
+
+static BuildingTypeInfo::Block readBlock(BitStreamReader &reader) {
+    BuildingTypeInfo::Block block;
+    block.resource = static_cast<ResourceType>(reader.readVarUint());
+    block.pos = readVec(reader);
+
+    if (block.resource >= RESOURCE_MAX)
+        reader.fail();
+
+    return block;
+}
+
+// Entities refer to each other by their ObjectId in snapshots, with
+// zero for entities that have been destroyed
+static ObjectId snapshotId(entityx::Entity entity) {
+    return entity ? entity.component<GameObject>()->getId() : 0;
+}
+
+void SimState::writeSnapshot(BitStreamWriter &writer) const {
+    auto ents = const_cast<entityx::EntityManager *>(&entities);
+
+    writeFixed(writer, time);
+    writer.writeVarUint(waterLevel);
+    writer.writeVarUint(entityCounter);
+    writer.writeBits(randomState, 32);
+
+    // The players themselves are given by the settings
+    for (auto &player : players) {
+        for (auto amount : player.second.resources)
+            writer.writeVarUint(amount);
+    }
+
+    map.writeSnapshot(writer);
+
+    // Entities are written by their index, so that they are iterated in
+    // the same order after restoring. Every entity has a GameObject, so
+    // indices without one are free. New entities take the free indices
+    // in the order in which they were freed, which is kept as well.
+    writer.writeVarUint(entities.capacity());
+
+    std::vector<uint32_t> freeIndices(freeList.indices.begin(),
+                                      freeList.indices.end());
+    write(writer, freeIndices);
+
+    for (size_t i = 0; i < entities.capacity(); i++) {
+        Entity entity = ents->get(ents->create_id(i));
+
+        GameObject::Handle gameObject = entity.component<GameObject>();
+        write(writer, static_cast<bool>(gameObject));
+        if (!gameObject)
+            continue;
+
+        writer.writeVarUint(gameObject->getOwner());
+        writer.writeVarUint(gameObject->getId());
+
+        Building::Handle building = entity.component<Building>();
+        MainBuilding::Handle mainBuilding = entity.component<MainBuilding>();
+        MinerBuilding::Handle miner = entity.component<MinerBuilding>();
+        Tree::Handle tree = entity.component<Tree>();
+        FlyingObject::Handle flyingObject = entity.component<FlyingObject>();
+        FlyingResource::Handle flyingResource = entity.component<FlyingResource>();
+        FlyingBlock::Handle flyingBlock = entity.component<FlyingBlock>();
+        Rocket::Handle rocket = entity.component<Rocket>();
+
+        uint32_t mask = (building ? SNAPSHOT_BUILDING : 0)
+                        | (mainBuilding ? SNAPSHOT_MAIN_BUILDING : 0)
+                        | (miner ? SNAPSHOT_MINER_BUILDING : 0)
+                        | (tree ? SNAPSHOT_TREE : 0)
+                        | (flyingObject ? SNAPSHOT_FLYING_OBJECT : 0)
+                        | (flyingResource ? SNAPSHOT_FLYING_RESOURCE : 0)
+                        | (flyingBlock ? SNAPSHOT_FLYING_BLOCK : 0)
+                        | (rocket ? SNAPSHOT_ROCKET : 0);
+        writer.writeBits(mask, SNAPSHOT_COMPONENT_BITS);
+
+        if (building) {
+            writer.writeVarUint(building->type);
+            writeVec(writer, building->position);
+            write(writer, building->finished);
+
+            writer.writeVarUint(building->blocks.size());
+            for (auto &block : building->blocks)
+                writeBlock(writer, block);
+
+            // Blocks that have landed only count as long as their
+            // handle is valid, so they are left out
+            std::vector<ObjectId> incoming;
+            for (auto &handle : building->incomingBlocks) {
+                if (!handle)
+                    continue;
+
+                FlyingBlock::Handle other;
+                for (auto blockEntity : ents->entities_with_components(other)) {
+                    if (other == handle)
+                        incoming.push_back(snapshotId(blockEntity));
+                }
+            }
+            write(writer, incoming);
+        }
+
+        if (mainBuilding) {
+            // Destroyed entities in the queue still take up a tick
+            writer.writeVarUint(mainBuilding->buildQueue.size());
+            for (auto &queued : mainBuilding->buildQueue)
+                writer.writeVarUint(snapshotId(queued));
+
+            writeFixed(writer, mainBuilding->timeLastLaunch);
+        }
+
+        if (miner) {
+            writer.writeVarUint(miner->resource);
+            writeFixed(writer, miner->amountStored);
+        }
+
+        if (tree)
+            writeVec(writer, tree->getPosition());
+
+        if (flyingObject) {
+            writeVec(writer, flyingObject->fromPosition);
+            writeVec(writer, flyingObject->toPosition);
+            writeFixed(writer, flyingObject->lastProgress);
+            writeFixed(writer, flyingObject->progress);
+        }
+
+        if (flyingResource) {
+            writer.writeVarUint(flyingResource->resource);
+            writer.writeVarUint(flyingResource->amount);
+        }
+
+        if (flyingBlock) {
+            writer.writeVarUint(snapshotId(flyingBlock->targetEntity));
+            writeBlock(writer, flyingBlock->block);
+        }
+    }
+}
+
+SimState::SimState(const GameSettings &settings, BitStreamReader &reader)
+    : settings(settings),
+      map(settings.mapW, settings.mapH),
+      players(playersFromSettings(settings)),
+      entityCounter(0),
+      time(0),
+      waterLevel(0),
+      randomState(0) {
+    events.subscribe<entityx::EntityCreatedEvent>(freeList);
+    events.subscribe<entityx::EntityDestroyedEvent>(freeList);
+
+    readSnapshot(reader);
+}
+
+void SimState::restoreSnapshot(BitStreamReader &reader) {
+    entities.reset();
+    freeList.indices.clear();
+
+    readSnapshot(reader);
+}
+
+void SimState::readSnapshot(BitStreamReader &reader) {
+    time = readFixed(reader);
+    waterLevel = reader.readVarUint();
+    entityCounter = reader.readVarUint();
+    randomState = reader.readBits(32);
+
+    for (auto &player : players) {
+        for (auto &amount : player.second.resources)
+            amount = reader.readVarUint();
+    }
+
+    map.readSnapshot(reader);
+
+    // Every index takes up at least one bit
+    size_t capacity = reader.readVarUint();
+    if (reader.hasFailed() || capacity > reader.remainingBits()) {
+        reader.fail();
+        return;
+    }
+
+    std::vector<uint32_t> freeIndices;
+    read(reader, freeIndices);
+    if (reader.hasFailed() || freeIndices.size() > capacity) {
+        reader.fail();
+        return;
+    }
+
+    // The entities are created in the order of their indices, and the
+    // free ones are destroyed again afterwards
+    std::vector<Entity> created;
+    for (size_t i = 0; i < capacity; i++)
+        created.push_back(entities.create());
+
+    std::map<ObjectId, Entity> objects;
+
+    // References to other entities, resolved once all entities exist
+    std::vector<std::pair<Entity, std::vector<ObjectId>>> incomingBlocks;
+    std::vector<std::pair<Entity, std::vector<ObjectId>>> buildQueues;
+    std::vector<std::pair<Entity, ObjectId>> blockTargets;
+
+    for (auto entity : created) {
+        bool used;
+        read(reader, used);
+        if (!used)
+            continue;
+
+        PlayerId owner = static_cast<PlayerId>(reader.readVarUint());
+        ObjectId id = static_cast<ObjectId>(reader.readVarUint());
+
+        if (reader.hasFailed() || id == 0 || id > entityCounter
+            || objects.count(id)
+            || (owner != PLAYER_NEUTRAL && !players.count(owner))) {
+            reader.fail();
+            return;
+        }
+
+        entity.assign<GameObject>(owner, id);
+        objects[id] = entity;
+
+        uint32_t mask = reader.readBits(SNAPSHOT_COMPONENT_BITS);
+
+        if (mask & SNAPSHOT_BUILDING) {
+            BuildingType type = static_cast<BuildingType>(reader.readVarUint());
+            glm::uvec3 position = readVec(reader);
+            bool finished;
+            read(reader, finished);
+
+            if (reader.hasFailed()
+                || type >= BUILDING_MAX
+                || !map.isPoint(glm::uvec2(position))
+                || !map.isPoint(glm::uvec2(position)
+                                + glm::uvec2(buildingTypeInfo[type].size))) {
+                reader.fail();
+                return;
+            }
+
+            Building::Handle building = entity.assign<Building>(
+                type, position, map.point(position.x, position.y), finished);
+
+            size_t numBlocks = reader.readVarUint();
+            if (numBlocks > reader.remainingBits()) {
+                reader.fail();
+                return;
+            }
+
+            // Finished buildings start out with all of their blocks
+            building->blocks.clear();
+            for (size_t i = 0; i < numBlocks; i++)
+                building->blocks.push_back(readBlock(reader));
+
+            incomingBlocks.push_back(std::make_pair(entity,
+                                                    std::vector<ObjectId>()));
+            read(reader, incomingBlocks.back().second);
+
+            map.forRectangle(glm::uvec2(position),
+                             glm::uvec2(buildingTypeInfo[type].size),
+                             [&] (GridPoint &p) {
+                p.entity = entity;
+            });
+        }
+
+        if (mask & SNAPSHOT_MAIN_BUILDING) {
+            MainBuilding::Handle mainBuilding = entity.assign<MainBuilding>();
+
+            buildQueues.push_back(std::make_pair(entity,
+                                                 std::vector<ObjectId>()));
+            read(reader, buildQueues.back().second);
+
+            mainBuilding->timeLastLaunch = readFixed(reader);
+        }
+
+        if (mask & SNAPSHOT_MINER_BUILDING) {
+            ResourceType resource = static_cast<ResourceType>(reader.readVarUint());
+            if (resource >= RESOURCE_MAX) {
+                reader.fail();
+                return;
+            }
+
+            MinerBuilding::Handle miner = entity.assign<MinerBuilding>(resource);
+            miner->amountStored = readFixed(reader);
+        }
+
+        if (mask & SNAPSHOT_TREE) {
+            glm::uvec3 position = readVec(reader);
+            if (reader.hasFailed() || !map.isPoint(glm::uvec2(position))) {
+                reader.fail();
+                return;
+            }
+
+            entity.assign<Tree>(position);
+            map.point(glm::uvec2(position)).entity = entity;
+        }
+
+        if (mask & SNAPSHOT_FLYING_OBJECT) {
+            fvec3 fromPosition = readFixedVec(reader);
+            fvec3 toPosition = readFixedVec(reader);
+            if (reader.hasFailed()
+                || manhattanDistance(fromPosition, toPosition) <= Fixed(0)) {
+                reader.fail();
+                return;
+            }
+
+            FlyingObject::Handle flyingObject =
+                entity.assign<FlyingObject>(fromPosition, toPosition);
+            flyingObject->lastProgress = readFixed(reader);
+            flyingObject->progress = readFixed(reader);
+        }
+
+        if (mask & SNAPSHOT_FLYING_RESOURCE) {
+            ResourceType resource = static_cast<ResourceType>(reader.readVarUint());
+            size_t amount = reader.readVarUint();
+            if (resource >= RESOURCE_MAX) {
+                reader.fail();
+                return;
+            }
+
+            entity.assign<FlyingResource>(resource, amount);
+        }
+
+        if (mask & SNAPSHOT_FLYING_BLOCK) {
+            ObjectId target = static_cast<ObjectId>(reader.readVarUint());
+            BuildingTypeInfo::Block block = readBlock(reader);
+
+            entity.assign<FlyingBlock>(Entity(), block);
+            blockTargets.push_back(std::make_pair(entity, target));
+        }
+
+        if (mask & SNAPSHOT_ROCKET)
+            entity.assign<Rocket>();
+
+        if (reader.hasFailed())
+            return;
+    }
+
+    // Resolve references; zero stands for a destroyed entity
+    auto resolve = [&] (ObjectId id, Entity &entity) {
+        if (id == 0) {
+            entity = Entity();
+            return true;
+        }
+
+        auto it = objects.find(id);
+        if (it == objects.end())
+            return false;
+
+        entity = it->second;
+        return true;
+    };
+
+    for (auto &entry : incomingBlocks) {
+        Building::Handle building = entry.first.component<Building>();
+
+        for (auto id : entry.second) {
+            Entity blockEntity;
+            if (!resolve(id, blockEntity)
+                || !blockEntity
+                || !blockEntity.has_component<FlyingBlock>()) {
+                reader.fail();
+                return;
+            }
+
+            building->incomingBlocks.push_back(
+                blockEntity.component<FlyingBlock>());
+        }
+    }
+
+    for (auto &entry : buildQueues) {
+        MainBuilding::Handle mainBuilding = entry.first.component<MainBuilding>();
+
+        for (auto id : entry.second) {
+            Entity queued;
+            if (!resolve(id, queued)
+                || (queued && !queued.has_component<Building>())) {
+                reader.fail();
+                return;
+            }
+
+            mainBuilding->buildQueue.push_back(queued);
+        }
+    }
+
+    for (auto &entry : blockTargets) {
+        FlyingBlock::Handle flyingBlock = entry.first.component<FlyingBlock>();
+
+        if (!resolve(entry.second, flyingBlock->targetEntity)) {
+            reader.fail();
+            return;
+        }
+    }
+
+    for (auto index : freeIndices) {
+        if (index >= capacity
+            || !created[index]
+            || created[index].has_component<GameObject>()) {
+            reader.fail();
+            return;
+        }
+
+        entities.destroy(created[index].id());
+    }
+
+    if (entities.size() != objects.size())
+        reader.fail();
+}
+
+void SimState::FreeList::receive(const entityx::EntityCreatedEvent &event) {
+    // New indices are only taken when there are no free ones
+    if (!indices.empty() && indices.front() == event.entity.id().index())
+        indices.pop_front();
+}
+
+void SimState::FreeList::receive(const entityx::EntityDestroyedEvent &event) {
+    indices.push_back(event.entity.id().index());
+}
+
+uint32_t SimState::random() {
+    // Linear congruential generator from Numerical Recipes
+    randomState = randomState * 1664525 + 1013904223;
+    return randomState >> 16;
+}
+
 SimState::PlayerMap SimState::playersFromSettings(const GameSettings &settings) {
     SimState::PlayerMap players;
 
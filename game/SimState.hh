@@ -7,11 +7,18 @@
 
 #include <entityx/entityx.h>
 #include <Fixed.hh>
+#include <list>
 #include <map>
 
 using entityx::Entity;
 
+struct BitStreamReader;
+struct BitStreamWriter;
+struct CustomMap;
+
 struct PlayerState {
+    friend struct SimState;
+
     PlayerState(const PlayerInfo &info);
 
     void giveResources(ResourceType type, size_t amount = 1) {
@@ -65,7 +72,20 @@ private:
 //
 // SimState also offers several functions to modify the game state.
 struct SimState : entityx::EntityX {
-    SimState(const GameSettings &);
+    // The map is generated from the random seed, unless a custom one is
+    // given
+    SimState(const GameSettings &, const CustomMap *customMap = NULL);
+
+    // Restores a state written by writeSnapshot. If the snapshot is
+    // malformed, the reader fails and the state must not be used.
+    SimState(const GameSettings &, BitStreamReader &);
+
+    // Writes everything needed to continue the game from this state,
+    // e.g. for players joining a running game
+    void writeSnapshot(BitStreamWriter &) const;
+
+    // Like the constructor, but with the existing state
+    void restoreSnapshot(BitStreamReader &);
 
     bool canPlaceBuilding(BuildingType, const glm::uvec2 &p) const;
     entityx::Entity findClosestBuilding(BuildingType, PlayerId,
@@ -118,6 +138,25 @@ private:
 
     size_t waterLevel;
 
+    // Random numbers of the game logic. Unlike with rand(), the state of
+    // the generator is part of snapshots.
+    uint32_t randomState;
+    uint32_t random();
+
+    // Indices of destroyed entities, in the order in which the entity
+    // manager reuses them. The manager does not tell, so this follows
+    // the creation and destruction of entities.
+    struct FreeList : entityx::Receiver<FreeList> {
+        std::list<uint32_t> indices;
+
+        void receive(const entityx::EntityCreatedEvent &);
+        void receive(const entityx::EntityDestroyedEvent &);
+    };
+
+    FreeList freeList;
+
+    void readSnapshot(BitStreamReader &);
+
     static PlayerMap playersFromSettings(const GameSettings &);
 };
 
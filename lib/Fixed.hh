@@ -53,6 +53,10 @@ public:
     Fixed& operator =(double a) { g= Fixed(a).g; return *this; }*/
     Fixed& operator =(int a) { g= Fixed(a).g; return *this; }
 
+    // Exact representation, e.g. for snapshots of the game state
+    int toRaw() const { return g; }
+    static Fixed fromRaw(int guts) { return Fixed(RAW, guts); }
+
     float toFloat() const { return g * (float)STEP(); }
     double toDouble() const { return g * (double)STEP(); }
     int toInt() const { return g>>BP; }
@@ -0,0 +1,618 @@
+#include "common/Connection.hh"
+#include "common/Message.hh"
+#include "common/BitStream.hh"
+#include "server/Metrics.hh"
+
+#include <enet/enet.h>
+
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <queue>
+#include <string>
+#include <vector>
+
+// A proxy for benchmarking over a bad network on one machine. Clients
+// connect to the proxy instead of the server, and it forwards their UDP
+// datagrams both ways, impaired like a real link: delayed, jittered,
+// dropped, reordered and limited in bandwidth.
+//
+// Every client gets its own socket towards the server, so the server
+// sees them as separate peers. The proxy does not take part in ENet's
+// protocol, but it peeks at the datagrams from the server to find those
+// carrying ticks, and reports how their cadence is affected.
+
+typedef std::chrono::steady_clock Clock;
+
+struct ProxyConfig {
+    enet_uint16 port;
+
+    std::string serverHost;
+    enet_uint16 serverPort;
+
+    // Applied to each direction on its own, so that the round trip time
+    // grows by twice the latency. Datagrams are delayed by the latency
+    // plus a uniformly random amount of up to +-jitter, but they stay in
+    // order unless they are reordered.
+    Clock::duration latency;
+    Clock::duration jitter;
+
+    // Probabilities of dropping a datagram, and of sending it right away,
+    // ahead of the delayed ones
+    double loss;
+    double reorder;
+
+    // Bits per second in each direction, or zero for no limit
+    double bandwidth;
+
+    uint32_t seed;
+
+    Clock::duration reportInterval;
+};
+
+static const size_t MAX_DATAGRAM_SIZE = ENET_PROTOCOL_MAXIMUM_MTU;
+
+// Counted towards the bandwidth for every datagram
+static const size_t UDP_OVERHEAD = 28;
+
+// Datagrams are dropped once the bandwidth limit has held up a direction
+// for this long, like by a full router queue
+static const std::chrono::milliseconds MAX_QUEUE_DELAY(200);
+
+// Clients are forgotten after being silent for this long
+static const std::chrono::seconds FLOW_TIMEOUT(30);
+
+static const size_t COMMAND_SIZES[ENET_PROTOCOL_COMMAND_COUNT] = {
+    0,
+    sizeof(ENetProtocolAcknowledge),
+    sizeof(ENetProtocolConnect),
+    sizeof(ENetProtocolVerifyConnect),
+    sizeof(ENetProtocolDisconnect),
+    sizeof(ENetProtocolPing),
+    sizeof(ENetProtocolSendReliable),
+    sizeof(ENetProtocolSendUnreliable),
+    sizeof(ENetProtocolSendFragment),
+    sizeof(ENetProtocolSendUnsequenced),
+    sizeof(ENetProtocolBandwidthLimit),
+    sizeof(ENetProtocolThrottleConfigure),
+    sizeof(ENetProtocolSendFragment)
+};
+
+// Returns whether an ENet datagram contains the start of a SERVER_TICK
+// message. Our hosts use neither compression nor checksums.
+static bool carriesTicks(const uint8_t *data, size_t size) {
+    if (size < 2)
+        return false;
+
+    uint16_t peerId = static_cast<uint16_t>((data[0] << 8) | data[1]);
+    if (peerId & ENET_PROTOCOL_HEADER_FLAG_COMPRESSED)
+        return false;
+
+    size_t offset = (peerId & ENET_PROTOCOL_HEADER_FLAG_SENT_TIME) ? 4 : 2;
+
+    while (offset + sizeof(ENetProtocolCommandHeader) <= size) {
+        ENetProtocol command;
+        memcpy(&command, data + offset,
+               std::min(sizeof(command), size - offset));
+
+        size_t commandNumber = command.header.command
+                               & ENET_PROTOCOL_COMMAND_MASK;
+        if (commandNumber == ENET_PROTOCOL_COMMAND_NONE
+            || commandNumber >= ENET_PROTOCOL_COMMAND_COUNT)
+            return false;
+
+        size_t commandSize = COMMAND_SIZES[commandNumber];
+        if (offset + commandSize > size)
+            return false;
+
+        size_t dataLength = 0;
+        bool first = false;
+
+        switch (commandNumber) {
+        case ENET_PROTOCOL_COMMAND_SEND_RELIABLE:
+            dataLength = ENET_NET_TO_HOST_16(command.sendReliable.dataLength);
+            first = true;
+            break;
+        case ENET_PROTOCOL_COMMAND_SEND_UNRELIABLE:
+            dataLength = ENET_NET_TO_HOST_16(
+                command.sendUnreliable.dataLength);
+            first = true;
+            break;
+        case ENET_PROTOCOL_COMMAND_SEND_UNSEQUENCED:
+            dataLength = ENET_NET_TO_HOST_16(
+                command.sendUnsequenced.dataLength);
+            first = true;
+            break;
+        case ENET_PROTOCOL_COMMAND_SEND_FRAGMENT:
+        case ENET_PROTOCOL_COMMAND_SEND_UNRELIABLE_FRAGMENT:
+            dataLength = ENET_NET_TO_HOST_16(
+                command.sendFragment.dataLength);
+            first = ENET_NET_TO_HOST_32(
+                command.sendFragment.fragmentNumber) == 0;
+            break;
+        default:
+            break;
+        }
+
+        offset += commandSize;
+        if (offset + dataLength > size)
+            return false;
+
+        if (first && dataLength > 0) {
+            BitStreamReader reader(data + offset, dataLength);
+            if (reader.readVarUint() == Message::SERVER_TICK
+                && !reader.hasFailed())
+                return true;
+        }
+
+        offset += dataLength;
+    }
+
+    return false;
+}
+
+// Traffic in one direction since the last report
+struct LinkStats {
+    size_t packets, bytes;
+    size_t lost, queueDropped, reordered;
+
+    // Time datagrams spent in the proxy
+    Stats delayMs;
+
+    LinkStats() {
+        reset();
+    }
+
+    void reset() {
+        packets = bytes = 0;
+        lost = queueDropped = reordered = 0;
+        delayMs.reset();
+    }
+
+    void print(std::ostream &out, const char *name) const {
+        out << name << ": " << packets << " packets, " << bytes
+            << " bytes, " << lost << " lost, " << queueDropped
+            << " dropped by queue, " << reordered << " reordered, delay "
+            << delayMs.mean() << "ms (max " << delayMs.max << "ms)"
+            << std::endl;
+    }
+};
+
+// One direction of the impaired link
+struct Link {
+    LinkStats stats;
+
+    // When the datagrams given so far have been sent at the bandwidth
+    // limit, and when the last one in order is delivered
+    Clock::time_point sendEndTime;
+    Clock::time_point lastDeliveryTime;
+};
+
+struct Flow {
+    ENetAddress clientAddress;
+
+    // Socket towards the server
+    ENetSocket socket;
+
+    Clock::time_point lastActiveTime;
+
+    // Datagrams of the flow that have not been delivered yet
+    size_t pending;
+
+    // When the last tick datagram arrived from the server and when it
+    // was passed on to the client
+    bool ticksReceived, ticksDelivered;
+    Clock::time_point lastTickReceiveTime;
+    Clock::time_point lastTickDeliveryTime;
+
+    Flow(const ENetAddress &clientAddress, ENetSocket socket)
+        : clientAddress(clientAddress), socket(socket),
+          lastActiveTime(Clock::now()), pending(0), ticksReceived(false),
+          ticksDelivered(false) {
+    }
+};
+
+struct Datagram {
+    Flow *flow;
+    bool toServer;
+    bool ticks;
+
+    Clock::time_point receiveTime;
+    Clock::time_point deliveryTime;
+
+    // Keeps datagrams with the same delivery time in order
+    uint64_t sequence;
+
+    std::vector<uint8_t> data;
+};
+
+struct LaterDelivery {
+    bool operator()(const Datagram *a, const Datagram *b) const {
+        if (a->deliveryTime != b->deliveryTime)
+            return a->deliveryTime > b->deliveryTime;
+        return a->sequence > b->sequence;
+    }
+};
+
+struct Proxy {
+    Proxy(const ProxyConfig &config)
+        : config(config), socket(ENET_SOCKET_NULL), sequence(0),
+          random(config.seed) {
+    }
+
+    ~Proxy() {
+        while (!scheduled.empty()) {
+            delete scheduled.top();
+            scheduled.pop();
+        }
+
+        for (auto flow : flows) {
+            enet_socket_destroy(flow->socket);
+            delete flow;
+        }
+
+        if (socket != ENET_SOCKET_NULL)
+            enet_socket_destroy(socket);
+    }
+
+    bool init() {
+        if (enet_address_set_host(&serverAddress,
+                                  config.serverHost.c_str()) != 0) {
+            std::cerr << "Failed to resolve " << config.serverHost
+                      << std::endl;
+            return false;
+        }
+        serverAddress.port = config.serverPort;
+
+        ENetAddress address;
+        address.host = ENET_HOST_ANY;
+        address.port = config.port;
+
+        socket = createSocket(&address);
+        if (socket == ENET_SOCKET_NULL) {
+            std::cerr << "Failed to listen on port " << address.port
+                      << std::endl;
+            return false;
+        }
+
+        std::cout << "Proxy listening on port " << address.port
+                  << ", forwarding to " << config.serverHost << ":"
+                  << config.serverPort << std::endl;
+        return true;
+    }
+
+    void run() {
+        Clock::time_point nextReportTime = Clock::now()
+                                           + config.reportInterval;
+
+        for (;;) {
+            Clock::time_point now = Clock::now();
+
+            while (!scheduled.empty() && scheduled.top()->deliveryTime <= now) {
+                Datagram *datagram = scheduled.top();
+                scheduled.pop();
+
+                deliver(*datagram, now);
+                delete datagram;
+            }
+
+            if (now >= nextReportTime) {
+                report();
+                removeIdleFlows(now);
+                nextReportTime = now + config.reportInterval;
+            }
+
+            Clock::time_point deadline = nextReportTime;
+            if (!scheduled.empty())
+                deadline = std::min(deadline, scheduled.top()->deliveryTime);
+
+            enet_uint32 timeoutMs = enetTimeoutMs(deadline, now);
+
+            ENetSocketSet set;
+            ENET_SOCKETSET_EMPTY(set);
+            ENET_SOCKETSET_ADD(set, socket);
+
+            ENetSocket maxSocket = socket;
+            for (auto flow : flows) {
+                ENET_SOCKETSET_ADD(set, flow->socket);
+                maxSocket = std::max(maxSocket, flow->socket);
+            }
+
+            if (enet_socketset_select(maxSocket, &set, NULL, timeoutMs) < 0)
+                continue;
+
+            if (ENET_SOCKETSET_CHECK(set, socket))
+                receiveFromClients();
+
+            for (size_t i = 0; i < flows.size(); i++) {
+                if (ENET_SOCKETSET_CHECK(set, flows[i]->socket))
+                    receiveFromServer(flows[i]);
+            }
+        }
+    }
+
+private:
+    const ProxyConfig &config;
+
+    ENetAddress serverAddress;
+
+    // Socket the clients connect to
+    ENetSocket socket;
+
+    std::vector<Flow *> flows;
+
+    // Datagrams by delivery time
+    std::priority_queue<Datagram *, std::vector<Datagram *>, LaterDelivery>
+        scheduled;
+    uint64_t sequence;
+
+    std::mt19937 random;
+
+    Link up, down;
+
+    // Cadence of tick datagrams arriving from the server and delivered
+    // to the clients, over all flows since the last report
+    Stats tickIntervalInMs;
+    Stats tickIntervalOutMs;
+
+    ENetSocket createSocket(const ENetAddress *address) {
+        ENetSocket newSocket = enet_socket_create(ENET_SOCKET_TYPE_DATAGRAM);
+        if (newSocket == ENET_SOCKET_NULL)
+            return ENET_SOCKET_NULL;
+
+        if (enet_socket_bind(newSocket, address) != 0) {
+            enet_socket_destroy(newSocket);
+            return ENET_SOCKET_NULL;
+        }
+
+        enet_socket_set_option(newSocket, ENET_SOCKOPT_NONBLOCK, 1);
+        enet_socket_set_option(newSocket, ENET_SOCKOPT_RCVBUF, 256 * 1024);
+        enet_socket_set_option(newSocket, ENET_SOCKOPT_SNDBUF, 256 * 1024);
+        return newSocket;
+    }
+
+    Flow *findFlow(const ENetAddress &address) {
+        for (auto flow : flows) {
+            if (flow->clientAddress.host == address.host
+                && flow->clientAddress.port == address.port)
+                return flow;
+        }
+
+        ENetSocket flowSocket = createSocket(NULL);
+        if (flowSocket == ENET_SOCKET_NULL) {
+            std::cerr << "Failed to create socket for new client"
+                      << std::endl;
+            return NULL;
+        }
+
+        flows.push_back(new Flow(address, flowSocket));
+
+        std::cout << "Client from port " << address.port << " ("
+                  << flows.size() << " clients)" << std::endl;
+        return flows.back();
+    }
+
+    void removeIdleFlows(Clock::time_point now) {
+        for (size_t i = 0; i < flows.size();) {
+            Flow *flow = flows[i];
+
+            if (flow->pending == 0
+                && now - flow->lastActiveTime >= FLOW_TIMEOUT) {
+                std::cout << "Client from port " << flow->clientAddress.port
+                          << " timed out" << std::endl;
+
+                enet_socket_destroy(flow->socket);
+                delete flow;
+                flows.erase(flows.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+
+    void receiveFromClients() {
+        for (;;) {
+            uint8_t data[MAX_DATAGRAM_SIZE];
+            ENetBuffer buffer;
+            buffer.data = data;
+            buffer.dataLength = sizeof(data);
+
+            ENetAddress address;
+            int length = enet_socket_receive(socket, &address, &buffer, 1);
+            if (length <= 0)
+                return;
+
+            Flow *flow = findFlow(address);
+            if (flow)
+                schedule(flow, true, data, length);
+        }
+    }
+
+    void receiveFromServer(Flow *flow) {
+        for (;;) {
+            uint8_t data[MAX_DATAGRAM_SIZE];
+            ENetBuffer buffer;
+            buffer.data = data;
+            buffer.dataLength = sizeof(data);
+
+            ENetAddress address;
+            int length = enet_socket_receive(flow->socket, &address,
+                                             &buffer, 1);
+            if (length <= 0)
+                return;
+
+            if (address.host != serverAddress.host
+                || address.port != serverAddress.port)
+                continue;
+
+            schedule(flow, false, data, length);
+        }
+    }
+
+    void schedule(Flow *flow, bool toServer, const uint8_t *data,
+                  size_t size) {
+        Clock::time_point now = Clock::now();
+        flow->lastActiveTime = now;
+
+        bool ticks = !toServer && carriesTicks(data, size);
+        if (ticks) {
+            if (flow->ticksReceived) {
+                tickIntervalInMs.add(std::chrono::duration<double, std::milli>(
+                    now - flow->lastTickReceiveTime).count());
+            }
+
+            flow->ticksReceived = true;
+            flow->lastTickReceiveTime = now;
+        }
+
+        Link &link(toServer ? up : down);
+
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+        if (uniform(random) < config.loss) {
+            link.stats.lost++;
+            return;
+        }
+
+        // Waits for the datagrams before it to be sent at the bandwidth
+        // limit, then takes its own time
+        Clock::time_point sendTime = now;
+        if (config.bandwidth > 0) {
+            sendTime = std::max(now, link.sendEndTime);
+
+            if (sendTime - now > MAX_QUEUE_DELAY) {
+                link.stats.queueDropped++;
+                return;
+            }
+
+            link.sendEndTime = sendTime + std::chrono::duration_cast<
+                Clock::duration>(std::chrono::duration<double>(
+                    (size + UDP_OVERHEAD) * 8 / config.bandwidth));
+            sendTime = link.sendEndTime;
+        }
+
+        Datagram *datagram = new Datagram;
+        datagram->flow = flow;
+        datagram->toServer = toServer;
+        datagram->ticks = ticks;
+        datagram->receiveTime = now;
+        datagram->sequence = sequence++;
+        datagram->data.assign(data, data + size);
+
+        if (uniform(random) < config.reorder) {
+            datagram->deliveryTime = sendTime;
+            link.stats.reordered++;
+        } else {
+            double jitterS = std::chrono::duration<double>(
+                config.jitter).count();
+            Clock::duration delay = config.latency
+                + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(
+                        (2 * uniform(random) - 1) * jitterS));
+
+            datagram->deliveryTime = std::max(sendTime + delay,
+                                              link.lastDeliveryTime);
+            datagram->deliveryTime = std::max(datagram->deliveryTime, now);
+            link.lastDeliveryTime = datagram->deliveryTime;
+        }
+
+        flow->pending++;
+        scheduled.push(datagram);
+    }
+
+    void deliver(const Datagram &datagram, Clock::time_point now) {
+        Flow *flow = datagram.flow;
+        assert(flow->pending > 0);
+        flow->pending--;
+
+        ENetBuffer buffer;
+        buffer.data = const_cast<uint8_t *>(&datagram.data[0]);
+        buffer.dataLength = datagram.data.size();
+
+        if (datagram.toServer)
+            enet_socket_send(flow->socket, &serverAddress, &buffer, 1);
+        else
+            enet_socket_send(socket, &flow->clientAddress, &buffer, 1);
+
+        Link &link(datagram.toServer ? up : down);
+        link.stats.packets++;
+        link.stats.bytes += datagram.data.size();
+        link.stats.delayMs.add(std::chrono::duration<double, std::milli>(
+            now - datagram.receiveTime).count());
+
+        if (datagram.ticks) {
+            if (flow->ticksDelivered) {
+                tickIntervalOutMs.add(
+                    std::chrono::duration<double, std::milli>(
+                        now - flow->lastTickDeliveryTime).count());
+            }
+
+            flow->ticksDelivered = true;
+            flow->lastTickDeliveryTime = now;
+        }
+    }
+
+    void report() {
+        std::ostream &out(std::cout);
+
+        out << "--- " << flows.size() << " clients, last "
+            << std::chrono::duration<double>(config.reportInterval).count()
+            << "s" << std::endl;
+
+        up.stats.print(out, "up");
+        down.stats.print(out, "down");
+
+        out << "tick interval: in " << tickIntervalInMs.mean() << "ms (sd "
+            << tickIntervalInMs.stddev() << ", max " << tickIntervalInMs.max
+            << "), out " << tickIntervalOutMs.mean() << "ms (sd "
+            << tickIntervalOutMs.stddev() << ", max "
+            << tickIntervalOutMs.max << ")" << std::endl;
+
+        up.stats.reset();
+        down.stats.reset();
+        tickIntervalInMs.reset();
+        tickIntervalOutMs.reset();
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: proxy port server-host server-port "
+                  << "[latency ms] [jitter ms] [loss %] [reorder %] "
+                  << "[bandwidth kbit/s] [seed]" << std::endl;
+        return 1;
+    }
+
+    if (enet_initialize() != 0) {
+        std::cerr << "Failed to initialize ENet" << std::endl;
+        return 1;
+    }
+
+    ProxyConfig config;
+    config.port = static_cast<enet_uint16>(atoi(argv[1]));
+    config.serverHost = argv[2];
+    config.serverPort = static_cast<enet_uint16>(atoi(argv[3]));
+    config.latency = std::chrono::milliseconds(argc > 4 ? atoi(argv[4]) : 0);
+    config.jitter = std::chrono::milliseconds(argc > 5 ? atoi(argv[5]) : 0);
+    config.loss = argc > 6 ? atof(argv[6]) / 100 : 0;
+    config.reorder = argc > 7 ? atof(argv[7]) / 100 : 0;
+    config.bandwidth = argc > 8 ? atof(argv[8]) * 1000 : 0;
+    config.seed = argc > 9 ? static_cast<uint32_t>(atoi(argv[9])) : 0;
+    config.reportInterval = std::chrono::seconds(5);
+
+    Proxy *proxy = new Proxy(config);
+
+    if (!proxy->init())
+        return 1;
+
+    proxy->run();
+
+    delete proxy;
+
+    enet_deinitialize();
+
+    return 0;
+}
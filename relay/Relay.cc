@@ -0,0 +1,537 @@
+#include "common/Connection.hh"
+#include "common/Message.hh"
+#include "common/BitStream.hh"
+#include "common/OrderCodec.hh"
+#include "common/ENetPool.hh"
+
+#include <enet/enet.h>
+
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// A relay watches one match of a server, or of another relay, and passes
+// its ticks on to any number of spectators, delayed by a fixed time.
+//
+// Upstream, the relay is a single spectator, so it never holds up the
+// match, no matter how many spectators it has. It keeps all ticks of
+// the match, so spectators can connect at any time; they are sent the
+// ticks from the start and catch up. Spectators can be relays again, so
+// relays can be chained.
+//
+// A custom map is passed on to the spectators as it arrives, in parts
+// like the ticks, on its own channel.
+
+typedef std::chrono::steady_clock Clock;
+
+struct RelayConfig {
+    enet_uint16 port;
+
+    // Maximum number of spectators
+    size_t maxPeers;
+
+    std::string upstreamHost;
+    enet_uint16 upstreamPort;
+
+    // Match to watch upstream, or zero for the next one
+    uint32_t matchId;
+
+    // Ticks are passed on this long after they have been received
+    Clock::duration delay;
+};
+
+// Maximum number of tick ranges in one packet to spectators
+static const size_t MAX_RANGES_PER_PACKET = 32;
+
+// Spectators that are behind, e.g. after connecting late, are sent
+// ticks as long as they have less than this many bytes in transit
+static const size_t TICKS_WINDOW = 16 * 1024;
+
+// Custom maps are passed on in parts of this size, with at most
+// MAP_WINDOW bytes of the map in transit
+static const size_t MAP_CHUNK_SIZE = 1024;
+static const size_t MAP_WINDOW = 16 * 1024;
+
+// Larger custom maps are rejected
+static const size_t MAX_MAP_SIZE = 16 * 1024 * 1024;
+
+// How often to check for room in the windows of spectators that are
+// behind, since ENet has no event for acknowledgements
+static const std::chrono::milliseconds WINDOW_POLL_INTERVAL(10);
+
+struct SpectatorInfo {
+    ENetPeer *peer;
+
+    // Number of ranges of Relay::ranges that have been sent
+    size_t rangesSent;
+
+    // Bytes of the custom map that have been sent
+    size_t mapSent;
+
+    SpectatorInfo(ENetPeer *peer)
+        : peer(peer), rangesSent(0), mapSent(0) {
+    }
+};
+
+struct Relay {
+    Relay(const RelayConfig &config)
+        : config(config), host(NULL), upstream(NULL), upstreamDone(false),
+          matchId(0), gameStarted(false), mapSize(0), ticksReceived(0),
+          rangesReleased(0), tickMessage(Message::SERVER_TICK) {
+    }
+
+    ~Relay() {
+        for (auto spectator : spectators)
+            delete spectator;
+
+        if (host)
+            enet_host_destroy(host);
+    }
+
+    bool init() {
+        ENetAddress address;
+        address.host = ENET_HOST_ANY;
+        address.port = config.port;
+
+        // One more peer for the upstream connection
+        host = enet_host_create(&address, config.maxPeers + 1, NUM_CHANNELS,
+                                0, 0);
+
+        if (host == NULL) {
+            std::cerr << "Failed to create host on port " << address.port
+                      << std::endl;
+            return false;
+        }
+
+        ENetAddress upstreamAddress;
+        enet_address_set_host(&upstreamAddress, config.upstreamHost.c_str());
+        upstreamAddress.port = config.upstreamPort;
+
+        upstream = enet_host_connect(host, &upstreamAddress, NUM_CHANNELS,
+                                     CONNECT_SPECTATE | config.matchId);
+
+        if (upstream == NULL) {
+            std::cerr << "Failed to connect to " << config.upstreamHost
+                      << ":" << config.upstreamPort << std::endl;
+            return false;
+        }
+
+        std::cout << "Relay listening on port " << address.port
+                  << ", watching " << config.upstreamHost << ":"
+                  << config.upstreamPort << std::endl;
+        return true;
+    }
+
+    // Returns once the match has ended and every spectator has been sent
+    // all of it
+    void run() {
+        for (;;) {
+            Clock::time_point now = Clock::now();
+            Clock::time_point deadline = now + std::chrono::seconds(1);
+
+            while (rangesReleased < ranges.size()
+                   && ranges[rangesReleased].releaseTime <= now) {
+                rangesReleased++;
+            }
+
+            if (rangesReleased < ranges.size()) {
+                deadline = std::min(deadline,
+                                    ranges[rangesReleased].releaseTime);
+            }
+
+            if (!sendTicks() || !sendMaps())
+                deadline = std::min(deadline, now + WINDOW_POLL_INTERVAL);
+
+            if (upstreamDone && rangesReleased == ranges.size()) {
+                if (spectators.empty())
+                    return;
+
+                // Disconnecting waits for the queued ticks to be sent
+                for (auto spectator : spectators) {
+                    if (spectator->rangesSent == ranges.size())
+                        enet_peer_disconnect_later(spectator->peer, 0);
+                }
+            }
+
+            enet_uint32 timeoutMs = enetTimeoutMs(deadline, Clock::now());
+
+            ENetEvent event;
+
+            int result = enet_host_service(host, &event, timeoutMs);
+            for (; result > 0; result = enet_host_service(host, &event, 0))
+                handleEvent(event);
+        }
+    }
+
+private:
+    const RelayConfig &config;
+
+    ENetHost *host;
+
+    ENetPeer *upstream;
+    bool upstreamDone;
+
+    std::vector<SpectatorInfo *> spectators;
+
+    uint32_t matchId;
+
+    bool gameStarted;
+    GameSettings settings;
+
+    // Custom map as received so far, and its whole size, if any
+    std::vector<uint8_t> map;
+    size_t mapSize;
+
+    // Ticks of the match, as received from upstream, and when they are
+    // passed on. Ranges before rangesReleased can be sent to spectators.
+    struct Range {
+        Message::TickRange range;
+        size_t firstTick;
+        uint8_t ticksAhead;
+        Clock::time_point releaseTime;
+    };
+    std::vector<Range> ranges;
+    size_t ticksReceived;
+    size_t rangesReleased;
+
+    MessagePool messagePool;
+
+    // Upstream tick packets are delta compressed on their own
+    OrderCodec receiveCodec;
+
+    // Reused for building tick packets
+    Message tickMessage;
+    OrderCodec tickCodec;
+
+    struct TickPacket {
+        size_t firstRange;
+        size_t numRanges;
+        ENetPacket *packet;
+    };
+
+    void sendMessage(ENetPeer *peer, const Message &message) {
+        enet_peer_send(peer, CHANNEL_RELIABLE, message.toPacket());
+    }
+
+    // Sends the spectators the released ranges they have not been sent
+    // yet. Spectators at the same position share packets. Returns false
+    // if some spectators are behind and have no room in their windows.
+    bool sendTicks() {
+        bool done = true;
+
+        // Packets for the spectators, by the first range they are missing
+        std::vector<TickPacket> packets;
+
+        for (auto spectator : spectators) {
+            if (!gameStarted)
+                break;
+
+            auto sendChunk = [&](size_t firstRange, size_t numRanges) {
+                TickPacket *packet = NULL;
+                for (auto &entry : packets) {
+                    if (entry.firstRange == firstRange)
+                        packet = &entry;
+                }
+
+                if (!packet) {
+                    packets.push_back(makeTickPacket(firstRange));
+                    packet = &packets.back();
+                }
+
+                assert(packet->numRanges == numRanges);
+                enet_peer_send(spectator->peer, CHANNEL_RELIABLE,
+                               packet->packet);
+                return packet->packet->dataLength;
+            };
+
+            if (!sendWindowed(spectator->peer->reliableDataInTransit,
+                              spectator->rangesSent, rangesReleased,
+                              MAX_RANGES_PER_PACKET, TICKS_WINDOW, sendChunk))
+                done = false;
+        }
+
+        for (auto &entry : packets) {
+            if (entry.packet->referenceCount == 0)
+                enet_packet_destroy(entry.packet);
+        }
+
+        return done;
+    }
+
+    // Sends the spectators the parts of the custom map that they have
+    // not been sent yet. Returns false if some spectators have no room in
+    // their windows.
+    bool sendMaps() {
+        bool done = true;
+
+        // A part for every spectator is rare enough not to share packets
+        for (auto spectator : spectators) {
+            auto sendChunk = [&](size_t offset, size_t size) {
+                Message message(Message::SERVER_MAP);
+                Message::MapChunk &chunk(message.server_map);
+                chunk.size = static_cast<uint32_t>(mapSize);
+                chunk.offset = static_cast<uint32_t>(offset);
+                chunk.data.assign(map.begin() + offset,
+                                  map.begin() + offset + size);
+
+                enet_peer_send(spectator->peer, CHANNEL_MAP,
+                               message.toPacket());
+                return size;
+            };
+
+            if (!sendWindowed(spectator->peer->reliableDataInTransit,
+                              spectator->mapSent, map.size(),
+                              MAP_CHUNK_SIZE, MAP_WINDOW, sendChunk))
+                done = false;
+        }
+
+        return done;
+    }
+
+    void receiveMap(const Message::MapChunk &chunk) {
+        if (chunk.offset == 0 && map.empty() && chunk.size <= MAX_MAP_SIZE)
+            mapSize = chunk.size;
+
+        if (chunk.size != mapSize || chunk.offset != map.size()
+            || chunk.data.size() > mapSize - map.size()) {
+            std::cout << "Ignoring map part at " << chunk.offset << std::endl;
+            return;
+        }
+
+        map.insert(map.end(), chunk.data.begin(), chunk.data.end());
+
+        if (map.size() == mapSize) {
+            std::cout << "Received map (" << mapSize << " bytes)"
+                      << std::endl;
+        }
+    }
+
+    TickPacket makeTickPacket(size_t firstRange) {
+        assert(firstRange < rangesReleased);
+
+        size_t endRange = std::min(firstRange + MAX_RANGES_PER_PACKET,
+                                   rangesReleased);
+
+        Message::ServerTick &tick(tickMessage.server_tick);
+        tick.firstTick = static_cast<uint32_t>(ranges[firstRange].firstTick);
+        tick.ticksAhead = ranges[endRange - 1].ticksAhead;
+        tick.ranges.clear();
+
+        for (size_t i = firstRange; i < endRange; i++)
+            tick.ranges.push_back(ranges[i].range);
+
+        tickCodec.reset();
+
+        TickPacket packet;
+        packet.firstRange = firstRange;
+        packet.numRanges = endRange - firstRange;
+        packet.packet = tickMessage.toPacket(&tickCodec);
+        return packet;
+    }
+
+    void receiveTicks(const Message::ServerTick &tick) {
+        // Same as in the client, but upstream sends everything once
+        if (tick.firstTick > ticksReceived) {
+            std::cout << "Ignoring ticks starting at " << tick.firstTick
+                      << ", expected " << ticksReceived << std::endl;
+            return;
+        }
+
+        Clock::time_point releaseTime = Clock::now() + config.delay;
+
+        size_t firstTick = tick.firstTick;
+        for (auto &range : tick.ranges) {
+            size_t endTick = firstTick + range.numTicks;
+
+            if (endTick > ticksReceived) {
+                ranges.push_back(Range());
+                ranges.back().firstTick = ticksReceived;
+                ranges.back().ticksAhead = tick.ticksAhead;
+                ranges.back().releaseTime = releaseTime;
+
+                Message::TickRange &newRange(ranges.back().range);
+                newRange.numTicks = endTick - ticksReceived;
+
+                // Only the empty ticks at the end might be new
+                if (firstTick == ticksReceived)
+                    newRange.orders = range.orders;
+
+                ticksReceived = endTick;
+            }
+
+            firstTick = endTick;
+        }
+    }
+
+    void handleUpstreamMessage(const Message &message) {
+        switch (message.type) {
+        case Message::SERVER_CONNECT:
+            matchId = message.server_connect.matchId;
+            std::cout << "Watching match " << matchId << std::endl;
+            return;
+
+        case Message::SERVER_START: {
+            if (gameStarted)
+                return;
+
+            gameStarted = true;
+            settings = message.server_start.settings;
+
+            // The map might have come first, on its own channel
+            if (mapSize != message.server_start.mapSize) {
+                map.clear();
+                mapSize = message.server_start.mapSize;
+            }
+
+            std::cout << "Match " << matchId << " started" << std::endl;
+
+            Message start(Message::SERVER_START);
+            start.server_start.settings = settings;
+            start.server_start.lateJoin = 0;
+            start.server_start.stateHashInterval = 0;
+            start.server_start.mapSize = static_cast<uint32_t>(mapSize);
+            for (auto spectator : spectators)
+                sendMessage(spectator->peer, start);
+            return;
+        }
+
+        case Message::SERVER_TICK:
+            if (gameStarted)
+                receiveTicks(message.server_tick);
+            return;
+
+        case Message::SERVER_MAP:
+            receiveMap(message.server_map);
+            return;
+
+        default:
+            return;
+        }
+    }
+
+    void connectSpectator(ENetPeer *peer) {
+        if (upstreamDone && ranges.empty()) {
+            enet_peer_disconnect(peer, 0);
+            return;
+        }
+
+        SpectatorInfo *spectator = new SpectatorInfo(peer);
+        peer->data = spectator;
+        spectators.push_back(spectator);
+
+        // The match id is only known once upstream has told us
+        Message message(Message::SERVER_CONNECT);
+        message.server_connect.yourPlayerId = 0;
+        message.server_connect.matchId = matchId;
+        sendMessage(peer, message);
+
+        if (gameStarted) {
+            Message start(Message::SERVER_START);
+            start.server_start.settings = settings;
+            start.server_start.lateJoin = 0;
+            start.server_start.stateHashInterval = 0;
+            start.server_start.mapSize = static_cast<uint32_t>(mapSize);
+            sendMessage(peer, start);
+        }
+
+        std::cout << "Spectator joined (" << spectators.size()
+                  << " watching)" << std::endl;
+    }
+
+    void disconnectSpectator(SpectatorInfo *spectator) {
+        auto position = std::find(spectators.begin(), spectators.end(),
+                                  spectator);
+        assert(position != spectators.end());
+        spectators.erase(position);
+
+        spectator->peer->data = NULL;
+        delete spectator;
+
+        std::cout << "Spectator left (" << spectators.size()
+                  << " watching)" << std::endl;
+    }
+
+    void handleEvent(ENetEvent &event) {
+        switch (event.type) {
+        case ENET_EVENT_TYPE_CONNECT:
+            if (event.peer == upstream) {
+                std::cout << "Connected to " << config.upstreamHost << ":"
+                          << config.upstreamPort << std::endl;
+            } else {
+                connectSpectator(event.peer);
+            }
+            return;
+
+        case ENET_EVENT_TYPE_RECEIVE: {
+            // Spectators have nothing to say
+            if (event.peer == upstream) {
+                BitStreamReader reader(event.packet->data,
+                                       event.packet->dataLength);
+                receiveCodec.reset();
+                reader.setOrderCodec(&receiveCodec);
+
+                const Message *message = messagePool.decode(reader);
+                if (message)
+                    handleUpstreamMessage(*message);
+                else
+                    std::cout << "Ignoring malformed message" << std::endl;
+            }
+
+            enet_packet_destroy(event.packet);
+            return;
+        }
+
+        case ENET_EVENT_TYPE_DISCONNECT:
+            if (event.peer == upstream) {
+                std::cout << "Upstream disconnected after " << ticksReceived
+                          << " ticks" << std::endl;
+                upstream = NULL;
+                upstreamDone = true;
+            } else if (event.peer->data) {
+                disconnectSpectator(
+                    static_cast<SpectatorInfo *>(event.peer->data));
+            }
+            return;
+
+        default: assert(false);
+        }
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: relay port upstream-host upstream-port "
+                  << "[delay ms] [match id]" << std::endl;
+        return 1;
+    }
+
+    if (initializeENetWithPool() != 0) {
+        std::cerr << "Failed to initialize ENet" << std::endl;
+        return 1;
+    }
+
+    RelayConfig config;
+    config.port = static_cast<enet_uint16>(atoi(argv[1]));
+    config.maxPeers = 256;
+    config.upstreamHost = argv[2];
+    config.upstreamPort = static_cast<enet_uint16>(atoi(argv[3]));
+    config.delay = std::chrono::milliseconds(argc > 4 ? atoi(argv[4]) : 0);
+    config.matchId = argc > 5 ? static_cast<uint32_t>(atoi(argv[5])) : 0;
+
+    Relay *relay = new Relay(config);
+
+    if (!relay->init())
+        return 1;
+
+    relay->run();
+
+    delete relay;
+
+    enet_deinitialize();
+
+    return 0;
+}
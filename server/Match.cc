@@ -0,0 +1,1163 @@
+#include "Match.hh"
+
+#include "common/BitStream.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+
+// Bounds for the number of ticks that are sent ahead
+static const size_t MIN_INPUT_DELAY = 2;
+static const size_t MAX_INPUT_DELAY = 20;
+
+// The input delay is increased as soon as it is needed, but only
+// decreased every so many ticks, halfway towards what is needed, so
+// that it doesn't jump back and forth with the round trip times
+static const size_t INPUT_DELAY_DECREASE_TICKS = 20;
+
+// ENet's round trip time estimates start out at 500ms and take a number
+// of acknowledgements to settle, so they are ignored at first
+static const size_t INPUT_DELAY_WARMUP_TICKS = 40;
+
+// Maximum number of ticks, and of ticks with orders, repeated in one tick
+// packet. Clients missing more than that get the oldest ones first.
+static const size_t MAX_TICKS_PER_PACKET = 32;
+static const size_t MAX_RANGES_PER_PACKET = 8;
+
+// After this many empty ticks in a row, empty ticks are started
+// EMPTY_TICKS_AHEAD at a time. Orders that arrive in the meantime
+// are delayed until after them.
+static const size_t QUIET_TICKS = 20;
+static const size_t EMPTY_TICKS_AHEAD = 10;
+
+// Every player gets ORDER_TOKENS_PER_TICK tokens per tick, of which
+// ORDER_TOKENS_MAX can be saved up for bursts of orders
+static const size_t ORDER_TOKENS_PER_TICK = 1;
+static const size_t ORDER_TOKENS_MAX = 20;
+
+// Joining players are sent snapshots in parts of this size, with at
+// most SNAPSHOT_WINDOW bytes of reliable data in transit to them
+static const size_t SNAPSHOT_CHUNK_SIZE = 1024;
+static const size_t SNAPSHOT_WINDOW = 16 * 1024;
+
+// Snapshots received from clients that are larger than this are rejected
+static const size_t MAX_SNAPSHOT_SIZE = 16 * 1024 * 1024;
+
+// With a shadow simulation, matches are kept for this long after the
+// last player has left
+static const std::chrono::seconds EMPTY_MATCH_TIMEOUT(60);
+
+// Custom maps are sent in parts of this size, with at most MAP_WINDOW
+// bytes of reliable data in transit to every client. Since ENet has no
+// event for acknowledgements, clients waiting for room in their windows
+// are checked every MAP_POLL_INTERVAL.
+static const size_t MAP_CHUNK_SIZE = 1024;
+static const size_t MAP_WINDOW = 32 * 1024;
+static const std::chrono::milliseconds MAP_POLL_INTERVAL(10);
+
+// With a shadow simulation, clients report their state every so many
+// ticks, and the server keeps its own for the last MAX_STATE_HASHES of
+// those
+static const size_t STATE_HASH_INTERVAL = 20;
+static const size_t MAX_STATE_HASHES = 32;
+
+// Raising the map costs an extra token per so many points of the
+// rectangle, since large ones are expensive to simulate. Rectangles
+// include the points at x + w and y + h.
+static const size_t RAISE_MAP_POINTS_PER_TOKEN = 256;
+
+static size_t orderCost(const Order &order) {
+    if (order.type == Order::RAISE_MAP) {
+        size_t points = (static_cast<size_t>(order.raiseMap.w) + 1) *
+                        (static_cast<size_t>(order.raiseMap.h) + 1);
+        return 1 + points / RAISE_MAP_POINTS_PER_TOKEN;
+    }
+
+    return 1;
+}
+
+static bool rectsOverlap(const Order::RaiseMap &a, const Order::RaiseMap &b) {
+    return a.x <= b.x + b.w && b.x <= a.x + a.w &&
+           a.y <= b.y + b.h && b.y <= a.y + a.h;
+}
+
+Match::Match(size_t id, const GameSettings &settings, size_t numWaitPlayers,
+             bool shadowSim, const std::vector<uint8_t> *customMap)
+    : id(id),
+      settings(settings),
+      numWaitPlayers(numWaitPlayers),
+      shadowSim(shadowSim),
+      shadow(NULL),
+      customMap(customMap),
+      loadingMap(false),
+      gameStarted(false),
+      playerCounter(0),
+      ticksStarted(0),
+      quietTicks(0),
+      firstRecentTick(0),
+      spectatorTicksSent(0),
+      tickLength(std::chrono::milliseconds(settings.tickLengthMs)),
+      inputDelay(MIN_INPUT_DELAY),
+      inputDelayChangeTick(0),
+      lastTicksElapsed(0),
+      snapshotDonor(NULL),
+      snapshotTick(0),
+      snapshotSize(0) {
+}
+
+Match::~Match() {
+    for (auto client : clients) {
+        client->connection->data = NULL;
+        client->connection->disconnect();
+        delete client;
+    }
+
+    for (auto spectator : spectators) {
+        spectator->connection->data = NULL;
+        spectator->connection->disconnect();
+        delete spectator;
+    }
+
+    for (auto tickMessage : tickMessages)
+        delete tickMessage;
+
+    delete shadow;
+}
+
+bool Match::isOpen() const {
+    return !gameStarted && clients.size() < numWaitPlayers;
+}
+
+bool Match::isFinished(Clock::time_point now) const {
+    if (!gameStarted || !clients.empty())
+        return false;
+
+    return !canRejoin() || now >= emptyTime + EMPTY_MATCH_TIMEOUT;
+}
+
+bool Match::canRejoin() const {
+    return gameStarted && !loadingMap && (shadow || !clients.empty())
+           && clients.size() < settings.players.size();
+}
+
+bool Match::canSpectate() const {
+    return !gameStarted;
+}
+
+void Match::spectate(Connection *connection) {
+    assert(canSpectate());
+
+    ClientInfo *spectator = new ClientInfo(0, connection, this);
+    spectator->spectator = true;
+    connection->data = spectator;
+    spectators.push_back(spectator);
+
+    Message message(Message::SERVER_CONNECT);
+    message.server_connect.yourPlayerId = 0;
+    message.server_connect.matchId = static_cast<uint32_t>(id);
+    sendMessage(spectator, message);
+
+    std::cout << "Match " << id << ": spectator joined" << std::endl;
+}
+
+void Match::connect(Connection *connection) {
+    assert(isOpen() || canRejoin());
+
+    ClientInfo *client;
+    if (!gameStarted) {
+        client = new ClientInfo(++playerCounter, connection, this);
+        client->player.color = playerCounter % 4;
+        client->player.team = playerCounter;
+    } else {
+        // The seat is taken when the client says hello
+        client = new ClientInfo(0, connection, this);
+        client->joining = true;
+        client->mapSent = getMapSize();
+        client->mapReceived = getMapSize();
+
+        // The clock continues where it stopped when everyone had left
+        if (clients.empty()) {
+            Clock::duration pause = Clock::now() - emptyTime;
+            startTime += pause;
+            lastTickTime += pause;
+        }
+    }
+
+    connection->data = client;
+
+    // Without enough reliable traffic, ENet only measures the round trip
+    // time with its default ping every 500ms, and the input delay would
+    // be slow to follow it
+    connection->setPingInterval(settings.tickLengthMs);
+
+    clients.push_back(client);
+
+    if (!client->joining) {
+        std::cout << "Match " << id << ": player " << client->player.id
+                  << " joined" << std::endl;
+    }
+}
+
+void Match::receive(ClientInfo *client, ENetPacket *packet) {
+    BitStreamReader reader(packet->data, packet->dataLength);
+    reader.setOrderCodec(&client->receiveCodec);
+    reader.setOrderTraffic(&metrics.received.orders);
+
+    Clock::time_point start = Clock::now();
+    const Message *message = messagePool.decode(reader);
+
+    if (!message) {
+        // The order codec is out of sync now, so we can not
+        // continue talking to this client
+        std::cout << "Match " << id << ": malformed message from player "
+                  << client->player.id << "; disconnecting" << std::endl;
+        client->connection->disconnect();
+        return;
+    }
+
+    metrics.received.add(message->type, packet->dataLength,
+                         std::chrono::duration<double>(
+                             Clock::now() - start).count());
+    handleMessage(client, *message);
+}
+
+void Match::receive(ClientInfo *client, const Message &message) {
+    metrics.received.add(message.type, 0, 0);
+    handleMessage(client, message);
+}
+
+void Match::disconnect(ClientInfo *client) {
+    if (client->spectator) {
+        auto position = std::find(spectators.begin(), spectators.end(),
+                                  client);
+        assert(position != spectators.end());
+        spectators.erase(position);
+
+        client->connection->data = NULL;
+        delete client;
+
+        std::cout << "Match " << id << ": spectator left" << std::endl;
+        return;
+    }
+
+    std::cout << "Match " << id << ": player " << client->player.id
+              << " disconnected (" << client->ordersDropped
+              << " orders dropped, " << client->ordersCoalesced
+              << " coalesced)" << std::endl;
+
+    auto position = std::find(clients.begin(), clients.end(), client);
+    assert(position != clients.end());
+    clients.erase(position);
+
+    bool wasDonor = client == snapshotDonor;
+
+    client->connection->data = NULL;
+    delete client;
+
+    // Someone else will have to take the snapshot
+    if (wasDonor) {
+        snapshotDonor = NULL;
+        requestSnapshot();
+    }
+
+    forgetReceivedTicks();
+
+    if (clients.empty() && gameStarted) {
+        std::cout << "Match " << id << ": all players disconnected"
+                  << std::endl;
+        emptyTime = Clock::now();
+    }
+}
+
+Clock::time_point Match::update(Clock::time_point now) {
+    if (!gameStarted && clients.size() == numWaitPlayers) {
+        startGame();
+        startTime = now;
+    }
+
+    // Nothing to do until something arrives over the network, or the
+    // players that have left can no longer come back
+    if (!gameStarted)
+        return Clock::time_point::max();
+    if (clients.empty())
+        return canRejoin() ? emptyTime + EMPTY_MATCH_TIMEOUT
+                           : Clock::time_point::max();
+
+    Clock::time_point mapPollTime = Clock::time_point::max();
+    if (!sendMaps())
+        mapPollTime = now + MAP_POLL_INTERVAL;
+
+    // The clock starts once everyone is ready
+    if (loadingMap) {
+        for (auto client : clients) {
+            if (client->mapReceived < getMapSize())
+                return mapPollTime;
+        }
+
+        std::cout << "Match " << id << ": all players have the map"
+                  << std::endl;
+
+        loadingMap = false;
+        startTime = now;
+    }
+
+    updateInputDelay();
+
+    // If we fell behind, e.g. because the worker was busy, or the input
+    // delay has just been increased, the missing ticks are sent at once
+    size_t ticksElapsed = static_cast<size_t>((now - startTime) / tickLength);
+    size_t ticksDue = ticksElapsed + inputDelay;
+
+    if (ticksElapsed > lastTicksElapsed) {
+        typedef std::chrono::duration<double, std::milli> Ms;
+
+        metrics.tickLateMs.add(
+            Ms(now - startTime - ticksElapsed * tickLength).count());
+        if (lastTicksElapsed > 0)
+            metrics.tickIntervalMs.add(Ms(now - lastTickTime).count());
+
+        lastTicksElapsed = ticksElapsed;
+        lastTickTime = now;
+    }
+
+    if (ticksStarted < ticksDue) {
+        while (ticksStarted < ticksDue)
+            startTick();
+
+        if (quietTicks >= QUIET_TICKS) {
+            for (size_t i = 1; i < EMPTY_TICKS_AHEAD; i++)
+                startTick();
+        }
+    }
+
+    sendSpectatorTicks(ticksElapsed);
+    sendSnapshots();
+
+    Clock::time_point resendTime = sendTicks(now, ticksElapsed);
+    Clock::time_point nextTickTime =
+        startTime + (ticksStarted - inputDelay + 1) * tickLength;
+
+    return std::min(std::min(resendTime, nextTickTime), mapPollTime);
+}
+
+void Match::writeMetrics(std::ostream &out) {
+    out << "\"match\":" << id
+        << ",\"started\":" << (gameStarted ? "true" : "false")
+        << ",\"ticksStarted\":" << ticksStarted
+        << ",\"inputDelay\":" << inputDelay
+        << ",\"spectators\":" << spectators.size()
+        << ",\"clients\":[";
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        const ClientInfo *client = clients[i];
+        const Connection *connection = client->connection;
+
+        out << (i > 0 ? "," : "")
+            << "{\"player\":" << client->player.id
+            << ",\"name\":";
+        writeJson(out, client->player.name);
+        out << ",\"joining\":" << (client->joining ? "true" : "false")
+            << ",\"lag\":" << ticksStarted - client->ticksDone
+            << ",\"maxLag\":" << client->maxLag
+            << ",\"rttMs\":" << connection->getRoundTripTime()
+            << ",\"rttVarianceMs\":" << connection->getRoundTripTimeVariance()
+            << ",\"packetLoss\":" << connection->getPacketLoss()
+            << ",\"reliableInTransit\":"
+            << connection->getReliableDataInTransit();
+
+        if (customMap)
+            out << ",\"mapReceived\":" << client->mapReceived;
+
+        out << "}";
+    }
+
+    out << "],";
+    metrics.write(out);
+
+    metrics.reset();
+    for (auto client : clients)
+        client->maxLag = ticksStarted - client->ticksDone;
+}
+
+void Match::sendMessage(ClientInfo *client, const Message &message) {
+    assert(client && client->connection);
+
+    // Ticks are sent by sendTicks
+    assert(message.type != Message::SERVER_TICK);
+
+    OutgoingMessage outgoing(message, CHANNEL_RELIABLE);
+    metrics.sent.add(outgoing, client->connection->send(outgoing));
+}
+
+void Match::broadcast(const Message &message) {
+    assert(message.type != Message::SERVER_TICK);
+
+    // The packet is shared between all peers
+    OutgoingMessage outgoing(message, CHANNEL_RELIABLE);
+
+    for (auto client : clients)
+        metrics.sent.add(outgoing, client->connection->send(outgoing));
+    for (auto spectator : spectators)
+        metrics.sent.add(outgoing, spectator->connection->send(outgoing));
+}
+
+void Match::sendLateStart(ClientInfo *client) {
+    Message message(Message::SERVER_START);
+    message.server_start.settings = settings;
+    message.server_start.lateJoin = 1;
+    message.server_start.stateHashInterval =
+        shadow ? STATE_HASH_INTERVAL : 0;
+    message.server_start.mapSize = 0;
+    sendMessage(client, message);
+}
+
+void Match::startTick() {
+    assert(gameStarted);
+
+    if (shadow) {
+        typedef std::chrono::duration<double, std::milli> Ms;
+        Clock::time_point start = Clock::now();
+
+        metrics.ordersInvalid += shadow->runTickRemovingInvalid(nextOrders);
+
+        if ((ticksStarted + 1) % STATE_HASH_INTERVAL == 0) {
+            stateHashes.push_back(std::make_pair(ticksStarted + 1,
+                                                 shadow->hashState()));
+            if (stateHashes.size() > MAX_STATE_HASHES)
+                stateHashes.pop_front();
+        }
+
+        metrics.shadowTickMs.add(Ms(Clock::now() - start).count());
+    }
+
+    if (nextOrders.empty())
+        quietTicks++;
+    else
+        quietTicks = 0;
+
+    metrics.ticksStarted++;
+    metrics.ordersPerTick.add(nextOrders.size());
+
+    recentTicks.push_back(std::vector<Order>());
+    recentTicks.back().swap(nextOrders);
+    ticksStarted++;
+
+    for (auto client : clients) {
+        client->maxLag = std::max(client->maxLag,
+                                  ticksStarted - client->ticksDone);
+
+        client->orderTokens = std::min(client->orderTokens + ORDER_TOKENS_PER_TICK,
+                                       ORDER_TOKENS_MAX);
+
+        if (client->orderTokens == ORDER_TOKENS_MAX)
+            client->overBudget = false;
+    }
+}
+
+bool Match::sendMaps() {
+    if (!customMap)
+        return true;
+
+    bool done = true;
+
+    // Clients that are equally far along share the packets
+    struct MapPacket {
+        size_t offset;
+        Message message;
+        OutgoingMessage *outgoing;
+
+        MapPacket()
+            : message(Message::SERVER_MAP), outgoing(NULL) {
+        }
+
+        ~MapPacket() {
+            delete outgoing;
+        }
+    };
+    std::deque<MapPacket> packets;
+
+    auto send = [&](ClientInfo *client) {
+        auto sendChunk = [&](size_t offset, size_t size) {
+            MapPacket *packet = NULL;
+            for (auto &entry : packets) {
+                if (entry.offset == offset)
+                    packet = &entry;
+            }
+
+            if (!packet) {
+                packets.emplace_back();
+                packet = &packets.back();
+                packet->offset = offset;
+
+                Message::MapChunk &chunk(packet->message.server_map);
+                chunk.size = static_cast<uint32_t>(customMap->size());
+                chunk.offset = static_cast<uint32_t>(offset);
+                chunk.data.assign(customMap->begin() + offset,
+                                  customMap->begin() + offset + size);
+
+                packet->outgoing = new OutgoingMessage(packet->message,
+                                                       CHANNEL_MAP);
+            }
+
+            metrics.sent.add(*packet->outgoing,
+                             client->connection->send(*packet->outgoing));
+            return size;
+        };
+
+        if (!sendWindowed(client->connection->getReliableDataInTransit(),
+                          client->mapSent, customMap->size(),
+                          MAP_CHUNK_SIZE, MAP_WINDOW, sendChunk))
+            done = false;
+    };
+
+    for (auto client : clients)
+        send(client);
+    for (auto spectator : spectators)
+        send(spectator);
+
+    return done;
+}
+
+void Match::receiveMapAck(ClientInfo *client,
+                          const Message::ClientMapAck &ack) {
+    if (ack.received > client->mapSent) {
+        std::cout << "Match " << id << ": player " << client->player.id
+                  << " acknowledged map data which has not been sent"
+                  << std::endl;
+        return;
+    }
+
+    if (ack.received <= client->mapReceived)
+        return;
+
+    client->mapReceived = ack.received;
+
+    if (client->mapReceived == getMapSize()) {
+        typedef std::chrono::duration<double, std::milli> Ms;
+
+        std::cout << "Match " << id << ": player " << client->player.id
+                  << " has the map after "
+                  << Ms(Clock::now() - mapStartTime).count() << "ms"
+                  << std::endl;
+    }
+}
+
+Clock::time_point Match::sendTicks(Clock::time_point now,
+                                   size_t ticksElapsed) {
+    Clock::time_point nextResendTime = Clock::time_point::max();
+
+    // Messages for the clients, by the first tick they are missing
+    std::vector<std::pair<size_t, OutgoingMessage *>> messages;
+
+    for (auto client : clients) {
+        if (client->joining)
+            continue;
+
+        size_t firstTick = client->ticksReceived;
+        assert(firstTick >= firstRecentTick);
+
+        if (firstTick == ticksStarted)
+            continue;
+
+        if (client->ticksSent == ticksStarted && now < client->resendTime) {
+            nextResendTime = std::min(nextResendTime, client->resendTime);
+            continue;
+        }
+
+        OutgoingMessage *message = NULL;
+        for (auto &entry : messages) {
+            if (entry.first == firstTick)
+                message = entry.second;
+        }
+
+        if (!message) {
+            size_t i = messages.size();
+            fillTickMessage(i, firstTick, ticksElapsed);
+
+            message = new OutgoingMessage(tickMessages[i]->message,
+                                          CHANNEL_TICKS,
+                                          &tickMessages[i]->codec);
+            messages.push_back(std::make_pair(firstTick, message));
+        }
+
+        Connection *connection = client->connection;
+        metrics.sent.add(*message, connection->send(*message));
+
+        // Similar to ENet's retransmission timeout
+        std::chrono::milliseconds timeout(
+            connection->getRoundTripTime()
+            + 4 * connection->getRoundTripTimeVariance());
+        client->ticksSent = ticksStarted;
+        client->resendTime = now + std::max<Clock::duration>(timeout,
+                                                             tickLength);
+        nextResendTime = std::min(nextResendTime, client->resendTime);
+    }
+
+    for (auto &entry : messages)
+        delete entry.second;
+
+    return nextResendTime;
+}
+
+size_t Match::fillTickMessage(size_t i, size_t firstTick,
+                              size_t ticksElapsed) {
+    assert(firstTick >= firstRecentTick && firstTick < ticksStarted);
+
+    while (tickMessages.size() <= i)
+        tickMessages.push_back(new TickMessage);
+
+    tickMessages[i]->codec.reset();
+
+    Message::ServerTick &tick(tickMessages[i]->message.server_tick);
+    tick.firstTick = static_cast<uint32_t>(firstTick);
+    tick.ticksAhead = static_cast<uint8_t>(ticksStarted - ticksElapsed);
+    tick.ranges.clear();
+
+    // Empty ticks are appended to the range of the previous tick
+    size_t t = firstTick;
+    for (; t < ticksStarted && t - firstTick < MAX_TICKS_PER_PACKET; t++) {
+        const std::vector<Order> &orders(recentTicks[t - firstRecentTick]);
+
+        if (!tick.ranges.empty() && orders.empty()) {
+            tick.ranges.back().numTicks++;
+            continue;
+        }
+
+        if (tick.ranges.size() == MAX_RANGES_PER_PACKET)
+            break;
+
+        tick.ranges.push_back(Message::TickRange());
+        tick.ranges.back().numTicks = 1;
+        tick.ranges.back().orders = orders;
+    }
+
+    return t - firstTick;
+}
+
+void Match::sendSpectatorTicks(size_t ticksElapsed) {
+    // Reliable packets, so every tick only needs to be sent once
+    while (spectatorTicksSent < ticksStarted) {
+        size_t numTicks = fillTickMessage(0, spectatorTicksSent,
+                                          ticksElapsed);
+        spectatorTicksSent += numTicks;
+
+        if (spectators.empty())
+            continue;
+
+        OutgoingMessage message(tickMessages[0]->message, CHANNEL_RELIABLE,
+                                &tickMessages[0]->codec);
+
+        for (auto spectator : spectators)
+            metrics.sent.add(message, spectator->connection->send(message));
+    }
+}
+
+void Match::forgetReceivedTicks() {
+    // Joining clients need the ticks after their snapshot, once they
+    // have a seat
+    size_t minTicksReceived = ticksStarted;
+    for (auto client : clients) {
+        if (client->player.id != 0)
+            minTicksReceived = std::min(minTicksReceived, client->ticksReceived);
+    }
+    if (snapshotDonor)
+        minTicksReceived = std::min(minTicksReceived, snapshotTick);
+    minTicksReceived = std::min(minTicksReceived, spectatorTicksSent);
+
+    while (firstRecentTick < minTicksReceived) {
+        recentTicks.pop_front();
+        firstRecentTick++;
+    }
+}
+
+void Match::updateInputDelay() {
+    if (ticksStarted < INPUT_DELAY_WARMUP_TICKS)
+        return;
+
+    // Ticks need to reach every client before they are due to be run,
+    // with some room for the variance of the round trip time
+    enet_uint32 maxDelayMs = 0;
+    for (auto client : clients) {
+        const Connection *connection = client->connection;
+        maxDelayMs = std::max(maxDelayMs, connection->getRoundTripTime()
+                              + 2 * connection->getRoundTripTimeVariance());
+    }
+
+    // One more tick for the one that is currently being run
+    size_t wanted = (maxDelayMs + settings.tickLengthMs - 1)
+                    / settings.tickLengthMs + 1;
+    wanted = std::min(std::max(wanted, MIN_INPUT_DELAY), MAX_INPUT_DELAY);
+
+    if (wanted > inputDelay) {
+        inputDelay = wanted;
+    } else if (wanted < inputDelay
+               && ticksStarted >= inputDelayChangeTick
+                                  + INPUT_DELAY_DECREASE_TICKS) {
+        inputDelay -= (inputDelay - wanted + 1) / 2;
+    } else {
+        return;
+    }
+
+    inputDelayChangeTick = ticksStarted;
+
+    std::cout << "Match " << id << ": input delay is now " << inputDelay
+              << " ticks (" << maxDelayMs << "ms)" << std::endl;
+}
+
+void Match::startGame() {
+    std::cout << "Match " << id << ": all players connected; starting game"
+              << std::endl;
+
+    assert(!gameStarted);
+
+    // Store player infos in the GameSettings, 
+    // and then broadcast it to the clients
+    assert(settings.players.empty());
+    for (auto client : clients)
+        settings.players.push_back(client->player);
+
+    if (shadowSim && customMap) {
+        CustomMap map;
+        BitStreamReader reader(*customMap);
+        read(reader, map);
+        assert(!reader.hasFailed());
+
+        shadow = new Sim(settings, &map);
+    } else if (shadowSim) {
+        shadow = new Sim(settings);
+    }
+
+    Message message(Message::SERVER_START);
+    message.server_start.settings = settings;
+    message.server_start.lateJoin = 0;
+    message.server_start.stateHashInterval =
+        shadow ? STATE_HASH_INTERVAL : 0;
+    message.server_start.mapSize = static_cast<uint32_t>(getMapSize());
+    broadcast(message);
+
+    if (customMap) {
+        std::cout << "Match " << id << ": sending map (" << getMapSize()
+                  << " bytes)" << std::endl;
+
+        loadingMap = true;
+        mapStartTime = Clock::now();
+    }
+
+    gameStarted = true;
+}
+
+bool Match::isRedundantOrder(const Order &order) const {
+    // Only repetitions of the last order touching the same state are
+    // dropped, since anything in between could make them count again
+    switch (order.type) {
+    case Order::CONSTRUCT:
+        // Constructing without queueing replaces the building's queue, so
+        // doing it twice is the same as once. Queued constructions each
+        // add an entry to the queue, i.e. they are requests for more.
+        if (order.construct.queue)
+            return false;
+
+        for (auto it = nextOrders.rbegin(); it != nextOrders.rend(); ++it) {
+            if (it->type == Order::BUILD &&
+                it->build.objectId == order.construct.from)
+                return false;
+
+            if (it->type == Order::CONSTRUCT &&
+                it->construct.from == order.construct.from) {
+                return it->player == order.player &&
+                       it->construct.to == order.construct.to &&
+                       !it->construct.queue;
+            }
+        }
+        return false;
+
+    case Order::RAISE_MAP:
+        // Map::raise sets growth targets relative to the heights at the
+        // start of the tick, so the same rectangle raises nothing twice.
+        // Overlapping rectangles reach different heights and are kept.
+        for (auto it = nextOrders.rbegin(); it != nextOrders.rend(); ++it) {
+            if (it->type != Order::RAISE_MAP ||
+                !rectsOverlap(it->raiseMap, order.raiseMap))
+                continue;
+
+            return it->raiseMap.x == order.raiseMap.x &&
+                   it->raiseMap.y == order.raiseMap.y &&
+                   it->raiseMap.w == order.raiseMap.w &&
+                   it->raiseMap.h == order.raiseMap.h;
+        }
+        return false;
+
+    default:
+        return false;
+    }
+}
+
+bool Match::takeSeat(ClientInfo *client, const std::string &name) {
+    assert(client->joining && client->player.id == 0);
+
+    const PlayerInfo *seat = NULL;
+    for (auto &player : settings.players) {
+        bool taken = false;
+        for (auto other : clients)
+            taken = taken || other->player.id == player.id;
+
+        if (!taken && (!seat || player.name == name))
+            seat = &player;
+    }
+
+    if (!seat)
+        return false;
+
+    client->player = *seat;
+
+    std::cout << "Match " << id << ": " << name << " joined as player "
+              << seat->id << " (" << seat->name << ")" << std::endl;
+    return true;
+}
+
+bool Match::isSnapshotComplete() const {
+    return !snapshotDonor && snapshotSize > 0
+           && snapshot.size() == snapshotSize;
+}
+
+void Match::requestSnapshot() {
+    bool waiting = false;
+    for (auto client : clients)
+        waiting = waiting || (client->joining && client->player.id != 0);
+
+    if (!waiting)
+        return;
+
+    if (shadow) {
+        takeShadowSnapshot();
+        return;
+    }
+
+    // Join in on the snapshot that is on its way
+    if (snapshotDonor) {
+        for (auto client : clients) {
+            if (client->joining && client->player.id != 0)
+                client->ticksReceived = snapshotTick;
+        }
+        return;
+    }
+
+    // The snapshot we have will do as long as the ticks after it are
+    // still around
+    if (isSnapshotComplete() && snapshotTick >= firstRecentTick) {
+        for (auto client : clients) {
+            if (client->joining && client->player.id != 0)
+                client->ticksReceived = snapshotTick;
+        }
+        return;
+    }
+
+    // Ask the client that is furthest ahead, so that it doesn't take long
+    ClientInfo *donor = NULL;
+    for (auto client : clients) {
+        if (!client->joining && (!donor || client->ticksDone > donor->ticksDone))
+            donor = client;
+    }
+
+    if (!donor) {
+        std::cout << "Match " << id << ": no one left to take a snapshot"
+                  << std::endl;
+
+        for (auto client : clients)
+            client->connection->disconnect();
+        return;
+    }
+
+    // The donor has received at least firstRecentTick ticks, so it can
+    // take the snapshot once it has run them, and the ticks after the
+    // snapshot are kept around for the joining clients
+    snapshotDonor = donor;
+    snapshotTick = std::max(donor->ticksDone, firstRecentTick);
+    snapshotSize = 0;
+    snapshot.clear();
+
+    for (auto client : clients) {
+        if (client->joining && client->player.id != 0) {
+            client->ticksReceived = snapshotTick;
+            client->snapshotSent = 0;
+        }
+    }
+
+    std::cout << "Match " << id << ": requesting snapshot of tick "
+              << snapshotTick << " from player " << donor->player.id
+              << std::endl;
+
+    Message message(Message::SERVER_SNAPSHOT_REQUEST);
+    message.server_snapshot_request.minTick =
+        static_cast<uint32_t>(snapshotTick);
+    sendMessage(donor, message);
+}
+
+void Match::takeShadowSnapshot() {
+    assert(shadow && !snapshotDonor);
+
+    // Only a snapshot of the latest tick will do: clients whose state
+    // differs from the server's can still have acks and ticks before it
+    // on their way
+    if (isSnapshotComplete() && snapshotTick == ticksStarted) {
+        for (auto client : clients) {
+            if (client->joining && client->player.id != 0)
+                client->ticksReceived = snapshotTick;
+        }
+        return;
+    }
+
+    BitStreamWriter writer;
+    shadow->writeSnapshot(writer);
+
+    snapshotTick = ticksStarted;
+    snapshotSize = writer.size();
+    snapshot.assign(writer.ptr(), writer.ptr() + writer.size());
+
+    // Clients in the middle of receiving an older snapshot start over
+    for (auto client : clients) {
+        if (client->joining && client->player.id != 0) {
+            client->ticksReceived = snapshotTick;
+            client->snapshotSent = 0;
+        }
+    }
+
+    std::cout << "Match " << id << ": took snapshot of tick "
+              << snapshotTick << " (" << snapshotSize << " bytes)"
+              << std::endl;
+}
+
+void Match::receiveSnapshot(ClientInfo *client,
+                            const Message::SnapshotChunk &chunk) {
+    if (client != snapshotDonor) {
+        std::cout << "Match " << id << ": ignoring snapshot from player "
+                  << client->player.id << std::endl;
+        return;
+    }
+
+    if (chunk.offset == 0) {
+        if (chunk.tick < snapshotTick
+            || chunk.tick > ticksStarted
+            || chunk.size == 0
+            || chunk.size > MAX_SNAPSHOT_SIZE) {
+            std::cout << "Match " << id << ": invalid snapshot from player "
+                      << client->player.id << "; disconnecting" << std::endl;
+            client->connection->disconnect();
+            return;
+        }
+
+        // Joining clients continue with the ticks after the snapshot
+        snapshotTick = chunk.tick;
+        snapshotSize = chunk.size;
+        for (auto other : clients) {
+            if (other->joining && other->player.id != 0)
+                other->ticksReceived = snapshotTick;
+        }
+    }
+
+    if (chunk.tick != snapshotTick
+        || chunk.size != snapshotSize
+        || chunk.offset != snapshot.size()
+        || chunk.data.size() > snapshotSize - snapshot.size()) {
+        std::cout << "Match " << id << ": invalid snapshot part from player "
+                  << client->player.id << "; disconnecting" << std::endl;
+        client->connection->disconnect();
+        return;
+    }
+
+    snapshot.insert(snapshot.end(), chunk.data.begin(), chunk.data.end());
+
+    if (snapshot.size() == snapshotSize) {
+        std::cout << "Match " << id << ": received snapshot of tick "
+                  << snapshotTick << " (" << snapshotSize << " bytes)"
+                  << std::endl;
+        snapshotDonor = NULL;
+    }
+
+    forgetReceivedTicks();
+}
+
+void Match::sendSnapshots() {
+    if (!isSnapshotComplete())
+        return;
+
+    for (auto client : clients) {
+        if (!client->joining || client->player.id == 0)
+            continue;
+
+        auto sendChunk = [&](size_t offset, size_t size) {
+            Message message(Message::SERVER_SNAPSHOT);
+            Message::SnapshotChunk &chunk(message.server_snapshot);
+            chunk.tick = static_cast<uint32_t>(snapshotTick);
+            chunk.size = static_cast<uint32_t>(snapshotSize);
+            chunk.offset = static_cast<uint32_t>(offset);
+            chunk.data.assign(snapshot.begin() + offset,
+                              snapshot.begin() + offset + size);
+            sendMessage(client, message);
+            return size;
+        };
+
+        sendWindowed(client->connection->getReliableDataInTransit(),
+                     client->snapshotSent, snapshotSize,
+                     SNAPSHOT_CHUNK_SIZE, SNAPSHOT_WINDOW, sendChunk);
+
+        if (client->snapshotSent == snapshotSize) {
+            std::cout << "Match " << id << ": player " << client->player.id
+                      << " continues after tick " << snapshotTick
+                      << std::endl;
+
+            client->joining = false;
+            client->ticksDone = snapshotTick;
+            client->ticksReceived = snapshotTick;
+            client->minHashTick = snapshotTick + 1;
+        }
+    }
+}
+
+void Match::checkStateHash(ClientInfo *client,
+                           const Message::ClientStateHash &stateHash) {
+    if (!shadow || stateHash.tick < client->minHashTick)
+        return;
+
+    // Hashes that are too old to compare are ignored
+    auto entry = std::find_if(stateHashes.begin(), stateHashes.end(),
+        [&](const std::pair<size_t, uint32_t> &entry) {
+            return entry.first == stateHash.tick;
+        });
+    if (entry == stateHashes.end() || entry->second == stateHash.hash)
+        return;
+
+    std::cout << "Match " << id << ": state of player " << client->player.id
+              << " differs after tick " << stateHash.tick
+              << "; sending it ours" << std::endl;
+    metrics.desyncs++;
+
+    client->joining = true;
+    client->snapshotSent = 0;
+
+    sendLateStart(client);
+    requestSnapshot();
+}
+
+void Match::handleMessage(ClientInfo *client, const Message &message) {
+    // Spectators only listen
+    if (client->spectator)
+        return;
+
+    // Joining clients only get to say hello
+    if (client->joining && message.type != Message::CLIENT_CONNECT)
+        return;
+
+    switch (message.type) {
+    case Message::CLIENT_CONNECT: {
+        if (!client->joining)
+            client->player.name = message.client_connect.name;
+        else if (client->player.id != 0)
+            return;
+        else if (!takeSeat(client, message.client_connect.name)) {
+            std::cout << "Match " << id << ": no seat left for "
+                      << message.client_connect.name << std::endl;
+            client->connection->disconnect();
+            return;
+        }
+
+        Message message(Message::SERVER_CONNECT);
+        message.server_connect.yourPlayerId = client->player.id;
+        message.server_connect.matchId = static_cast<uint32_t>(id);
+        sendMessage(client, message);
+
+        if (client->joining) {
+            sendLateStart(client);
+            requestSnapshot();
+        }
+        return;
+    }
+    case Message::CLIENT_ORDER: {
+        if (!gameStarted) {
+            std::cout << "Match " << id << ": ignoring order from player "
+                      << client->player.id << std::endl;
+            return;
+        }
+
+        Order order(message.client_order.order);
+        order.player = client->player.id;
+
+        if (isRedundantOrder(order)) {
+            client->ordersCoalesced++;
+            metrics.ordersCoalesced++;
+            return;
+        }
+
+        size_t cost = orderCost(order);
+        if (cost > client->orderTokens) {
+            if (!client->overBudget) {
+                std::cout << "Match " << id << ": player " << client->player.id
+                          << " is over its order budget" << std::endl;
+                client->overBudget = true;
+            }
+
+            client->ordersDropped++;
+            metrics.ordersDropped++;
+            return;
+        }
+
+        client->orderTokens -= cost;
+        nextOrders.push_back(order);
+
+        return;
+    }
+    case Message::CLIENT_SNAPSHOT:
+        receiveSnapshot(client, message.client_snapshot);
+        return;
+
+    case Message::CLIENT_STATE_HASH:
+        checkStateHash(client, message.client_state_hash);
+        return;
+
+    case Message::CLIENT_MAP_ACK:
+        receiveMapAck(client, message.client_map_ack);
+        return;
+
+    case Message::CLIENT_TIME_REQUEST: {
+        // The clock only starts once the map has been loaded
+        if (!gameStarted || loadingMap)
+            return;
+
+        Message answer(Message::SERVER_TIME);
+        answer.server_time.clientTime = message.client_time_request.clientTime;
+        answer.server_time.serverTime = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - startTime).count());
+
+        // Answers that arrive late are useless, so they are not resent
+        OutgoingMessage outgoing(answer, CHANNEL_TICKS);
+        metrics.sent.add(outgoing, client->connection->send(outgoing));
+        return;
+    }
+
+    case Message::CLIENT_TICK_ACK: {
+        size_t ticksReceived = message.client_tick_ack.ticksReceived;
+        size_t ticksDone = message.client_tick_ack.ticksDone;
+
+        if (ticksReceived > ticksStarted || ticksDone > ticksReceived) {
+            std::cout << "Match " << id << ": player " << client->player.id
+                      << " acknowledged tick " << ticksReceived
+                      << " (done " << ticksDone << ") which has not been sent"
+                      << std::endl;
+            return;
+        }
+
+        // Acks are unsequenced, so older ones can arrive late
+        client->ticksDone = std::max(client->ticksDone, ticksDone);
+
+        if (ticksReceived > client->ticksReceived) {
+            client->ticksReceived = ticksReceived;
+            forgetReceivedTicks();
+        }
+        return;
+    }
+
+    default:
+        return;
+    }
+}
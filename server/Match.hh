@@ -0,0 +1,309 @@
+#ifndef STRAT_SERVER_MATCH_HH
+#define STRAT_SERVER_MATCH_HH
+
+#include "common/Message.hh"
+#include "common/GameSettings.hh"
+#include "common/OrderCodec.hh"
+#include "common/Connection.hh"
+#include "common/CustomMap.hh"
+#include "game/Sim.hh"
+#include "Metrics.hh"
+
+#include <enet/enet.h>
+
+#include <chrono>
+#include <deque>
+#include <utility>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Match;
+
+struct ClientInfo {
+    Connection *connection;
+    Match *match;
+
+    // Ticks the client has reported to have completed. Reported along
+    // with ticksReceived, but not as often.
+    size_t ticksDone;
+
+    // Ticks acknowledged by the client as received
+    size_t ticksReceived;
+
+    // Value of Match::ticksStarted when we last sent ticks to the client,
+    // and when to send them again if they are not acknowledged by then
+    size_t ticksSent;
+    Clock::time_point resendTime;
+
+    PlayerInfo player;
+
+    // Order budget of the player, refilled every tick. Orders sent while
+    // the budget is used up are dropped. Going over the budget is logged
+    // once until it has been filled up again.
+    size_t orderTokens;
+    bool overBudget;
+
+    size_t ordersDropped;
+    size_t ordersCoalesced;
+
+    // Highest ticksStarted - ticksDone since the last metrics snapshot
+    size_t maxLag;
+
+    // Set for players joining the running game until they have been sent
+    // the whole snapshot of it. They are not sent ticks before that.
+    // Their seat is only known once they have said hello.
+    bool joining;
+    size_t snapshotSent;
+
+    // State hashes for earlier ticks can still be on their way after the
+    // client has been sent the server's state, and are ignored
+    size_t minHashTick;
+
+    // Bytes of the custom map sent, and acknowledged by players. Late
+    // joiners get the map with their snapshot instead.
+    size_t mapSent;
+    size_t mapReceived;
+
+    // Spectators are sent the ticks reliably as they are started, but
+    // are otherwise ignored
+    bool spectator;
+
+    // Delta compression state of the orders received from this client
+    OrderCodec receiveCodec;
+
+    ClientInfo(PlayerId id, Connection *connection, Match *match)
+        : connection(connection), match(match), ticksDone(0), ticksReceived(0), ticksSent(0),
+          player(), orderTokens(0), overBudget(false), ordersDropped(0),
+          ordersCoalesced(0), maxLag(0), joining(false), snapshotSent(0),
+          minHashTick(0), mapSent(0), mapReceived(0), spectator(false) {
+        player.id = id;
+    }
+};
+
+// One lockstep game with its own set of clients.
+//
+// A match waits for a number of players to connect, then starts the game
+// and runs ticks until all players have left. Matches are not thread-safe;
+// each one belongs to the worker thread owning the connections of its
+// clients.
+//
+// Ticks are started by the wall clock, inputDelay ticks ahead of the time
+// at which clients are meant to run them, so that they arrive in time.
+// An order received during tick N is thus run at tick N + inputDelay.
+// The input delay follows the round trip times of the clients. Clients
+// that fall behind do not hold up the match, but have to catch up.
+//
+// Tick packets are only sent when new ticks have been started or old
+// ones need to be resent. When no orders have come in for a while,
+// runs of empty ticks are started ahead of time and sent as one range.
+//
+// Every player has a token bucket limiting the orders it can send per
+// tick. Orders that would have no effect after the orders already in
+// the next tick are dropped without costing anything.
+//
+// Players that have left can be replaced while the game is running, e.g.
+// by the same player reconnecting. The joining player is sent a snapshot
+// of the game state, followed by the ticks after it. Unless the server
+// runs the game itself, it asks one of the remaining players for the
+// snapshot. If the server runs the game, the match is also kept for a
+// while after the last player has left, with the clock stopped, so that
+// they can come back.
+//
+// With a shadow simulation, the server runs every tick as it is started.
+// Orders that turn out to be invalid are removed before the tick is sent,
+// and the clients report a hash of their state every stateHashInterval
+// ticks. Clients whose state differs from the server's are sent the
+// server's state like a joining player.
+//
+// With a custom map, the map is sent to the clients after SERVER_START,
+// in parts on a channel of its own, with a limited amount of data in
+// transit to every client. The first tick is only due once every player
+// has received all of it, so that everyone starts at the same time.
+//
+// Spectators can only watch a match from its start. They never hold up
+// the match; watching running matches or with a delay is left to relays,
+// which act as a spectator here and keep the whole match for their own
+// spectators.
+struct Match {
+    // The encoded custom map, if any, must stay around while the match
+    // exists. The settings have its size then.
+    Match(size_t id, const GameSettings &settings, size_t numWaitPlayers,
+          bool shadowSim = false,
+          const std::vector<uint8_t> *customMap = NULL);
+    ~Match();
+
+    size_t getId() const { return id; }
+
+    // Whether new players can still join
+    bool isOpen() const;
+
+    // Whether all players have left after the game had started, and can
+    // not come back anymore
+    bool isFinished(Clock::time_point now) const;
+
+    // Whether the game is running and a player has left, whose seat can
+    // be taken by a new connection. Without a shadow simulation, there
+    // has to be a player left to take the snapshot for the new one, so
+    // once the last player has left, the match is finished.
+    bool canRejoin() const;
+
+    // Whether the game has not started yet, so spectators get all of it
+    bool canSpectate() const;
+
+    // Sets itself as the ClientInfo of the connection's data
+    void connect(Connection *);
+    void spectate(Connection *);
+
+    void receive(ClientInfo *, ENetPacket *);
+    void receive(ClientInfo *, const Message &);
+    void disconnect(ClientInfo *);
+
+    // Starts the game or the next tick if they are due. Returns the time
+    // at which update should be called next, unless network events
+    // arrive earlier.
+    Clock::time_point update(Clock::time_point now);
+
+    // Writes the members of a JSON object describing the state of the
+    // match and its clients, and starts counting anew
+    void writeMetrics(std::ostream &);
+
+private:
+    size_t id;
+
+    GameSettings settings;
+    size_t numWaitPlayers;
+
+    // The server's own simulation of the game, if enabled, with the
+    // hashes of its state after the most recent multiples of
+    // STATE_HASH_INTERVAL ticks
+    bool shadowSim;
+    Sim *shadow;
+    std::deque<std::pair<size_t, uint32_t>> stateHashes;
+
+    // Encoded custom map, or NULL. While the players are loading it, the
+    // game has started, but the ticks have not.
+    const std::vector<uint8_t> *customMap;
+    bool loadingMap;
+    Clock::time_point mapStartTime;
+
+    bool gameStarted;
+
+    // When the last player left the running game, if no one is there
+    Clock::time_point emptyTime;
+
+    PlayerId playerCounter;
+    std::vector<ClientInfo *> clients;
+    std::vector<ClientInfo *> spectators;
+
+    size_t ticksStarted;
+    std::vector<Order> nextOrders;
+
+    // Number of empty ticks started in a row
+    size_t quietTicks;
+
+    // Orders of the ticks that have not been received by every client
+    // yet, starting with tick number firstRecentTick
+    std::deque<std::vector<Order>> recentTicks;
+    size_t firstRecentTick;
+
+    // Number of ticks sent to the spectators
+    size_t spectatorTicksSent;
+
+    Clock::duration tickLength;
+    Clock::time_point startTime;
+
+    size_t inputDelay;
+    size_t inputDelayChangeTick;
+
+    MatchMetrics metrics;
+
+    // When ticksElapsed last increased, for the tick timing metrics
+    size_t lastTicksElapsed;
+    Clock::time_point lastTickTime;
+
+    MessagePool messagePool;
+
+    // Snapshot of the game state for joining players. While snapshotDonor
+    // is set, it has been requested from that client, to be taken after
+    // at least snapshotTick ticks. With a shadow simulation, it is taken
+    // from there instead.
+    ClientInfo *snapshotDonor;
+    size_t snapshotTick;
+    size_t snapshotSize;
+    std::vector<uint8_t> snapshot;
+
+    // Tick packets can be lost or reordered, so every one is delta
+    // compressed on its own, starting with a fresh codec. Several of them
+    // can be on their way to different clients at once; they are reused
+    // for building the next ones.
+    struct TickMessage {
+        Message message;
+        OrderCodec codec;
+
+        TickMessage()
+            : message(Message::SERVER_TICK) {
+        }
+    };
+    std::vector<TickMessage *> tickMessages;
+
+    void sendMessage(ClientInfo *, const Message &);
+    void broadcast(const Message &);
+
+    // Sends SERVER_START to a player joining the running game
+    void sendLateStart(ClientInfo *);
+
+    void startGame();
+    void startTick();
+
+    size_t getMapSize() const {
+        return customMap ? customMap->size() : 0;
+    }
+
+    // Sends the clients and spectators the next parts of the custom map,
+    // as far as ENet's reliable data in transit allows. Returns false if
+    // some of them are waiting for room in their windows.
+    bool sendMaps();
+    void receiveMapAck(ClientInfo *, const Message::ClientMapAck &);
+
+    // Sends every client the ticks it has not acknowledged yet, if there
+    // are new ones or it is time to resend them. Clients that are missing
+    // the same ticks share one packet. Returns the next time at which
+    // ticks need to be resent.
+    Clock::time_point sendTicks(Clock::time_point now, size_t ticksElapsed);
+    void sendSpectatorTicks(size_t ticksElapsed);
+    void forgetReceivedTicks();
+
+    // Puts recent ticks starting at firstTick into tickMessages[i], up to
+    // the packet limits, and resets its codec. Returns the number of ticks
+    // included.
+    size_t fillTickMessage(size_t i, size_t firstTick, size_t ticksElapsed);
+
+    void updateInputDelay();
+
+    // Gives the client the seat of a player that has left, preferably
+    // one with the same name. Returns false if there is none.
+    bool takeSeat(ClientInfo *, const std::string &name);
+
+    // Makes sure that a snapshot for the joining clients is available
+    // or on its way
+    void requestSnapshot();
+    void takeShadowSnapshot();
+    void receiveSnapshot(ClientInfo *, const Message::SnapshotChunk &);
+    bool isSnapshotComplete() const;
+
+    // Sends the joining clients the next parts of the snapshot, as far
+    // as ENet's reliable data in transit allows
+    void sendSnapshots();
+
+    // Whether the order would change nothing when run after nextOrders
+    bool isRedundantOrder(const Order &) const;
+
+    // Compares the client's state after the given tick with the shadow's,
+    // and sends it the shadow's state if they differ
+    void checkStateHash(ClientInfo *, const Message::ClientStateHash &);
+
+    void handleMessage(ClientInfo *, const Message &);
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include "Metrics.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+
+void Stats::add(double value) {
+    min = count == 0 ? value : std::min(min, value);
+    max = count == 0 ? value : std::max(max, value);
+
+    count++;
+    sum += value;
+    sumSquares += value * value;
+}
+
+void Stats::reset() {
+    count = 0;
+    sum = 0;
+    sumSquares = 0;
+    min = 0;
+    max = 0;
+}
+
+double Stats::mean() const {
+    return count > 0 ? sum / count : 0;
+}
+
+double Stats::stddev() const {
+    if (count == 0)
+        return 0;
+
+    double m = mean();
+    return std::sqrt(std::max(sumSquares / count - m * m, 0.0));
+}
+
+void MatchMetrics::reset() {
+    tickLateMs.reset();
+    tickIntervalMs.reset();
+
+    ticksStarted = 0;
+    ordersPerTick.reset();
+    ordersDropped = 0;
+    ordersCoalesced = 0;
+
+    ordersInvalid = 0;
+    desyncs = 0;
+    shadowTickMs.reset();
+
+    sent.reset();
+    received.reset();
+}
+
+void MatchMetrics::write(std::ostream &out) const {
+    out << "\"tickLateMs\":";
+    writeJson(out, tickLateMs);
+    out << ",\"tickIntervalMs\":";
+    writeJson(out, tickIntervalMs);
+
+    out << ",\"ticksStarted\":" << ticksStarted
+        << ",\"ordersPerTick\":";
+    writeJson(out, ordersPerTick);
+    out << ",\"ordersDropped\":" << ordersDropped
+        << ",\"ordersCoalesced\":" << ordersCoalesced
+        << ",\"ordersInvalid\":" << ordersInvalid
+        << ",\"desyncs\":" << desyncs
+        << ",\"shadowTickMs\":";
+    writeJson(out, shadowTickMs);
+
+    out << ",\"sent\":";
+    writeJson(out, sent);
+    out << ",\"received\":";
+    writeJson(out, received);
+}
+
+MetricsLog::MetricsLog(const std::string &path)
+    : file(path.c_str(), std::ios::app) {
+}
+
+void MetricsLog::write(const std::string &line) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Flushed right away, so that the file can be followed
+    file << line << std::endl;
+}
+
+void writeJson(std::ostream &out, const std::string &str) {
+    out << "\"";
+
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out << "\\" << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                << static_cast<int>(c) << std::dec << std::setfill(' ');
+        } else {
+            out << c;
+        }
+    }
+
+    out << "\"";
+}
+
+void writeJson(std::ostream &out, const Stats &stats) {
+    out << "{\"count\":" << stats.count
+        << ",\"mean\":" << stats.mean()
+        << ",\"min\":" << stats.min
+        << ",\"max\":" << stats.max
+        << ",\"stddev\":" << stats.stddev() << "}";
+}
+
+void writeJson(std::ostream &out, const MessageTraffic &traffic) {
+    out << "{";
+
+    for (size_t i = 0; i < Message::TYPE_MAX; i++) {
+        if (traffic.messages[i] == 0)
+            continue;
+
+        out << "\"" << Message::getTypeName(static_cast<Message::Type>(i))
+            << "\":{\"messages\":" << traffic.messages[i]
+            << ",\"bytes\":" << traffic.bytes[i]
+            << ",\"timeMs\":" << traffic.time[i] * 1000.0 << "},";
+    }
+
+    out << "\"orders\":{";
+
+    const OrderTraffic &orders(traffic.orders);
+    bool first = true;
+    for (size_t i = 0; i < Order::TYPE_MAX; i++) {
+        if (orders.orders[i] == 0)
+            continue;
+
+        if (!first)
+            out << ",";
+        first = false;
+
+        out << "\"" << Order::getTypeName(static_cast<Order::Type>(i))
+            << "\":{\"orders\":" << orders.orders[i]
+            << ",\"bits\":" << orders.bits[i] << "}";
+    }
+
+    out << "}}";
+}
+
+double metricsTime() {
+    return std::chrono::duration<double>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,87 @@
+#ifndef STRAT_SERVER_METRICS_HH
+#define STRAT_SERVER_METRICS_HH
+
+#include "common/Message.hh"
+#include "common/Traffic.hh"
+
+#include <enet/enet.h>
+
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+// Summary of a series of samples, e.g. tick intervals in milliseconds
+struct Stats {
+    size_t count;
+    double sum;
+    double sumSquares;
+    double min;
+    double max;
+
+    Stats() { reset(); }
+
+    void add(double value);
+    void reset();
+
+    double mean() const;
+    double stddev() const;
+};
+
+// Counters of a match that are reset after every metrics snapshot
+struct MatchMetrics {
+    // Time between ticks becoming due and the server getting around to
+    // starting them, and between successive tick starts
+    Stats tickLateMs;
+    Stats tickIntervalMs;
+
+    size_t ticksStarted;
+    Stats ordersPerTick;
+    size_t ordersDropped;
+    size_t ordersCoalesced;
+
+    // With a shadow simulation: orders removed from the ticks since they
+    // had no effect, clients that disagreed with the server's state, and
+    // the time for running the ticks
+    size_t ordersInvalid;
+    size_t desyncs;
+    Stats shadowTickMs;
+
+    // Packets shared by several peers count once per peer, except for
+    // the time spent encoding them. Messages over loopback connections
+    // are not encoded and count neither bytes nor orders.
+    MessageTraffic sent;
+    MessageTraffic received;
+
+    MatchMetrics() { reset(); }
+
+    void reset();
+
+    // Writes the counters as members of a JSON object
+    void write(std::ostream &) const;
+};
+
+// Periodic snapshots of the server's health, written as one JSON object
+// per line to a file. Shared by the worker threads.
+struct MetricsLog {
+    MetricsLog(const std::string &path);
+
+    bool isOpen() const { return file.is_open(); }
+
+    void write(const std::string &line);
+
+private:
+    std::mutex mutex;
+    std::ofstream file;
+};
+
+void writeJson(std::ostream &, const std::string &);
+void writeJson(std::ostream &, const Stats &);
+
+// By message type, with the orders of all messages in "orders"
+void writeJson(std::ostream &, const MessageTraffic &);
+
+// Seconds since the epoch, for the "time" member of snapshots
+double metricsTime();
+
+#endif
@@ -1,235 +1,87 @@
+#include "Worker.hh"
+#include "common/BitStream.hh"
+#include "common/CustomMap.hh"
+#include "common/ENetPool.hh"
+
 #include <enet/enet.h>
 
 #include <algorithm>
 #include <iostream>
-#include <cassert>
-#include <ctime>
+#include <cstdlib>
+#include <thread>
 #include <vector>
 
-#include "common/Message.hh"
-#include "common/GameSettings.hh"
-#include "common/BitStream.hh"
-
-struct ClientInfo {
-    ENetPeer *peer;
-
-    size_t ticksDone;
-
-    PlayerInfo player;
-
-    ClientInfo(PlayerId id, ENetPeer *peer)
-        : peer(peer), ticksDone(0), player() {
-        player.id = id;
+int main(int argc, char *argv[]) {
+    if (initializeENetWithPool() != 0) {
+        std::cerr << "Failed to initialize ENet" << std::endl;
+        return 1;
     }
-};
-
-GameSettings settings;
-
-ENetHost *server = NULL;
-bool gameStarted = false;
-
-PlayerId playerCounter = 0;
-std::vector<ClientInfo *> clients;
-
-size_t ticksStarted = 0;
-std::vector<Order> nextOrders;
-
-void sendMessage(ClientInfo *client, const Message &message) {
-    assert(client && client->peer);
-
-    ENetPacket *packet = message.toPacket();
-    enet_peer_send(client->peer, 0, packet);
-}
-
-void broadcast(const Message &message) {
-    for (auto client : clients)
-        sendMessage(client, message);
-}
-
-void startTick() {
-    assert(gameStarted);
-    for (auto client : clients) {
-        assert(client->ticksDone <= ticksStarted);
-        assert(ticksStarted - client->ticksDone <= 2);
 
-        //std::cout << "Client at " << client->ticksDone << std::endl;
+    ServerConfig config;
+
+    // Usage: server [port] [workers] [players per match] [metrics file]
+    //               [shadow simulation] [heightmap.pgm] [water.pgm]
+    //
+    // Worker i listens on port + i and is the lobby for the peers that
+    // connect there. There is no lobby shared by the workers, so clients
+    // are spread over them by connecting to different ports, e.g. by a
+    // load balancer in front of the server.
+    if (argc > 1) config.port = static_cast<enet_uint16>(atoi(argv[1]));
+    if (argc > 2) config.numWorkers = std::max(atoi(argv[2]), 1);
+    if (argc > 3) config.playersPerMatch = std::max(atoi(argv[3]), 1);
+    if (argc > 4) config.metricsPath = argv[4];
+    if (argc > 5) config.shadowSim = atoi(argv[5]) != 0;
+
+    if (argc > 6) {
+        CustomMap map;
+        if (!map.load(argv[6], argc > 7 ? argv[7] : "",
+                      config.settings.heightLimit))
+            return 1;
+
+        BitStreamWriter writer;
+        write(writer, map);
+        config.customMap.assign(writer.ptr(), writer.ptr() + writer.size());
+
+        config.settings.mapW = map.sizeX;
+        config.settings.mapH = map.sizeY;
+
+        std::cout << "Custom map of " << map.sizeX << "x" << map.sizeY
+                  << " points (" << config.customMap.size() << " bytes)"
+                  << std::endl;
     }
 
-    //std::cout << "Starting tick " << ticksStarted + 1 << std::endl;
-
-    Message message(Message::SERVER_TICK);
-    message.server_tick.orders = nextOrders;
-    broadcast(message);
-
-    ticksStarted++;
-    nextOrders.clear();
-
-    /*for (auto client : clients)
-        client->ticksDone = false;*/
-}
-
-void startGame() {
-    std::cout << "All players connected; starting game" << std::endl;
-
-    assert(!gameStarted);
+    MetricsLog *metricsLog = NULL;
+    if (!config.metricsPath.empty()) {
+        metricsLog = new MetricsLog(config.metricsPath);
 
-    // Store player infos in the GameSettings, 
-    // and then broadcast it to the clients
-    assert(settings.players.empty());
-    for (auto client : clients)
-        settings.players.push_back(client->player);
-
-    Message message(Message::SERVER_START);
-    message.server_start.settings = settings;
-    broadcast(message);
-
-    gameStarted = true;
-}
-
-void handleMessage(ClientInfo *client, const Message &message) {
-    switch (message.type) {
-    case Message::CLIENT_CONNECT: {
-        client->player.name = message.client_connect.name;
-
-        Message message(Message::SERVER_CONNECT);
-        message.server_connect.yourPlayerId = client->player.id;
-        sendMessage(client, message);
-        return;
-    }
-    case Message::CLIENT_ORDER: {
-        if (!gameStarted) {
-            std::cout << "Ignoring order from player " << client->player.id << std::endl;
-            return;
+        if (!metricsLog->isOpen()) {
+            std::cerr << "Failed to open " << config.metricsPath << std::endl;
+            return 1;
         }
-
-        nextOrders.push_back(message.client_order.order);
-        nextOrders.back().player = client->player.id;
-
-        return;
     }
-    case Message::CLIENT_TICK_DONE:
-        client->ticksDone++;
-        assert(client->ticksDone <= ticksStarted);
-        return;
 
-    default:
-        return;
-    }
-}
-
-int main() {
-    if (enet_initialize() != 0) {
-        std::cerr << "Failed to initialize ENet" << std::endl;    
-        return 1;
-    }
-
-    settings.randomSeed = static_cast<uint32_t>(time(NULL));
-    settings.mapW = 256;
-    settings.mapH = 256;
-    settings.heightLimit = 8;
-    settings.tickLengthMs = 50;
-
-    // Wait for this number of players before starting the game
-    size_t numWaitPlayers = 1;
-
-    ENetAddress address;
-    address.host = ENET_HOST_ANY;
-    address.port = 1234;
+    std::vector<Worker *> workers;
+    for (size_t i = 0; i < config.numWorkers; i++) {
+        workers.push_back(new Worker(config, i, metricsLog));
 
-    server = enet_host_create(&address, 32, 2, 0, 0);
-
-    if (server == NULL) {
-        std::cerr << "Failed to create host." << std::endl;
-        return 1;
+        if (!workers.back()->init())
+            return 1;
     }
 
     std::cout << "Server started" << std::endl;
 
-    bool quit = false;
-    while (!quit) {
-        if (!gameStarted && clients.size() == numWaitPlayers) {
-            startGame();
-            startTick();
-            startTick();
-        }
-
-        if (gameStarted) {
-            assert(ticksStarted >= 2);
-
-            bool prevTickDone = true;
-            for (auto client : clients) {
-                assert(client->ticksDone <= ticksStarted);
-
-                prevTickDone = prevTickDone && (client->ticksDone >= ticksStarted - 1);
-            }
-
-            if (prevTickDone)
-                startTick();
-        }
+    std::vector<std::thread> threads;
+    for (auto worker : workers)
+        threads.push_back(std::thread(&Worker::run, worker));
 
-        ENetEvent event;
+    for (auto &thread : threads)
+        thread.join();
 
-        while (enet_host_service(server, &event, 0) > 0) {
-            switch (event.type) {
-            case ENET_EVENT_TYPE_CONNECT: {
-                std::cout << "A new client connected" << std::endl;
+    for (auto worker : workers)
+        delete worker;
 
-                if (gameStarted) {
-                    std::cout << "Rejecting client since game has started" << std::endl;
-                    enet_peer_reset(event.peer);
-                    // TODO: Cleanup ENet stuff?
-                    break;
-                }
-
-                ClientInfo *client = new ClientInfo(++playerCounter, event.peer);
-                client->player.color = playerCounter % 4;
-                client->player.team = playerCounter;
-
-                event.peer->data = client;
-
-                clients.push_back(client);
-
-                break;
-            }
-            case ENET_EVENT_TYPE_RECEIVE: {
-                ClientInfo *client = static_cast<ClientInfo *>(event.peer->data);
-
-                BitStreamReader reader(event.packet->data, event.packet->dataLength);
-
-                Message::Type messageType;
-                read(reader, messageType);
-                Message message(messageType);
-                read(reader, message);
-
-                handleMessage(client, message);
-
-                enet_packet_destroy(event.packet);
-                break;
-            }
-            case ENET_EVENT_TYPE_DISCONNECT: {
-                ClientInfo *client = static_cast<ClientInfo *>(event.peer->data);
-                std::cout << "Player " << client->player.id << " disconnected" << std::endl;
-
-                auto position = std::find(clients.begin(), clients.end(), client);
-                assert(position != clients.end());
-                clients.erase(position);
-
-                delete client;
-
-                if (clients.empty()) {
-                    std::cout << "All players disconnected" << std::endl;
-                    quit = true;
-                }
-
-                break;
-            }
-
-            default: assert(false);
-            }
-        }
-    }
+    delete metricsLog;
 
-    enet_host_destroy(server);
     enet_deinitialize();
 
     return 0;
@@ -0,0 +1,357 @@
+#include "Worker.hh"
+
+#include "common/ENetPool.hh"
+#include "util/Profiling.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+#include <ctime>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
+
+// How often a worker with an ENetHost checks its loopback connections
+static const std::chrono::milliseconds LOOPBACK_POLL_INTERVAL(1);
+
+static std::atomic<size_t> matchCounter(0);
+
+ServerConfig::ServerConfig()
+    : port(1234),
+      numWorkers(1),
+      maxPeers(32),
+      playersPerMatch(1),
+      shadowSim(false),
+      metricsInterval(std::chrono::seconds(5)) {
+    settings.mapW = 256;
+    settings.mapH = 256;
+    settings.heightLimit = 8;
+    settings.tickLengthMs = 50;
+}
+
+Worker::Worker(const ServerConfig &config, size_t index,
+               MetricsLog *metricsLog)
+    : config(config), index(index), host(NULL), stopped(false),
+      openMatch(NULL), metricsLog(metricsLog) {
+}
+
+Worker::~Worker() {
+    for (auto match : matches)
+        delete match;
+
+    for (auto loopback : loopbacks)
+        delete loopback;
+
+    if (host) {
+        for (size_t i = 0; i < host->peerCount; i++)
+            delete static_cast<ENetConnection *>(host->peers[i].data);
+
+        enet_host_destroy(host);
+    }
+}
+
+// entityx numbers the component and event types when they are first
+// used, which is not thread-safe, so that happens before there are
+// several threads running simulations
+static void warmUpSim() {
+    static bool done = false;
+    if (done)
+        return;
+    done = true;
+
+    GameSettings settings;
+    settings.randomSeed = 0;
+    settings.mapW = 64;
+    settings.mapH = 64;
+    settings.heightLimit = 8;
+    settings.tickLengthMs = 50;
+
+    PlayerInfo player;
+    player.id = 1;
+    player.team = 1;
+    player.color = 0;
+    settings.players.push_back(player);
+
+    // Outside of the map, so that it only gets as far as the events
+    Order order;
+    order.type = Order::RAISE_MAP;
+    order.player = player.id;
+    order.raiseMap.x = order.raiseMap.y = static_cast<uint16_t>(settings.mapW);
+    order.raiseMap.w = order.raiseMap.h = 1;
+
+    Sim sim(settings);
+    sim.runTick(std::vector<Order>(1, order));
+    sim.runTick(std::vector<Order>());
+}
+
+bool Worker::init() {
+    if (config.shadowSim)
+        warmUpSim();
+
+    if (config.port == 0)
+        return true;
+
+    ENetAddress address;
+    address.host = ENET_HOST_ANY;
+    address.port = config.port + index;
+
+    host = enet_host_create(&address, config.maxPeers, NUM_CHANNELS, 0, 0);
+
+    if (host == NULL) {
+        std::cerr << "Failed to create host on port " << address.port
+                  << std::endl;
+        return false;
+    }
+
+    std::cout << "Worker " << index << " listening on port "
+              << address.port << std::endl;
+    return true;
+}
+
+void Worker::run() {
+    // The profiling data is shared by all threads, and belongs to the
+    // client if there is one in this process
+    ProfilingData::setThreadEnabled(false);
+
+    while (!stopped) {
+        // Find out how long we can sleep until some match needs to tick
+        Clock::time_point now = Clock::now();
+        Clock::time_point deadline = now + std::chrono::seconds(1);
+
+        for (auto match : matches)
+            deadline = std::min(deadline, match->update(now));
+
+        if (metricsLog) {
+            if (now >= nextMetricsTime) {
+                writeMetrics();
+                nextMetricsTime = now + config.metricsInterval;
+            }
+
+            deadline = std::min(deadline, nextMetricsTime);
+        }
+
+        removeFinishedMatches(now);
+
+        if (!host) {
+            loopbackHost.wait(deadline);
+            handleLoopbacks();
+            continue;
+        }
+
+        if (!loopbacks.empty())
+            deadline = std::min(deadline, now + LOOPBACK_POLL_INTERVAL);
+
+        enet_uint32 timeoutMs = enetTimeoutMs(deadline, Clock::now());
+
+        ENetEvent event;
+
+        int result = enet_host_service(host, &event, timeoutMs);
+        for (; result > 0; result = enet_host_service(host, &event, 0))
+            handleEvent(event);
+
+        handleLoopbacks();
+    }
+}
+
+void Worker::stop() {
+    stopped = true;
+    loopbackHost.wake();
+}
+
+void Worker::writeMetrics() {
+    double time = metricsTime();
+
+    if (host) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3)
+            << "{\"time\":" << time
+            << ",\"worker\":" << index
+            << ",\"matches\":" << matches.size()
+            << ",\"peers\":" << host->connectedPeers
+            << ",\"packetsSent\":" << host->totalSentPackets
+            << ",\"bytesSent\":" << host->totalSentData
+            << ",\"packetsReceived\":" << host->totalReceivedPackets
+            << ",\"bytesReceived\":" << host->totalReceivedData;
+
+        // The pools are shared by all workers
+        if (index == 0) {
+            ENetPoolStats pool = getENetPoolStats();
+            out << ",\"pool\":{\"pooled\":" << pool.pooled
+                << ",\"large\":" << pool.large
+                << ",\"inUse\":" << pool.inUse
+                << ",\"slabs\":" << pool.slabs
+                << ",\"bytesReserved\":" << pool.bytesReserved
+                << ",\"refills\":" << pool.refills
+                << ",\"flushes\":" << pool.flushes << "}";
+        }
+
+        out << "}";
+        metricsLog->write(out.str());
+
+        host->totalSentPackets = 0;
+        host->totalSentData = 0;
+        host->totalReceivedPackets = 0;
+        host->totalReceivedData = 0;
+    }
+
+    for (auto match : matches) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3)
+            << "{\"time\":" << time
+            << ",\"worker\":" << index << ",";
+        match->writeMetrics(out);
+        out << "}";
+        metricsLog->write(out.str());
+    }
+}
+
+Match *Worker::findOpenMatch() {
+    if (openMatch && openMatch->isOpen())
+        return openMatch;
+
+    GameSettings settings(config.settings);
+    settings.randomSeed = static_cast<uint32_t>(time(NULL)) + matchCounter;
+
+    openMatch = new Match(++matchCounter, settings, config.playersPerMatch,
+                          config.shadowSim,
+                          config.customMap.empty() ? NULL : &config.customMap);
+    matches.push_back(openMatch);
+
+    std::cout << "Worker " << index << ": created match "
+              << openMatch->getId() << std::endl;
+
+    return openMatch;
+}
+
+void Worker::connect(Connection *connection, enet_uint32 data) {
+    if (data & CONNECT_SPECTATE) {
+        spectateMatch(connection, data & ~CONNECT_SPECTATE);
+        return;
+    }
+
+    // Clients that lost their connection say which match they were in
+    if (data != 0) {
+        rejoinMatch(connection, data);
+        return;
+    }
+
+    findOpenMatch()->connect(connection);
+}
+
+void Worker::rejoinMatch(Connection *connection, size_t matchId) {
+    for (auto match : matches) {
+        if (match->getId() == matchId && match->canRejoin()) {
+            match->connect(connection);
+            return;
+        }
+    }
+
+    std::cout << "Worker " << index << ": can not rejoin match "
+              << matchId << std::endl;
+    connection->disconnect();
+}
+
+void Worker::spectateMatch(Connection *connection, size_t matchId) {
+    if (matchId == 0) {
+        findOpenMatch()->spectate(connection);
+        return;
+    }
+
+    for (auto match : matches) {
+        if (match->getId() == matchId && match->canSpectate()) {
+            match->spectate(connection);
+            return;
+        }
+    }
+
+    std::cout << "Worker " << index << ": can not spectate match "
+              << matchId << std::endl;
+    connection->disconnect();
+}
+
+void Worker::removeFinishedMatches(Clock::time_point now) {
+    for (size_t i = 0; i < matches.size();) {
+        if (matches[i]->isFinished(now)) {
+            std::cout << "Worker " << index << ": match "
+                      << matches[i]->getId() << " finished" << std::endl;
+
+            if (matches[i] == openMatch)
+                openMatch = NULL;
+
+            delete matches[i];
+            matches.erase(matches.begin() + i);
+        } else {
+            i++;
+        }
+    }
+}
+
+void Worker::handleEvent(ENetEvent &event) {
+    switch (event.type) {
+    case ENET_EVENT_TYPE_CONNECT:
+        connect(new ENetConnection(event.peer), event.data);
+        return;
+
+    case ENET_EVENT_TYPE_RECEIVE: {
+        ENetConnection *connection =
+            static_cast<ENetConnection *>(event.peer->data);
+
+        // Peers of deleted matches might still have something in flight
+        if (connection && connection->data) {
+            ClientInfo *client = static_cast<ClientInfo *>(connection->data);
+            client->match->receive(client, event.packet);
+        }
+
+        enet_packet_destroy(event.packet);
+        return;
+    }
+
+    case ENET_EVENT_TYPE_DISCONNECT: {
+        ENetConnection *connection =
+            static_cast<ENetConnection *>(event.peer->data);
+        if (!connection)
+            return;
+
+        if (connection->data) {
+            ClientInfo *client = static_cast<ClientInfo *>(connection->data);
+            client->match->disconnect(client);
+        }
+
+        delete connection;
+        return;
+    }
+
+    default: assert(false);
+    }
+}
+
+void Worker::handleLoopbacks() {
+    enet_uint32 data;
+    while (LoopbackConnection *connection = loopbackHost.accept(data)) {
+        loopbacks.push_back(connection);
+        connect(connection, data);
+    }
+
+    for (size_t i = 0; i < loopbacks.size();) {
+        LoopbackConnection *connection = loopbacks[i];
+
+        while (const Message *message = connection->receive()) {
+            ClientInfo *client = static_cast<ClientInfo *>(connection->data);
+
+            if (client)
+                client->match->receive(client, *message);
+        }
+
+        if (connection->isDisconnected()) {
+            ClientInfo *client = static_cast<ClientInfo *>(connection->data);
+
+            if (client)
+                client->match->disconnect(client);
+
+            delete connection;
+            loopbacks.erase(loopbacks.begin() + i);
+        } else {
+            i++;
+        }
+    }
+}
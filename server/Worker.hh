@@ -0,0 +1,109 @@
+#ifndef STRAT_SERVER_WORKER_HH
+#define STRAT_SERVER_WORKER_HH
+
+#include "Match.hh"
+#include "common/Loopback.hh"
+
+#include <enet/enet.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+struct ServerConfig {
+    ServerConfig();
+
+    // Worker i listens on port + i. With port zero, workers do not
+    // listen at all and only take loopback connections.
+    enet_uint16 port;
+    size_t numWorkers;
+
+    // Maximum number of peers per worker
+    size_t maxPeers;
+
+    // Wait for this number of players before starting a match
+    size_t playersPerMatch;
+
+    GameSettings settings;
+
+    // Whether matches run the game themselves, to remove invalid orders
+    // and to check the state of the clients (see Match)
+    bool shadowSim;
+
+    // Encoded custom map (see CustomMap) played in every match, unless
+    // empty. The settings have its size then.
+    std::vector<uint8_t> customMap;
+
+    // Metrics are written to this file periodically, if it is not empty
+    std::string metricsPath;
+    Clock::duration metricsInterval;
+};
+
+// A worker thread owns one ENetHost and all the matches of the peers
+// connected to it. It acts as a lobby for its host: new peers are put
+// into the worker's open match, and a new match is created once the
+// previous one is full.
+//
+// ENet peers belong to their host and hosts can not be shared between
+// threads, so a peer can not be handed to another worker. Rather than
+// have one thread do all the networking for the workers, or send peers
+// to another port after connecting, each worker is the lobby of its
+// own port, and peers pick their worker by the port they connect to.
+// Rejoining and spectating thus also go through the worker that has
+// the match.
+//
+// Clients in the same process can connect through the worker's loopback
+// host instead, e.g. for playing alone without a server process. While
+// there are loopback connections, a worker with an ENetHost checks them
+// every LOOPBACK_POLL_INTERVAL; a worker without one only waits for them.
+struct Worker {
+    Worker(const ServerConfig &config, size_t index, MetricsLog *metricsLog);
+    ~Worker();
+
+    // Called before any worker runs
+    bool init();
+
+    // Returns once stop has been called
+    void run();
+
+    // Can be called from any thread
+    void stop();
+
+    LoopbackHost &getLoopbackHost() { return loopbackHost; }
+
+private:
+    const ServerConfig &config;
+    size_t index;
+
+    ENetHost *host;
+
+    LoopbackHost loopbackHost;
+    std::vector<LoopbackConnection *> loopbacks;
+
+    std::atomic<bool> stopped;
+
+    std::vector<Match *> matches;
+    Match *openMatch;
+
+    MetricsLog *metricsLog;
+    Clock::time_point nextMetricsTime;
+
+    // Writes one line for the worker's host, with the traffic since the
+    // last time including ENet's overhead, and one line per match. The
+    // first worker also reports the ENet memory pools.
+    void writeMetrics();
+
+    Match *findOpenMatch();
+
+    // Puts the connection into a match, depending on its connect data
+    void connect(Connection *, enet_uint32 data);
+    void rejoinMatch(Connection *, size_t matchId);
+    void spectateMatch(Connection *, size_t matchId);
+
+    void removeFinishedMatches(Clock::time_point now);
+
+    void handleEvent(ENetEvent &event);
+    void handleLoopbacks();
+};
+
+#endif
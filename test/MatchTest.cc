@@ -0,0 +1,265 @@
+// Checks which orders a match merges before broadcasting them, and that
+// the last player can come back to a match. A client plays a match over
+// a loopback connection.
+
+#include "server/Match.hh"
+#include "common/BitStream.hh"
+#include "common/Loopback.hh"
+#include "test/Test.hh"
+
+#include <algorithm>
+#include <map>
+#include <thread>
+
+static Order construct(ObjectId from, ObjectId to, uint16_t queue) {
+    Order order(Order::CONSTRUCT);
+    order.construct.from = from;
+    order.construct.to = to;
+    order.construct.queue = queue;
+    return order;
+}
+
+static Order raiseMap(uint16_t x, uint16_t y) {
+    Order order(Order::RAISE_MAP);
+    order.raiseMap.x = x;
+    order.raiseMap.y = y;
+    order.raiseMap.w = 2;
+    order.raiseMap.h = 2;
+    return order;
+}
+
+static GameSettings testSettings() {
+    GameSettings settings;
+    settings.randomSeed = 0;
+    settings.mapW = 64;
+    settings.mapH = 64;
+    settings.heightLimit = 8;
+    settings.tickLengthMs = 10;
+    return settings;
+}
+
+// Connects a client to the match and says hello. Returns the client's
+// end; the match's end is in server.
+static LoopbackConnection *connect(Match &match, LoopbackHost &host,
+                                   LoopbackConnection *&server) {
+    LoopbackConnection *client = host.connect(0);
+
+    enet_uint32 data;
+    server = host.accept(data);
+    match.connect(server);
+
+    Message connect(Message::CLIENT_CONNECT);
+    connect.client_connect.name = "test";
+    OutgoingMessage outgoing(connect, CHANNEL_RELIABLE);
+    client->send(outgoing);
+
+    return client;
+}
+
+static void update(Match &match, LoopbackConnection *server) {
+    match.update(Clock::now());
+
+    while (const Message *message = server->receive())
+        match.receive(static_cast<ClientInfo *>(server->data), *message);
+}
+
+// Sends the orders once the player has saved up enough order tokens, and
+// returns the orders of the tick that they end up in
+static std::vector<Order> runTick(const std::vector<Order> &orders) {
+    Match *match = new Match(1, testSettings(), 1);
+
+    LoopbackHost host;
+    LoopbackConnection *server;
+    LoopbackConnection *client = connect(*match, host, server);
+
+    // Ticks are repeated until they are acknowledged, so they are
+    // collected by number
+    std::map<size_t, std::vector<Order>> ticks;
+    size_t ticksReceived = 0;
+    bool ordersSent = false;
+
+    std::vector<Order> result;
+
+    Clock::time_point end = Clock::now() + std::chrono::seconds(5);
+    while (result.empty() && Clock::now() < end) {
+        update(*match, server);
+
+        while (const Message *message = client->receive()) {
+            if (message->type != Message::SERVER_TICK)
+                continue;
+
+            size_t tick = message->server_tick.firstTick;
+            for (auto &range : message->server_tick.ranges) {
+                ticks[tick] = range.orders;
+                tick += range.numTicks;
+            }
+
+            ticksReceived = std::max(ticksReceived, tick);
+        }
+
+        if (!ordersSent && ticksReceived >= 2 * orders.size()) {
+            for (auto &order : orders) {
+                Message message(Message::CLIENT_ORDER);
+                message.client_order.order = order;
+                OutgoingMessage outgoing(message, CHANNEL_RELIABLE);
+                client->send(outgoing);
+            }
+
+            ordersSent = true;
+        }
+
+        for (auto &tick : ticks) {
+            if (!tick.second.empty())
+                result = tick.second;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    delete match;
+    delete server;
+    delete client;
+
+    return result;
+}
+
+static size_t count(const std::vector<Order> &orders, const Order &order) {
+    size_t n = 0;
+    for (auto &other : orders) {
+        if (other.type != order.type)
+            continue;
+
+        if (order.type == Order::CONSTRUCT &&
+            other.construct.from == order.construct.from &&
+            other.construct.to == order.construct.to &&
+            other.construct.queue == order.construct.queue)
+            n++;
+
+        if (order.type == Order::RAISE_MAP &&
+            other.raiseMap.x == order.raiseMap.x &&
+            other.raiseMap.y == order.raiseMap.y)
+            n++;
+    }
+    return n;
+}
+
+// The only player of a match leaves and connects again. With a shadow
+// simulation, it is sent the server's snapshot and continues; without
+// one, the match is over.
+static void testRejoinLastPlayer(bool shadowSim) {
+    std::string what = shadowSim ? " with a shadow" : " without a shadow";
+
+    Match match(1, testSettings(), 1, shadowSim);
+    LoopbackHost host;
+
+    LoopbackConnection *server;
+    LoopbackConnection *client = connect(match, host, server);
+
+    size_t ticksReceived = 0;
+    Clock::time_point end = Clock::now() + std::chrono::seconds(5);
+    while (ticksReceived < 20 && Clock::now() < end) {
+        update(match, server);
+
+        while (const Message *message = client->receive()) {
+            if (message->type != Message::SERVER_TICK)
+                continue;
+
+            size_t tick = message->server_tick.firstTick;
+            for (auto &range : message->server_tick.ranges)
+                tick += range.numTicks;
+            ticksReceived = std::max(ticksReceived, tick);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    check(ticksReceived >= 20, "game runs" + what);
+
+    match.disconnect(static_cast<ClientInfo *>(server->data));
+    delete server;
+    delete client;
+
+    Clock::time_point now = Clock::now();
+    check(match.isFinished(now) == !shadowSim,
+          "empty match is finished only without a shadow");
+    check(match.canRejoin() == shadowSim,
+          "last player can rejoin only with a shadow");
+    if (!shadowSim)
+        return;
+
+    check(match.isFinished(now + std::chrono::minutes(5)),
+          "empty match is finished after a while");
+
+    // The clock stops while no one is there, so no ticks are missed
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    client = connect(match, host, server);
+
+    GameSettings settings;
+    bool started = false;
+    size_t snapshotTick = 0;
+    std::vector<uint8_t> snapshot;
+    bool ticksAfterSnapshot = false;
+
+    end = Clock::now() + std::chrono::seconds(5);
+    while (!ticksAfterSnapshot && Clock::now() < end) {
+        update(match, server);
+
+        while (const Message *message = client->receive()) {
+            if (message->type == Message::SERVER_START) {
+                started = message->server_start.lateJoin != 0;
+                settings = message->server_start.settings;
+            } else if (message->type == Message::SERVER_SNAPSHOT) {
+                const Message::SnapshotChunk &chunk(message->server_snapshot);
+                snapshotTick = chunk.tick;
+                snapshot.insert(snapshot.end(), chunk.data.begin(),
+                                chunk.data.end());
+            } else if (message->type == Message::SERVER_TICK) {
+                ticksAfterSnapshot = !snapshot.empty()
+                    && message->server_tick.firstTick == snapshotTick;
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    check(started, "rejoining player is sent a late start");
+    check(!snapshot.empty(), "rejoining player is sent a snapshot");
+    check(ticksAfterSnapshot, "rejoining player is sent the next ticks");
+    check(snapshotTick < ticksReceived + 30,
+          "no ticks were started while no one was there");
+
+    if (!snapshot.empty()) {
+        BitStreamReader reader(snapshot);
+        Sim sim(settings, reader);
+        check(!reader.hasFailed(), "snapshot can be restored");
+    }
+
+    match.disconnect(static_cast<ClientInfo *>(server->data));
+    delete server;
+    delete client;
+}
+
+int main() {
+    Order queued = construct(1, 2, 1);
+    Order replacing = construct(3, 4, 0);
+    Order raised = raiseMap(10, 10);
+    Order overlapping = raiseMap(11, 11);
+
+    std::vector<Order> tick = runTick({
+        queued, queued,
+        replacing, replacing,
+        raised, raised, overlapping
+    });
+
+    check(!tick.empty(), "orders arrive in a tick");
+    check(count(tick, queued) == 2, "queued builds are all kept");
+    check(count(tick, replacing) == 1, "repeated build is merged");
+    check(count(tick, raised) == 1, "repeated raise is merged");
+    check(count(tick, overlapping) == 1, "overlapping raise is kept");
+
+    testRejoinLastPlayer(false);
+    testRejoinLastPlayer(true);
+
+    return finishTests();
+}
@@ -0,0 +1,118 @@
+// Checks that malformed messages are rejected without reading out of
+// bounds. Run with ASan to catch reads past the end of the packet; in
+// default builds, such reads hit the assertions in BitStreamReader.
+
+#include "common/BitStream.hh"
+#include "common/Message.hh"
+#include "common/OrderCodec.hh"
+#include "test/Test.hh"
+
+static std::vector<uint8_t> varint(uint64_t value) {
+    BitStreamWriter writer;
+    writer.writeVarUint(value);
+    return std::vector<uint8_t>(writer.ptr(), writer.ptr() + writer.size());
+}
+
+static bool readsVarUint(const std::vector<uint8_t> &data, size_t valueBits,
+                         uint64_t expected) {
+    BitStreamReader reader(data);
+    uint64_t value = reader.readVarUint(valueBits);
+    return !reader.hasFailed() && value == expected && reader.eof();
+}
+
+static bool rejectsVarUint(const std::vector<uint8_t> &data,
+                           size_t valueBits) {
+    BitStreamReader reader(data);
+    reader.readVarUint(valueBits);
+    return reader.hasFailed() && reader.position() <= (valueBits + 6) / 7;
+}
+
+static void testVarints() {
+    check(readsVarUint(varint(0), 8, 0), "zero");
+    check(readsVarUint(varint(255), 8, 255), "largest uint8_t");
+    check(readsVarUint(varint(0xffffffff), 32, 0xffffffff),
+          "largest uint32_t");
+    check(readsVarUint(varint(UINT64_MAX), 64, UINT64_MAX),
+          "largest uint64_t");
+
+    check(rejectsVarUint(varint(256), 8), "uint8_t too large");
+    check(rejectsVarUint(varint(0x100000000), 32), "uint32_t too large");
+    check(rejectsVarUint({ 0x80, 0x00 }, 8), "zero padding");
+    check(rejectsVarUint(std::vector<uint8_t>(5, 0xff), 32),
+          "continued uint32_t");
+    check(rejectsVarUint(std::vector<uint8_t>(16, 0xff), 64),
+          "continued uint64_t");
+
+    BitStreamWriter writer;
+    writer.writeVarInt(-32768);
+    BitStreamReader reader(writer.ptr(), writer.size());
+    check(reader.readVarInt(16) == -32768 && !reader.hasFailed(),
+          "smallest int16_t");
+}
+
+// Every message type followed by continued varints, cut off at every
+// length, with and without order delta compression
+static void testOverlongMessages() {
+    MessagePool pool;
+
+    for (size_t i = Message::CLIENT_CONNECT; i < Message::TYPE_MAX; i++) {
+        Message::Type type = static_cast<Message::Type>(i);
+
+        for (size_t length = 0; length <= 24; length++) {
+            for (size_t delta = 0; delta < 2; delta++) {
+                std::vector<uint8_t> data(varint(type));
+                data.resize(data.size() + length, 0xff);
+
+                OrderCodec codec;
+                BitStreamReader reader(data);
+                if (delta)
+                    reader.setOrderCodec(&codec);
+
+                const Message *message = pool.decode(reader);
+
+                std::string what = std::string(Message::getTypeName(type))
+                    + " with " + std::to_string(length) + " overlong bytes"
+                    + (delta ? " (delta)" : "");
+
+                // Reading a whole varint or vector length of 0xff bytes
+                // never succeeds
+                check(message == NULL, what + " is rejected");
+                check(reader.position() <= data.size(),
+                      what + " is read within bounds");
+            }
+        }
+    }
+}
+
+// Map parts decode into the same message every time, so a short part
+// after a long one must not keep the old data
+static void testMapChunks() {
+    MessagePool pool;
+
+    for (size_t size : { 300, 0, 5 }) {
+        Message message(Message::SERVER_MAP);
+        message.server_map.size = 1000;
+        message.server_map.offset = 7;
+        for (size_t i = 0; i < size; i++)
+            message.server_map.data.push_back(static_cast<uint8_t>(i));
+
+        BitStreamWriter writer;
+        write(writer, message);
+        BitStreamReader reader(writer.ptr(), writer.size());
+        const Message *decoded = pool.decode(reader);
+
+        std::string what = "map part of " + std::to_string(size) + " bytes";
+        check(decoded != NULL && reader.eof(), what + " is decoded");
+        check(decoded && decoded->server_map.offset == 7
+              && decoded->server_map.data == message.server_map.data,
+              what + " is decoded as sent");
+    }
+}
+
+int main() {
+    testVarints();
+    testOverlongMessages();
+    testMapChunks();
+
+    return finishTests();
+}
@@ -0,0 +1,75 @@
+// Checks that restoring a snapshot into a running Sim leaves no grid
+// point referring to an entity from before. The snapshot comes from a
+// game with another seed, so that buildings and trees stand elsewhere.
+
+#include "game/Sim.hh"
+#include "common/BitStream.hh"
+#include "test/Test.hh"
+
+static GameSettings settings(uint32_t randomSeed) {
+    GameSettings settings;
+    settings.randomSeed = randomSeed;
+    settings.mapW = 64;
+    settings.mapH = 64;
+    settings.heightLimit = 8;
+    settings.tickLengthMs = 50;
+
+    for (PlayerId id = 1; id <= 2; id++) {
+        PlayerInfo player;
+        player.id = id;
+        player.name = "player" + std::to_string(id);
+        player.team = id;
+        player.color = id;
+        settings.players.push_back(player);
+    }
+
+    return settings;
+}
+
+// Returns 0 for no entity, and an id that is never used for an entity
+// that is not a game object
+static ObjectId objectAt(const Sim &sim, size_t x, size_t y) {
+    entityx::Entity entity = sim.getState().getMap().point(x, y).entity;
+    if (!entity)
+        return 0;
+
+    auto object = entity.component<const GameObject>();
+    return object ? object->getId() : ~static_cast<ObjectId>(0);
+}
+
+static void testRestoredGrid() {
+    GameSettings settingsA = settings(1), settingsB = settings(2);
+    Sim a(settingsA), b(settingsB);
+
+    std::vector<Order> noOrders;
+    for (size_t i = 0; i < 20; i++) {
+        a.runTick(noOrders);
+        b.runTick(noOrders);
+    }
+
+    BitStreamWriter writer;
+    b.writeSnapshot(writer);
+    BitStreamReader reader(writer.ptr(), writer.size());
+    a.restoreSnapshot(reader);
+    check(!reader.hasFailed(), "snapshot is restored");
+
+    size_t numMismatched = 0, numObjects = 0;
+    for (size_t x = 0; x < settingsA.mapW; x++) {
+        for (size_t y = 0; y < settingsA.mapH; y++) {
+            if (objectAt(a, x, y) != objectAt(b, x, y))
+                numMismatched++;
+            if (objectAt(b, x, y))
+                numObjects++;
+        }
+    }
+
+    check(numObjects > 0, "the grid has objects");
+    check(numMismatched == 0, "grid points refer to the restored objects");
+    check(a.hashState() == b.hashState(), "restored state matches");
+}
+
+int main() {
+    testRestoredGrid();
+
+    return finishTests();
+}
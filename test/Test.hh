@@ -0,0 +1,30 @@
+#ifndef STRAT_TEST_TEST_HH
+#define STRAT_TEST_TEST_HH
+
+#include <iostream>
+#include <string>
+
+// Every test program is a single source file whose main runs the checks
+// and returns finishTests().
+
+static size_t numFailures = 0;
+
+static void check(bool condition, const std::string &what) {
+    if (!condition) {
+        std::cout << "FAILED: " << what << std::endl;
+        numFailures++;
+    }
+}
+
+// Prints the outcome of the checks and returns the exit status
+static int finishTests() {
+    if (numFailures > 0) {
+        std::cout << numFailures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
+
+#endif
@@ -2,9 +2,19 @@
 
 #include <sstream>
 #include <algorithm>
+#include <chrono>
+#include <cassert>
 
 #include "util/Log.hh"
 
+// Not using glfwGetTime, so that the simulation can run without GLFW,
+// e.g. in the bot
+static double getTime() {
+    typedef std::chrono::steady_clock Clock;
+    return std::chrono::duration<double>(
+        Clock::now().time_since_epoch()).count();
+}
+
 ProfilingData::ProfilingData(char const* name)
     : name(name), numCalls(0), time(0), parent(current), isRoot(!current) {
     if (!current)
@@ -54,11 +64,21 @@ void ProfilingData::dump() {
     reset();
 }
 
+void ProfilingData::setThreadEnabled(bool enabled) {
+    threadEnabled = enabled;
+}
+
 std::vector<ProfilingData*> ProfilingData::roots;
 ProfilingData* ProfilingData::current = nullptr;
+thread_local bool ProfilingData::threadEnabled = true;
+
+ProfilingImpl::ProfilingImpl(ProfilingData* data)
+    : data(data), startTime(0) {
+    if (!data)
+        return;
+
+    startTime = getTime();
 
-ProfilingImpl::ProfilingImpl(ProfilingData& data)
-    : data(data), startTime(glfwGetTime()) {
     /*if (ProfilingData::current != data.parent)
         WARN(profiling) << "Inconsistent profiling calls: " 
             << data.name << " was called first from "
@@ -67,22 +87,25 @@ ProfilingImpl::ProfilingImpl(ProfilingData& data)
             << (ProfilingData::current ?
                 ProfilingData::current->name : "<root>");*/
 
-    if (ProfilingData::current && data.isRoot) {
-        auto it = std::find(ProfilingData::roots.begin(), ProfilingData::roots.end(), &data);
+    if (ProfilingData::current && data->isRoot) {
+        auto it = std::find(ProfilingData::roots.begin(), ProfilingData::roots.end(), data);
         assert(it != ProfilingData::roots.end());
         ProfilingData::roots.erase(it);
 
-        ProfilingData::current->children.push_back(&data);
+        ProfilingData::current->children.push_back(data);
 
-        data.isRoot = false;
+        data->isRoot = false;
     }
 
-    ProfilingData::current = &data;
+    ProfilingData::current = data;
 }
 
 ProfilingImpl::~ProfilingImpl() {
-    data.numCalls++;
-    data.time += glfwGetTime() - startTime;
+    if (!data)
+        return;
+
+    data->numCalls++;
+    data->time += getTime() - startTime;
 
-    ProfilingData::current = data.parent;
+    ProfilingData::current = data->parent;
 }
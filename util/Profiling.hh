@@ -1,15 +1,18 @@
 #pragma once
 
-#include <GL/glew.h>
-#include <GLFW/glfw3.h>
-
 #include <vector>
 
 #define USE_PROFILING
 
+// The data of a block is only created and updated on threads that have
+// profiling enabled, since it is shared by all of them
 #ifdef USE_PROFILING
-#   define PROFILE(name) static ProfilingData _profilingData(#name); \
-        ProfilingImpl _profilingImpl(_profilingData)
+#   define PROFILE(name) ProfilingImpl _profilingImpl( \
+        ProfilingData::isThreadEnabled() ? \
+        &[]() -> ProfilingData & { \
+            static ProfilingData data(#name); \
+            return data; \
+        }() : nullptr)
 #else
 #   define PROFILE(name) do {} while(0)
 #endif
@@ -30,19 +33,26 @@ struct ProfilingData {
     static void reset();
     static void dump();
 
+    // Enabled by default. Threads other than the main one, e.g. servers
+    // running in the same process, should disable it.
+    static void setThreadEnabled(bool enabled);
+    static bool isThreadEnabled() { return threadEnabled; }
+
     static std::vector<ProfilingData*> roots;
 
 private:
     friend struct ProfilingImpl;
     static ProfilingData* current; // the block we are currently in
+
+    static thread_local bool threadEnabled;
 };
 
-// Updates given ProfilingData according to time elapsed
+// Updates given ProfilingData according to time elapsed, if any
 struct ProfilingImpl {
-    ProfilingImpl(ProfilingData&);
+    ProfilingImpl(ProfilingData*);
     ~ProfilingImpl();
 
 private:
-    ProfilingData& data;
+    ProfilingData* data;
     double startTime;
 };